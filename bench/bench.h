@@ -0,0 +1,51 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __BENCH_H__
+#define __BENCH_H__
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The little runtime the benchmark guests link against: hostapi calls
+ * through the stub rscv passes in a0, and just enough libc for the
+ * workloads.  Every workload checks its own result and returns non-zero
+ * from main when it is wrong, which becomes the rscv exit status.
+ */
+
+int host_write(int fd, const void *buf, unsigned size);
+void host_exit(int status) __attribute__((noreturn));
+
+void print(const char *s);
+void print_u32(uint32_t v);
+void print_hex(uint32_t v);
+
+/* never freed, the guests run once and exit */
+void *bench_alloc(size_t size);
+
+/* xorshift32, a reproducible input generator */
+static inline uint32_t bench_rand(uint32_t *seed)
+{
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *seed = x;
+}
+
+void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+void *memset(void *dst, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+size_t strlen(const char *s);
+char *strcpy(char *dst, const char *src);
+int strcmp(const char *a, const char *b);
+int strncmp(const char *a, const char *b, size_t n);
+void qsort(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *));
+
+/* report name and checksum, then main's return value: 0 when sum is expected */
+int bench_result(const char *name, uint32_t sum, uint32_t expected);
+
+#endif /* __BENCH_H__*/
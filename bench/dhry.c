@@ -0,0 +1,209 @@
+#include "bench.h"
+
+/* Dhrystone style: record copies through pointers, enum switches,
+ * short string copies and compares, and global array updates */
+
+#define RUNS	200000
+
+enum ident { IDENT_1, IDENT_2, IDENT_3, IDENT_4, IDENT_5 };
+
+struct record {
+	struct record *next;
+	enum ident discr;
+	enum ident enum_comp;
+	int int_comp;
+	char str_comp[31];
+};
+
+static struct record *glob, *next_glob;
+static int int_glob;
+static int bool_glob;
+static char char_1_glob, char_2_glob;
+static int arr_1_glob[50];
+static int arr_2_glob[50][50];
+
+static int func_3(enum ident e)
+{
+	return e == IDENT_3;
+}
+
+static enum ident func_1(char c1, char c2)
+{
+	if (c1 != c2)
+		return IDENT_1;
+	char_1_glob = c1;
+	return IDENT_2;
+}
+
+static int func_2(const char *s1, const char *s2)
+{
+	int i = 2;
+	char c = 0;
+
+	while (i <= 2) {
+		if (func_1(s1[i], s2[i + 1]) == IDENT_1) {
+			c = 'A';
+			i++;
+		}
+	}
+	if (c >= 'W' && c < 'Z')
+		i = 7;
+	if (c == 'R')
+		return 1;
+	if (strcmp(s1, s2) > 0) {
+		int_glob = i + 7;
+		return 1;
+	}
+	return 0;
+}
+
+static void proc_6(enum ident in, enum ident *out)
+{
+	*out = in;
+	if (!func_3(in))
+		*out = IDENT_4;
+	switch (in) {
+	case IDENT_1:
+		*out = IDENT_1;
+		break;
+	case IDENT_2:
+		*out = int_glob > 100 ? IDENT_1 : IDENT_4;
+		break;
+	case IDENT_3:
+		*out = IDENT_2;
+		break;
+	case IDENT_4:
+		break;
+	case IDENT_5:
+		*out = IDENT_3;
+		break;
+	}
+}
+
+static void proc_7(int a, int b, int *out)
+{
+	*out = b + a + 2;
+}
+
+static void proc_8(int *arr_1, int (*arr_2)[50], int a, int b)
+{
+	int i, loc = a + 5;
+
+	arr_1[loc] = b;
+	arr_1[loc + 1] = arr_1[loc];
+	arr_1[loc + 30] = loc;
+	for (i = loc; i <= loc + 1; i++)
+		arr_2[loc][i] = loc;
+	arr_2[loc][loc - 1] += 1;
+	arr_2[loc + 20][loc] = arr_1[loc];
+	int_glob = 5;
+}
+
+static void proc_3(struct record **out)
+{
+	if (glob != NULL)
+		*out = glob->next;
+	proc_7(10, int_glob, &glob->int_comp);
+}
+
+static void proc_1(struct record *in)
+{
+	struct record *next = in->next;
+
+	*in->next = *glob;
+	in->int_comp = 5;
+	next->int_comp = in->int_comp;
+	next->next = in->next;
+	proc_3(&next->next);
+	if (next->discr == IDENT_1) {
+		next->int_comp = 6;
+		proc_6(in->enum_comp, &next->enum_comp);
+		next->next = glob->next;
+		proc_7(next->int_comp, 10, &next->int_comp);
+	} else {
+		*in = *in->next;
+	}
+}
+
+static void proc_2(int *io)
+{
+	int loc = *io + 10;
+	enum ident e = IDENT_2;
+
+	for (;;) {
+		if (char_1_glob == 'A') {
+			loc -= 1;
+			*io = loc - int_glob;
+			e = IDENT_1;
+		}
+		if (e == IDENT_1)
+			break;
+	}
+}
+
+static void proc_4(void)
+{
+	int b = char_1_glob == 'A';
+
+	bool_glob = b | bool_glob;
+	char_2_glob = 'B';
+}
+
+static void proc_5(void)
+{
+	char_1_glob = 'A';
+	bool_glob = 0;
+}
+
+int main(void)
+{
+	static char str_1[31], str_2[31];
+	int int_1, int_2, int_3, run;
+	enum ident e;
+	uint32_t sum = 0;
+	char c;
+
+	next_glob = bench_alloc(sizeof(*next_glob));
+	glob = bench_alloc(sizeof(*glob));
+	glob->next = next_glob;
+	glob->discr = IDENT_1;
+	glob->enum_comp = IDENT_3;
+	glob->int_comp = 40;
+	strcpy(glob->str_comp, "DHRYSTONE PROGRAM, SOME STRING");
+	strcpy(str_1, "DHRYSTONE PROGRAM, 1'ST STRING");
+	arr_2_glob[8][7] = 10;
+
+	for (run = 1; run <= RUNS; run++) {
+		proc_5();
+		proc_4();
+		int_1 = 2;
+		int_2 = 3;
+		strcpy(str_2, "DHRYSTONE PROGRAM, 2'ND STRING");
+		e = IDENT_2;
+		bool_glob = !func_2(str_1, str_2);
+		while (int_1 < int_2) {
+			int_3 = 5 * int_1 - int_2;
+			proc_7(int_1, int_2, &int_3);
+			int_1++;
+		}
+		proc_8(arr_1_glob, arr_2_glob, int_1, int_3);
+		proc_1(glob);
+		for (c = 'A'; c <= char_2_glob; c++) {
+			if (e == func_1(c, 'C')) {
+				proc_6(IDENT_1, &e);
+				strcpy(str_2, "DHRYSTONE PROGRAM, 3'RD STRING");
+				int_2 = run;
+				int_glob = run;
+			}
+		}
+		int_2 = int_2 * int_1;
+		int_1 = int_2 / int_3;
+		int_2 = 7 * (int_2 - int_3) - int_1;
+		proc_2(&int_1);
+
+		sum = sum * 31 + int_1 + int_2 + int_3 + e + int_glob;
+	}
+
+	sum ^= arr_1_glob[8] + arr_2_glob[8][7] + glob->int_comp + next_glob->int_comp;
+	return bench_result("dhry", sum, 0xba942174);
+}
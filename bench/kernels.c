@@ -0,0 +1,181 @@
+#include "bench.h"
+
+/* CoreMark style: linked list search and reversal, a small matrix
+ * multiply, a scanner state machine, all folded into a crc16 */
+
+#define ITERATIONS	400
+#define LIST_SIZE	256
+#define MAT_N		16
+
+struct node {
+	struct node *next;
+	int16_t data;
+	int16_t idx;
+};
+
+static uint16_t crc16(uint16_t crc, uint16_t val)
+{
+	int i;
+
+	for (i = 0; i < 16; i++, val >>= 1) {
+		if ((crc ^ val) & 1)
+			crc = (crc >> 1) ^ 0xa001;
+		else
+			crc >>= 1;
+	}
+	return crc;
+}
+
+static struct node *list_reverse(struct node *list)
+{
+	struct node *prev = NULL, *next;
+
+	while (list) {
+		next = list->next;
+		list->next = prev;
+		prev = list;
+		list = next;
+	}
+	return prev;
+}
+
+static struct node *list_find(struct node *list, int16_t data)
+{
+	while (list && list->data != data)
+		list = list->next;
+	return list;
+}
+
+static uint16_t list_bench(struct node *list, uint16_t crc, int16_t seed)
+{
+	struct node *n;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		n = list_find(list, (seed + i * 7) & 0xff);
+		crc = crc16(crc, n ? n->idx : 0xffff);
+		list = list_reverse(list);
+	}
+	for (n = list; n; n = n->next)
+		n->data = (n->data * 5 + seed) & 0xff;
+	return crc;
+}
+
+static uint16_t matrix_bench(int16_t a[MAT_N][MAT_N], int16_t b[MAT_N][MAT_N],
+	int32_t c[MAT_N][MAT_N], uint16_t crc, int16_t seed)
+{
+	int i, j, k;
+	int32_t sum;
+
+	for (i = 0; i < MAT_N; i++) {
+		for (j = 0; j < MAT_N; j++) {
+			sum = 0;
+			for (k = 0; k < MAT_N; k++)
+				sum += a[i][k] * b[k][j];
+			c[i][j] = sum;
+		}
+	}
+	for (i = 0; i < MAT_N; i++) {
+		for (j = 0; j < MAT_N; j++) {
+			crc = crc16(crc, c[i][j] ^ (c[i][j] >> 16));
+			a[i][j] = (a[i][j] + seed + (c[i][j] & 7)) & 0x7ff;
+		}
+	}
+	return crc;
+}
+
+enum state { S_START, S_INT, S_FLOAT, S_EXP, S_SCI, S_INVALID, S_NR };
+
+/* classify comma separated tokens as integers, floats or scientific */
+static uint16_t state_bench(const char *s, uint16_t crc)
+{
+	unsigned count[S_NR] = { 0 };
+	enum state st;
+	int i;
+
+	while (*s) {
+		st = S_START;
+		for (; *s && *s != ','; s++) {
+			char ch = *s;
+			int digit = ch >= '0' && ch <= '9';
+
+			switch (st) {
+			case S_START:
+				st = digit || ch == '-' ? S_INT : ch == '.' ? S_FLOAT : S_INVALID;
+				break;
+			case S_INT:
+				st = digit ? S_INT : ch == '.' ? S_FLOAT : S_INVALID;
+				break;
+			case S_FLOAT:
+				st = digit ? S_FLOAT : ch == 'e' || ch == 'E' ? S_EXP : S_INVALID;
+				break;
+			case S_EXP:
+				st = digit || ch == '-' || ch == '+' ? S_SCI : S_INVALID;
+				break;
+			case S_SCI:
+				st = digit ? S_SCI : S_INVALID;
+				break;
+			default:
+				break;
+			}
+		}
+		count[st]++;
+		if (*s)
+			s++;
+	}
+
+	for (i = 0; i < S_NR; i++)
+		crc = crc16(crc, count[i]);
+	return crc;
+}
+
+int main(void)
+{
+	static const char *const tokens[] = {
+		"5012", "1234", "-874", "+122", "35.54", "0.0", ".1e-4",
+		"-110.7", "7.2e9", "T0.3e-1F", "-T.T++Tq", "1T3.4e4z", "34.0e-T^",
+	};
+	static int16_t a[MAT_N][MAT_N], b[MAT_N][MAT_N];
+	static int32_t c[MAT_N][MAT_N];
+	struct node *nodes, *list = NULL;
+	uint32_t seed = 0x12345678, sum;
+	uint16_t crc = 0;
+	char *input, *p;
+	unsigned n;
+	int i, j;
+
+	nodes = bench_alloc(LIST_SIZE * sizeof(*nodes));
+	for (i = 0; i < LIST_SIZE; i++) {
+		nodes[i].data = bench_rand(&seed) & 0xff;
+		nodes[i].idx = i;
+		nodes[i].next = list;
+		list = &nodes[i];
+	}
+
+	for (i = 0; i < MAT_N; i++) {
+		for (j = 0; j < MAT_N; j++) {
+			a[i][j] = bench_rand(&seed) & 0x7ff;
+			b[i][j] = bench_rand(&seed) & 0x7ff;
+		}
+	}
+
+	input = p = bench_alloc(2048);
+	for (i = 0; i < 160; i++) {
+		const char *t = tokens[bench_rand(&seed) % (sizeof(tokens) / sizeof(tokens[0]))];
+
+		n = strlen(t);
+		memcpy(p, t, n);
+		p += n;
+		*p++ = ',';
+	}
+	*p = '\0';
+
+	for (i = 0; i < ITERATIONS; i++) {
+		crc = list_bench(list, crc, i);
+		crc = matrix_bench(a, b, c, crc, i);
+		crc = state_bench(input, crc);
+	}
+
+	sum = crc;
+	return bench_result("kernels", sum, 0x0000a1dc);
+}
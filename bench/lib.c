@@ -0,0 +1,222 @@
+#include <hostapi.h>
+#include "bench.h"
+
+/* the hostapi stub address rscv passes in a0, saved by crt0.S */
+uintptr_t __hostapi;
+
+static int hostcall(int func, uintptr_t a1, uintptr_t a2, uintptr_t a3)
+{
+	return ((int (*)(int, uintptr_t, uintptr_t, uintptr_t))__hostapi)(func, a1, a2, a3);
+}
+
+int host_write(int fd, const void *buf, unsigned size)
+{
+	return hostcall(HOSTAPI_WRITE, fd, (uintptr_t)buf, size);
+}
+
+void host_exit(int status)
+{
+	for (;;)
+		hostcall(HOSTAPI_EXIT, status, 0, 0);
+}
+
+void print(const char *s)
+{
+	host_write(1, s, strlen(s));
+}
+
+void print_u32(uint32_t v)
+{
+	char buf[11], *p = buf + sizeof(buf);
+
+	*--p = '\0';
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	print(p);
+}
+
+void print_hex(uint32_t v)
+{
+	char buf[9];
+	int i;
+
+	for (i = 7; i >= 0; i--, v >>= 4)
+		buf[i] = "0123456789abcdef"[v & 15];
+	buf[8] = '\0';
+	print(buf);
+}
+
+int bench_result(const char *name, uint32_t sum, uint32_t expected)
+{
+	print(name);
+	print(": ");
+	print_hex(sum);
+	print(sum == expected ? " ok\n" : " WRONG\n");
+	return sum != expected;
+}
+
+void *bench_alloc(size_t size)
+{
+	extern char _end[];
+	static char *brk;
+	char *p;
+
+	/* rscv puts the hostapi stub right after the image */
+	if (brk == NULL)
+		brk = (char *)__hostapi > _end ? (char *)__hostapi + 8 : _end;
+	brk = (char *)(((uintptr_t)brk + 7) & ~(uintptr_t)7);
+	p = brk;
+	brk += size;
+	return p;
+}
+
+void *memcpy(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	if ((((uintptr_t)d | (uintptr_t)s) & 3) == 0) {
+		for (; n >= 4; n -= 4, d += 4, s += 4)
+			*(uint32_t *)d = *(const uint32_t *)s;
+	}
+	while (n--)
+		*d++ = *s++;
+	return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	if (d <= s || d >= s + n)
+		return memcpy(dst, src, n);
+
+	while (n--)
+		d[n] = s[n];
+	return dst;
+}
+
+void *memset(void *dst, int c, size_t n)
+{
+	uint8_t *d = dst;
+
+	while (n--)
+		*d++ = c;
+	return dst;
+}
+
+int memcmp(const void *a, const void *b, size_t n)
+{
+	const uint8_t *x = a, *y = b;
+
+	for (; n; n--, x++, y++) {
+		if (*x != *y)
+			return *x - *y;
+	}
+	return 0;
+}
+
+size_t strlen(const char *s)
+{
+	const char *p = s;
+
+	while (*p)
+		p++;
+	return p - s;
+}
+
+char *strcpy(char *dst, const char *src)
+{
+	char *d = dst;
+
+	while ((*d++ = *src++))
+		;
+	return dst;
+}
+
+int strcmp(const char *a, const char *b)
+{
+	const uint8_t *x = (const uint8_t *)a, *y = (const uint8_t *)b;
+
+	while (*x && *x == *y)
+		x++, y++;
+	return *x - *y;
+}
+
+int strncmp(const char *a, const char *b, size_t n)
+{
+	const uint8_t *x = (const uint8_t *)a, *y = (const uint8_t *)b;
+
+	for (; n; n--, x++, y++) {
+		if (*x != *y || *x == '\0')
+			return *x - *y;
+	}
+	return 0;
+}
+
+static void swap(uint8_t *a, uint8_t *b, size_t size)
+{
+	uint8_t t;
+
+	while (size--) {
+		t = *a;
+		*a++ = *b;
+		*b++ = t;
+	}
+}
+
+/* quicksort on the median of three, insertion sort below 8 elements;
+ * recursion only into the smaller half keeps the stack shallow */
+void qsort(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *))
+{
+	uint8_t *a = base, *lo, *hi, *mid, *p;
+	size_t i, j;
+
+	while (n > 8) {
+		mid = a + n / 2 * size;
+		hi = a + (n - 1) * size;
+		if (cmp(mid, a) < 0)
+			swap(mid, a, size);
+		if (cmp(hi, mid) < 0) {
+			swap(hi, mid, size);
+			if (cmp(mid, a) < 0)
+				swap(mid, a, size);
+		}
+		/* the pivot waits in a[1] while the rest is partitioned */
+		swap(mid, a + size, size);
+		p = a + size;
+
+		lo = a + size;
+		for (;;) {
+			do
+				lo += size;
+			while (cmp(lo, p) < 0);
+			do
+				hi -= size;
+			while (cmp(hi, p) > 0);
+			if (lo >= hi)
+				break;
+			swap(lo, hi, size);
+		}
+		swap(p, hi, size);
+
+		i = (hi - a) / size;
+		j = n - i - 1;
+		if (i < j) {
+			qsort(a, i, size, cmp);
+			a = hi + size;
+			n = j;
+		} else {
+			qsort(hi + size, j, size, cmp);
+			n = i;
+		}
+	}
+
+	for (i = 1; i < n; i++) {
+		for (p = a + i * size; p > a && cmp(p - size, p) > 0; p -= size)
+			swap(p - size, p, size);
+	}
+}
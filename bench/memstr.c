@@ -0,0 +1,65 @@
+#include "bench.h"
+
+/* memcpy of aligned and misaligned blocks, then strcmp and strlen over a
+ * table of strings sharing long prefixes */
+
+#define ROUNDS		20
+#define BUF_SIZE	(64 * 1024)
+#define NR_STRINGS	512
+
+static uint32_t fold(uint32_t sum, const uint8_t *p, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i += 61)
+		sum = sum * 33 + p[i];
+	return sum;
+}
+
+int main(void)
+{
+	uint8_t *src, *dst;
+	char **strs, *p;
+	uint32_t seed = 0xcafef00d, sum = 0;
+	int r, i, j, k;
+	unsigned off, len;
+
+	src = bench_alloc(BUF_SIZE + 16);
+	dst = bench_alloc(BUF_SIZE + 16);
+	for (i = 0; i < BUF_SIZE + 16; i++)
+		src[i] = bench_rand(&seed);
+
+	strs = bench_alloc(NR_STRINGS * sizeof(*strs));
+	for (i = 0; i < NR_STRINGS; i++) {
+		len = 24 + bench_rand(&seed) % 40;
+		strs[i] = p = bench_alloc(len + 1);
+		/* a shared prefix makes every compare walk most of the string */
+		for (k = 0; k < (int)len; k++)
+			p[k] = k < 20 ? 'a' + k % 3 : 'a' + bench_rand(&seed) % 4;
+		p[len] = '\0';
+	}
+
+	for (r = 0; r < ROUNDS; r++) {
+		memcpy(dst, src, BUF_SIZE);
+		sum = fold(sum, dst, BUF_SIZE);
+
+		for (i = 0; i < 64; i++) {
+			off = bench_rand(&seed) & 7;
+			len = 256 + (bench_rand(&seed) & 1023);
+			memcpy(dst + (off ^ 5), src + off, len);
+			memmove(dst + 3, dst, len);
+			sum = fold(sum, dst, len);
+		}
+
+		for (i = 0; i < NR_STRINGS; i++) {
+			for (j = i & 7; j < NR_STRINGS; j += 8) {
+				int c = strcmp(strs[i], strs[j]);
+
+				sum += c < 0 ? 1 : c > 0 ? 3 : 7;
+			}
+			sum += strlen(strs[i]);
+		}
+	}
+
+	return bench_result("memstr", sum, 0x1ee54f90);
+}
@@ -0,0 +1,15 @@
+# cmake -P script behind the bench target, see CMakeLists.txt
+file(REMOVE ${REPORT})
+
+foreach (engine ${ENGINES})
+	foreach (elf ${WORKLOADS})
+		execute_process(COMMAND ${RSCV} -m ${MEMSIZE} -e ${engine} -r ${elf} -b ${REPORT}
+			RESULT_VARIABLE status)
+		if (NOT status EQUAL 0)
+			message(SEND_ERROR "${elf} on ${engine} exited with ${status}")
+		endif()
+	endforeach()
+endforeach()
+
+file(READ ${REPORT} results)
+message("${results}")
@@ -0,0 +1,78 @@
+#include "bench.h"
+
+/* qsort of 10k records by a string key, then by a numeric key */
+
+#define NR_RECORDS	10000
+#define ROUNDS		4
+
+struct record {
+	char name[24];
+	uint32_t id;
+	int32_t balance;
+};
+
+static int by_name(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+	int c = strcmp(x->name, y->name);
+
+	return c ? c : x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int by_balance(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+
+	if (x->balance != y->balance)
+		return x->balance < y->balance ? -1 : 1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void fill(struct record *r, uint32_t *seed)
+{
+	static const char *const first[] = {
+		"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi",
+		"ivan", "judy", "mallory", "niaj", "olivia", "peggy", "rupert", "sybil",
+	};
+	const char *f;
+	int i, n;
+
+	for (i = 0; i < NR_RECORDS; i++) {
+		f = first[bench_rand(seed) & 15];
+		n = strlen(f);
+		memcpy(r[i].name, f, n);
+		r[i].name[n++] = '.';
+		while (n < 12)
+			r[i].name[n++] = 'a' + bench_rand(seed) % 26;
+		r[i].name[n] = '\0';
+		r[i].id = i;
+		r[i].balance = (int32_t)(bench_rand(seed) % 200000) - 100000;
+	}
+}
+
+int main(void)
+{
+	struct record *r;
+	uint32_t seed = 0x2545f491, sum = 0;
+	int round, i, bad = 0;
+
+	r = bench_alloc(NR_RECORDS * sizeof(*r));
+
+	for (round = 0; round < ROUNDS; round++) {
+		fill(r, &seed);
+
+		qsort(r, NR_RECORDS, sizeof(*r), by_name);
+		for (i = 1; i < NR_RECORDS; i++)
+			bad |= by_name(&r[i - 1], &r[i]) > 0;
+		for (i = 0; i < NR_RECORDS; i += 97)
+			sum = sum * 31 + r[i].id;
+
+		qsort(r, NR_RECORDS, sizeof(*r), by_balance);
+		for (i = 1; i < NR_RECORDS; i++)
+			bad |= by_balance(&r[i - 1], &r[i]) > 0;
+		for (i = 0; i < NR_RECORDS; i += 97)
+			sum = sum * 31 + r[i].id;
+	}
+
+	return bench_result("sort", sum, 0xaaaa5f23) | bad;
+}
@@ -0,0 +1,180 @@
+#include "bench.h"
+
+/* parse a synthetic PBAP phonebook of vCard 3.0 entries, as the ribp
+ * example in the README does, and sort the contacts by name */
+
+#define NR_CARDS	3000
+#define ROUNDS		3
+
+struct contact {
+	const char *fn;
+	char tel[4][20];
+	unsigned ntel;
+	uint32_t email_hash;
+};
+
+static char *put(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+static char *put_digits(char *p, uint32_t *seed, int n)
+{
+	while (n--)
+		*p++ = '0' + bench_rand(seed) % 10;
+	return p;
+}
+
+static char *make_phonebook(uint32_t *seed)
+{
+	static const char *const given[] = {
+		"Wei", "Anna", "Jose", "Mei", "Olga", "Raj", "Sven", "Yuki",
+	};
+	static const char *const family[] = {
+		"Zhang", "Smith", "Garcia", "Li", "Ivanova", "Patel", "Berg", "Sato",
+	};
+	char *book, *p;
+	int i, t, ntel;
+	const char *g, *f;
+
+	book = p = bench_alloc(NR_CARDS * 256);
+	for (i = 0; i < NR_CARDS; i++) {
+		g = given[bench_rand(seed) & 7];
+		f = family[bench_rand(seed) & 7];
+		p = put(p, "BEGIN:VCARD\r\nVERSION:3.0\r\nN:");
+		p = put(p, f);
+		p = put(p, ";");
+		p = put(p, g);
+		p = put(p, ";;;\r\nFN:");
+		p = put(p, g);
+		p = put(p, " ");
+		p = put(p, f);
+		p = put(p, " ");
+		p = put_digits(p, seed, 4);
+		p = put(p, "\r\n");
+		ntel = 1 + bench_rand(seed) % 3;
+		for (t = 0; t < ntel; t++) {
+			p = put(p, t ? "TEL;TYPE=WORK,VOICE:+86-" : "TEL;TYPE=CELL:+86-");
+			p = put_digits(p, seed, 3);
+			p = put(p, "-");
+			p = put_digits(p, seed, 8);
+			p = put(p, "\r\n");
+		}
+		/* a folded line: the continuation starts with a space */
+		p = put(p, "EMAIL;TYPE=INTERNET:");
+		p = put(p, g);
+		p = put(p, ".");
+		p = put(p, f);
+		p = put(p, "\r\n @example.com\r\nEND:VCARD\r\n");
+	}
+	*p = '\0';
+	return book;
+}
+
+/* the next logical line of s, unfolded in place; NULL at the end */
+static char *next_line(char **s)
+{
+	char *line = *s, *r = *s, *w = *s;
+
+	if (*r == '\0')
+		return NULL;
+
+	for (;;) {
+		if (r[0] == '\r' && r[1] == '\n') {
+			if (r[2] == ' ' || r[2] == '\t') {
+				r += 3;
+				continue;
+			}
+			r += 2;
+			break;
+		}
+		if (*r == '\0')
+			break;
+		*w++ = *r++;
+	}
+	*w = '\0';
+	*s = r;
+	return line;
+}
+
+static unsigned parse(char *book, struct contact *c)
+{
+	struct contact *cur = NULL;
+	char *line, *value, *p;
+	unsigned n = 0, k;
+
+	while ((line = next_line(&book)) != NULL) {
+		value = line;
+		while (*value && *value != ':')
+			value++;
+		if (*value == '\0')
+			continue;
+		*value++ = '\0';
+
+		/* the property name ends at its first parameter */
+		for (p = line; *p && *p != ';'; p++)
+			;
+		*p = '\0';
+
+		if (!strcmp(line, "BEGIN")) {
+			cur = &c[n];
+			memset(cur, 0, sizeof(*cur));
+		} else if (cur == NULL) {
+			continue;
+		} else if (!strcmp(line, "FN")) {
+			cur->fn = value;
+		} else if (!strcmp(line, "TEL") && cur->ntel < 4) {
+			/* keep the digits only */
+			for (k = 0; *value && k < sizeof(cur->tel[0]) - 1; value++) {
+				if (*value >= '0' && *value <= '9')
+					cur->tel[cur->ntel][k++] = *value;
+			}
+			cur->tel[cur->ntel++][k] = '\0';
+		} else if (!strcmp(line, "EMAIL")) {
+			for (; *value; value++)
+				cur->email_hash = cur->email_hash * 31 + (uint8_t)*value;
+		} else if (!strcmp(line, "END")) {
+			n++;
+			cur = NULL;
+		}
+	}
+	return n;
+}
+
+/* names repeat among the cards, so the numbers break ties: the order,
+ * and with it the checksum, must not depend on the qsort */
+static int by_fn(const void *a, const void *b)
+{
+	const struct contact *x = a, *y = b;
+	unsigned i;
+	int r = strcmp(x->fn, y->fn);
+
+	for (i = 0; r == 0 && i < 4; i++)
+		r = strcmp(x->tel[i], y->tel[i]);
+	return r;
+}
+
+int main(void)
+{
+	struct contact *c;
+	uint32_t seed = 0x9e3779b9, sum = 0;
+	unsigned round, i, n;
+	char *book;
+
+	c = bench_alloc(NR_CARDS * sizeof(*c));
+	for (round = 0; round < ROUNDS; round++) {
+		book = make_phonebook(&seed);
+		n = parse(book, c);
+		qsort(c, n, sizeof(*c), by_fn);
+
+		sum = sum * 31 + n;
+		for (i = 0; i < n; i++) {
+			sum = sum * 31 + c[i].ntel + c[i].email_hash;
+			sum = sum * 31 + (uint8_t)c[i].fn[0] + (uint8_t)c[i].tel[0][5];
+		}
+	}
+
+	return bench_result("vcard", sum, 0xdcac7f66);
+}
@@ -11,6 +11,89 @@
 #define HOSTAPI_WRITE	0x03
 #define HOSTAPI_SEEK	0x04
 #define HOSTAPI_POLL	0x05
+#define HOSTAPI_EXIT	0x06
+#define HOSTAPI_RING	0x07
+#define HOSTAPI_IRQ	0x08
+
+#include <stdint.h>
+
+/*
+ * A single producer, single consumer byte ring in guest memory, for
+ * moving bulk data over a descriptor without a host call per chunk.  The
+ * consumer only advances head, the producer only tail; both run freely
+ * and wrap modulo 2^32, so tail - head is the number of bytes queued.
+ * The guest calls HOSTAPI_RING(fd, ring) only when its side can not go
+ * on: an RIBP_RING_IN ring that is empty, which the host fills from fd,
+ * or an output ring that is full, which the host drains to fd.  The call
+ * returns the bytes moved, or -1, and sets RIBP_RING_EOF once fd reads
+ * end of file.
+ */
+struct ribp_ring {
+	uint32_t head;		/* consumer index */
+	uint32_t tail;		/* producer index */
+	uint32_t size;		/* bytes in data, a power of two */
+	uint32_t flags;
+	uint8_t data[];
+};
+
+#define RIBP_RING_IN	(1 << 0)	/* the host produces */
+#define RIBP_RING_EOF	(1 << 1)	/* set by the host, nothing more to come */
+
+struct riscv32_vm;
+/* returns non-zero when the guest asked to exit, with its status in *a1 */
+int hostapi_ecall(struct riscv32_vm *vm,
+	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
+	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7);
+
+/*
+ * The same api on an io_uring: read, write, open, poll and ring are submitted
+ * and hostapi_uring_ecall returns HOSTAPI_PENDING, the vm must then stay
+ * parked until done(vm, arg) is called for it on the ring's thread with
+ * the result in a0.  Everything else completes at once, as in
+ * hostapi_ecall.
+ */
+#define HOSTAPI_PENDING	2
+
+struct hostapi_uring;
+struct hostapi_uring *hostapi_uring_create(unsigned entries,
+	void (*done)(struct riscv32_vm *vm, void *arg), void *arg);
+void hostapi_uring_destroy(struct hostapi_uring *u);
+int hostapi_uring_ecall(struct hostapi_uring *u, struct riscv32_vm *vm);
+
+/*
+ * Record and replay: hostapi_log_ecall makes the call and writes down its
+ * result and the guest memory it wrote, or with replay takes both from
+ * the log instead.  The time csr goes through hostapi_log_time from the
+ * vm's time_hook, so a replayed guest runs exactly as recorded.
+ */
+struct hostapi_log;
+struct hostapi_log *hostapi_log_open(int fd, int replay);
+int hostapi_log_close(struct hostapi_log *l);
+int hostapi_log_ecall(struct hostapi_log *l, struct riscv32_vm *vm,
+	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
+	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7);
+uint64_t hostapi_log_time(struct hostapi_log *l, uint64_t time);
+
+/*
+ * Descriptor interrupts: HOSTAPI_IRQ(fd, events) raises the machine
+ * external interrupt once fd has one of the poll events POLLIN and
+ * POLLOUT, one time; arming it again starts over and events 0 forgets
+ * fd.  HOSTAPI_IRQ(-1) claims the earliest armed descriptor that fired,
+ * returning it with its revents in a1, or -1 when none is left; the
+ * line goes down with the last one.  After RISCV32_EXIT_WFI a vm sleeps
+ * in hostapi_irq_wait, or is parked by hostapi_irq_park until an
+ * interrupt or its timer is due and wake(vm, arg) is called for it on
+ * the interrupt thread.  hostapi_irq_close forgets fd before the
+ * guest's HOSTAPI_CLOSE of it, so its number can be armed again.
+ */
+struct hostapi_irq;
+struct hostapi_irq *hostapi_irq_create(void (*wake)(struct riscv32_vm *vm, void *arg), void *arg);
+void hostapi_irq_destroy(struct hostapi_irq *h);
+int hostapi_irq_ecall(struct hostapi_irq *h, struct riscv32_vm *vm);
+void hostapi_irq_wait(struct hostapi_irq *h, struct riscv32_vm *vm);
+int hostapi_irq_park(struct hostapi_irq *h, struct riscv32_vm *vm);
+void hostapi_irq_close(struct hostapi_irq *h, struct riscv32_vm *vm, int fd);
+void hostapi_irq_release(struct hostapi_irq *h, struct riscv32_vm *vm);
 
 #endif /* __HOSTAPI_H__*/
 
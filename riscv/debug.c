@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include "riscv.h"
+#include "riscv-internal.h"
+
+/* the first breakpoint table, grown by doubling at half full */
+#define BREAK_SLOTS	64
+
+/* the debugger state of a vm, allocated on first use */
+struct riscv32_debug *riscv32_debug_get(struct riscv32_vm *m)
+{
+	struct riscv32_debug *g = m->debug;
+	unsigned size;
+
+	if (g != NULL)
+		return g;
+
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return NULL;
+
+	size = ((m->memsize >> RISCV32_WATCH_SHIFT) >> 3) + 1;
+	g->watch_pages = calloc(1, size);
+	if (g->watch_pages == NULL) {
+		free(g);
+		return NULL;
+	}
+	m->debug = g;
+	return g;
+}
+
+void riscv32_debug_free(struct riscv32_vm *m)
+{
+	struct riscv32_debug *g = m->debug;
+
+	if (g == NULL)
+		return;
+
+	free(g->breaks);
+	free(g->watch_pages);
+	free(g);
+	m->debug = NULL;
+}
+
+static unsigned break_slot(struct riscv32_debug *g, uint32_t pc)
+{
+	unsigned i = ((pc >> 1) * 0x9e3779b1u) >> 16;
+
+	for (;; i++) {
+		i &= g->break_mask;
+		if (g->breaks[i] == pc || g->breaks[i] == RISCV32_ICACHE_INVALID)
+			return i;
+	}
+}
+
+int riscv32_break_at(struct riscv32_debug *g, uint32_t pc)
+{
+	return g->nbreaks && g->breaks[break_slot(g, pc)] == pc;
+}
+
+static int break_grow(struct riscv32_debug *g)
+{
+	uint32_t *old = g->breaks;
+	unsigned size = old ? (g->break_mask + 1) * 2 : BREAK_SLOTS, i;
+
+	g->breaks = malloc(size * sizeof(*g->breaks));
+	if (g->breaks == NULL) {
+		g->breaks = old;
+		return -1;
+	}
+	for (i = 0; i < size; i++)
+		g->breaks[i] = RISCV32_ICACHE_INVALID;
+
+	i = old ? g->break_mask + 1 : 0;
+	g->break_mask = size - 1;
+	while (i--) {
+		if (old[i] != RISCV32_ICACHE_INVALID)
+			g->breaks[break_slot(g, old[i])] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* the instruction at addr stops the vm with RISCV32_EXIT_DEBUG instead of
+ * running, whichever engine reaches it */
+int riscv32_break_insert(struct riscv32_vm *m, uint32_t addr)
+{
+	struct riscv32_debug *g = riscv32_debug_get(m);
+	unsigned i;
+
+	if (g == NULL || (addr & 1))
+		return -1;
+	if (g->breaks == NULL || (g->nbreaks + 1) * 2 > g->break_mask + 1) {
+		if (break_grow(g))
+			return -1;
+	}
+
+	i = break_slot(g, addr);
+	if (g->breaks[i] == addr)
+		return 0;
+	g->breaks[i] = addr;
+	g->nbreaks++;
+
+	/* decoded again, now as the breakpoint */
+	riscv32_icache_invalidate_range(m, addr, 2);
+	return 0;
+}
+
+int riscv32_break_remove(struct riscv32_vm *m, uint32_t addr)
+{
+	struct riscv32_debug *g = m->debug;
+	unsigned i, j;
+	uint32_t pc;
+
+	if (g == NULL || !riscv32_break_at(g, addr))
+		return -1;
+
+	/* linear probing: the rest of the run moves up over the hole */
+	i = break_slot(g, addr);
+	g->breaks[i] = RISCV32_ICACHE_INVALID;
+	g->nbreaks--;
+	for (j = (i + 1) & g->break_mask; (pc = g->breaks[j]) != RISCV32_ICACHE_INVALID;
+			j = (j + 1) & g->break_mask) {
+		g->breaks[j] = RISCV32_ICACHE_INVALID;
+		g->breaks[break_slot(g, pc)] = pc;
+	}
+
+	riscv32_icache_invalidate_range(m, addr, 2);
+	return 0;
+}
+
+static void watch_pages(struct riscv32_vm *m)
+{
+	struct riscv32_debug *g = m->debug;
+	uint64_t p, end;
+	unsigned i;
+
+	memset(g->watch_pages, 0, ((m->memsize >> RISCV32_WATCH_SHIFT) >> 3) + 1);
+	for (i = 0; i < g->nwatch; i++) {
+		end = (uint64_t)g->watch[i].addr + g->watch[i].len - 1;
+		if (end >= m->memsize)
+			end = m->memsize - 1;
+		for (p = g->watch[i].addr >> RISCV32_WATCH_SHIFT; p <= end >> RISCV32_WATCH_SHIFT; p++)
+			g->watch_pages[p >> 3] |= 1 << (p & 7);
+	}
+}
+
+/* accesses of type to [addr, addr + len) stop the vm with
+ * RISCV32_EXIT_DEBUG once the instruction making them retires */
+int riscv32_watch_insert(struct riscv32_vm *m, uint32_t addr, uint32_t len, int type)
+{
+	struct riscv32_debug *g = riscv32_debug_get(m);
+
+	if (g == NULL || len == 0 || addr >= m->memsize || g->nwatch == RISCV32_MAX_WATCH ||
+			type < RISCV32_WATCH_WRITE || type > RISCV32_WATCH_ACCESS)
+		return -1;
+
+	g->watch[g->nwatch].addr = addr;
+	g->watch[g->nwatch].len = len;
+	g->watch[g->nwatch].type = type;
+	g->nwatch++;
+	watch_pages(m);
+	return 0;
+}
+
+int riscv32_watch_remove(struct riscv32_vm *m, uint32_t addr, uint32_t len, int type)
+{
+	struct riscv32_debug *g = m->debug;
+	unsigned i;
+
+	for (i = 0; g && i < g->nwatch; i++) {
+		if (g->watch[i].addr == addr && g->watch[i].len == len && g->watch[i].type == type) {
+			g->watch[i] = g->watch[--g->nwatch];
+			watch_pages(m);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* from the watching core, on a page with a watchpoint */
+void riscv32_watch_hit(struct riscv32_vm *m, uint32_t addr, uint32_t size, int type)
+{
+	struct riscv32_debug *g = m->debug;
+	struct riscv32_watch *w;
+	unsigned i;
+
+	for (i = 0; i < g->nwatch && !g->hit; i++) {
+		w = &g->watch[i];
+		if ((w->type & type) && addr < (uint64_t)w->addr + w->len && w->addr < (uint64_t)addr + size) {
+			g->hit = w->type;
+			g->hit_addr = w->addr;
+		}
+	}
+}
+
+/* after RISCV32_EXIT_DEBUG: the type of the watchpoint that stopped the
+ * vm and its address in *addr, or 0 at a breakpoint */
+int riscv32_debug_hit(struct riscv32_vm *m, uint32_t *addr)
+{
+	if (m->debug == NULL || !m->debug->hit)
+		return 0;
+
+	*addr = m->debug->hit_addr;
+	return m->debug->hit;
+}
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include "riscv.h"
+#include "riscv-internal.h"
+
+#ifdef RISCV32_HAVE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifndef EM_RISCV
+#define EM_RISCV	243
+#endif
+
+/* function and object symbols of the loaded image, sorted by address */
+struct riscv32_symtab {
+	unsigned nsyms;
+	char *strtab;
+	struct riscv32_sym {
+		uint32_t addr;
+		uint32_t size;
+		const char *name;
+	} syms[];
+};
+
+static int elf_read(int fd, void *buf, size_t size, uint32_t off)
+{
+	ssize_t rn;
+
+	while (size) {
+		rn = pread(fd, buf, size, off);
+		if (rn <= 0)
+			return -1;
+		buf = (char *)buf + rn;
+		size -= rn;
+		off += rn;
+	}
+	return 0;
+}
+
+/* the file part of a segment: whole pages are mapped from the file copy
+ * on write when the vm memory is mapped and the offsets agree, partial
+ * pages at either end are read, so neighbouring segments are untouched */
+static int elf_load_segment(struct riscv32_vm *vm, int fd, const Elf32_Phdr *ph)
+{
+	uint32_t addr = ph->p_vaddr, end = ph->p_vaddr + ph->p_filesz;
+#ifdef RISCV32_HAVE_MMAP
+	uint32_t page = sysconf(_SC_PAGESIZE);
+	uint32_t first = (addr + page - 1) & ~(page - 1), last = end & ~(page - 1);
+
+	if (vm->mapsize && first < last &&
+		(ph->p_offset & (page - 1)) == (addr & (page - 1))) {
+		if (mmap(vm->mem + first, last - first, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd,
+				ph->p_offset + (first - addr)) == MAP_FAILED)
+			return -1;
+		if (elf_read(fd, vm->mem + addr, first - addr, ph->p_offset))
+			return -1;
+		addr = last;
+	}
+#endif
+	return elf_read(fd, vm->mem + addr, end - addr, ph->p_offset + (addr - ph->p_vaddr));
+}
+
+static int elf_sym_cmp(const void *a, const void *b)
+{
+	const struct riscv32_sym *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* whether size bytes at off are all in a file of fsize bytes */
+static bool elf_in_file(uint64_t off, uint64_t size, off_t fsize)
+{
+	return off + size <= (uint64_t)fsize;
+}
+
+static void elf_load_symtab(struct riscv32_vm *vm, int fd, const Elf32_Ehdr *eh, off_t fsize)
+{
+	struct riscv32_symtab *st = NULL;
+	Elf32_Shdr *sh, *strsh;
+	Elf32_Sym *syms = NULL;
+	char *strtab = NULL;
+	unsigned i, n, nsyms;
+
+	if (eh->e_shentsize != sizeof(Elf32_Shdr) || eh->e_shnum == 0 ||
+		!elf_in_file(eh->e_shoff, (uint64_t)eh->e_shnum * sizeof(*sh), fsize))
+		return;
+
+	sh = malloc(eh->e_shnum * sizeof(*sh));
+	if (sh == NULL || elf_read(fd, sh, eh->e_shnum * sizeof(*sh), eh->e_shoff))
+		goto out;
+
+	for (i = 0; i < eh->e_shnum && sh[i].sh_type != SHT_SYMTAB; i++)
+		;
+	if (i == eh->e_shnum || sh[i].sh_link >= eh->e_shnum)
+		goto out;
+
+	strsh = &sh[sh[i].sh_link];
+	if (!elf_in_file(sh[i].sh_offset, sh[i].sh_size, fsize) ||
+		!elf_in_file(strsh->sh_offset, strsh->sh_size, fsize))
+		goto out;
+	nsyms = sh[i].sh_size / sizeof(Elf32_Sym);
+	syms = malloc(nsyms * sizeof(*syms));
+	strtab = malloc((size_t)strsh->sh_size + 1);
+	if (syms == NULL || strtab == NULL ||
+		elf_read(fd, syms, nsyms * sizeof(*syms), sh[i].sh_offset) ||
+		elf_read(fd, strtab, strsh->sh_size, strsh->sh_offset))
+		goto out;
+	strtab[strsh->sh_size] = '\0';
+
+	st = malloc(sizeof(*st) + nsyms * sizeof(st->syms[0]));
+	if (st == NULL)
+		goto out;
+
+	for (i = n = 0; i < nsyms; i++) {
+		if (ELF32_ST_TYPE(syms[i].st_info) != STT_FUNC &&
+			ELF32_ST_TYPE(syms[i].st_info) != STT_OBJECT &&
+			ELF32_ST_TYPE(syms[i].st_info) != STT_NOTYPE)
+			continue;
+		if (syms[i].st_shndx == SHN_UNDEF || syms[i].st_name >= strsh->sh_size)
+			continue;
+		/* nameless, mapping ($x, $d) and assembler local symbols */
+		if (strtab[syms[i].st_name] == '\0' || strtab[syms[i].st_name] == '$' ||
+			!strncmp(strtab + syms[i].st_name, ".L", 2))
+			continue;
+		st->syms[n].addr = syms[i].st_value;
+		st->syms[n].size = syms[i].st_size;
+		st->syms[n].name = strtab + syms[i].st_name;
+		n++;
+	}
+	qsort(st->syms, n, sizeof(st->syms[0]), elf_sym_cmp);
+	st->nsyms = n;
+	st->strtab = strtab;
+	strtab = NULL;
+
+	riscv32_symtab_free(vm);
+	vm->symtab = st;
+
+out:
+	free(strtab);
+	free(syms);
+	free(sh);
+}
+
+/* load an rv32 ELF executable from fd into a fresh vm: PT_LOAD segments
+ * come from the file, .bss is the vm's still untouched zero memory; pc is
+ * set to e_entry and *end, if given, to the first byte after the highest
+ * segment */
+int riscv32_load_elf(struct riscv32_vm *vm, int fd, uint32_t *end)
+{
+	Elf32_Ehdr eh;
+	Elf32_Phdr ph;
+	struct stat st;
+	uint32_t top = 0;
+	unsigned i;
+
+	if (fstat(fd, &st) || elf_read(fd, &eh, sizeof(eh), 0))
+		return -1;
+
+	if (memcmp(eh.e_ident, ELFMAG, SELFMAG) || eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+		eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV ||
+		eh.e_type != ET_EXEC || eh.e_phentsize != sizeof(Elf32_Phdr))
+		return -1;
+
+	for (i = 0; i < eh.e_phnum; i++) {
+		if (elf_read(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)))
+			return -1;
+		if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+			continue;
+		if (ph.p_filesz > ph.p_memsz || (uint64_t)ph.p_vaddr + ph.p_memsz > vm->memsize)
+			return -1;
+		/* a mapping past the end of the file faults on first touch */
+		if (!elf_in_file(ph.p_offset, ph.p_filesz, st.st_size))
+			return -1;
+
+		if (elf_load_segment(vm, fd, &ph))
+			return -1;
+		riscv32_icache_invalidate_range(vm, ph.p_vaddr, ph.p_memsz);
+
+		if (ph.p_vaddr + ph.p_memsz > top)
+			top = ph.p_vaddr + ph.p_memsz;
+	}
+
+	elf_load_symtab(vm, fd, &eh, st.st_size);
+
+	vm->cpu.pc = eh.e_entry;
+	if (end)
+		*end = top;
+	return 0;
+}
+
+/* the symbol covering addr, with the distance from its start in *offset */
+const char *riscv32_symbol(struct riscv32_vm *vm, uint32_t addr, uint32_t *offset)
+{
+	struct riscv32_symtab *st = vm->symtab;
+	unsigned lo = 0, hi, mid;
+
+	if (st == NULL || st->nsyms == 0)
+		return NULL;
+
+	/* the last symbol starting at or below addr */
+	hi = st->nsyms;
+	while (lo + 1 < hi) {
+		mid = (lo + hi) / 2;
+		if (st->syms[mid].addr <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (st->syms[lo].addr > addr)
+		return NULL;
+	if (st->syms[lo].size && addr - st->syms[lo].addr >= st->syms[lo].size)
+		return NULL;
+
+	if (offset)
+		*offset = addr - st->syms[lo].addr;
+	return st->syms[lo].name;
+}
+
+int riscv32_symbol_addr(struct riscv32_vm *vm, const char *name, uint32_t *addr)
+{
+	struct riscv32_symtab *st = vm->symtab;
+	unsigned i;
+
+	for (i = 0; st && i < st->nsyms; i++) {
+		if (!strcmp(st->syms[i].name, name)) {
+			*addr = st->syms[i].addr;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void riscv32_symtab_free(struct riscv32_vm *vm)
+{
+	if (vm->symtab == NULL)
+		return;
+
+	free(vm->symtab->strtab);
+	free(vm->symtab);
+	vm->symtab = NULL;
+}
@@ -0,0 +1,733 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "riscv.h"
+#include "riscv-internal.h"
+
+/*
+ * A template JIT for hot rv32im basic blocks.
+ *
+ * Blocks are straight-line runs of translatable instructions ending with
+ * a branch or jump, or just before anything the interpreter must handle
+ * (csr access, ecall, ebreak, mret, wfi, fence.i).  Each guest
+ * instruction loads its operands from struct riscv32_cpu and stores its
+ * result straight back, so the cpu state is exact at every block exit.
+ *
+ * Host registers inside translated code:
+ *	rbx	struct riscv32_cpu *
+ *	rbp	struct jit_ctx *
+ *	r12	guest memory base
+ *	r14d	remaining instruction budget
+ *	r15	m->code_map
+ *
+ * Translated code returns to the dispatcher with rax = 0 (pc stored in
+ * the cpu), JIT_EXIT_INTERP (let the interpreter run the instruction at
+ * pc, it may trap) or the address of a struct jit_exit whose jump may be
+ * chained to the translated target.
+ */
+
+#ifndef RISCV32_JIT_HOT
+#define RISCV32_JIT_HOT		16	/* executions before a block is translated */
+#endif
+#ifndef RISCV32_JIT_CODE_SIZE
+#define RISCV32_JIT_CODE_SIZE	(4 << 20)
+#endif
+#define JIT_BLOCK_BITS		13
+#define JIT_BLOCKS		(1u << JIT_BLOCK_BITS)
+#define JIT_MAX_INSNS		32
+#define JIT_MAX_BYTES		(JIT_MAX_INSNS * 128 + 256)
+#define JIT_EXIT_INTERP		1
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+struct jit_ctx {
+	uint8_t *mem;
+	uint8_t *code_map;
+	uint32_t budget;
+};
+
+struct jit_exit {
+	uint32_t target;
+	uint8_t *jmp;		/* jmp rel32 to patch, NULL once chained */
+};
+
+struct jit_block {
+	uint32_t pc;
+	uint32_t end;		/* first guest byte after the block */
+	uint32_t count;
+	uint16_t ninsns;	/* 0: the instruction at pc is not translatable */
+	uint8_t *code;
+	struct jit_exit exit[2];
+};
+
+/* a forward jump to an out of line stub restoring pc and budget */
+struct jit_fixup {
+	uint8_t *rel;
+	uint32_t pc;
+	uint32_t restore;
+};
+
+struct riscv32_jit {
+	uint8_t *code, *code_ptr, *code_end;
+	void *(*enter)(struct riscv32_cpu *c, void *code, struct jit_ctx *ctx);
+	uint8_t *epilogue;
+	uint8_t *code_start;	/* first byte after enter/epilogue */
+	unsigned nblocks;
+	unsigned ncompiled;
+	unsigned code_map_size;
+	int seeded;		/* code_map covers the icache the vm started with */
+	struct jit_block blocks[JIT_BLOCKS];
+	struct jit_block *compiled[JIT_BLOCKS];	/* blocks with code, for invalidation */
+	struct jit_fixup fixups[JIT_MAX_INSNS * 2];
+	unsigned nfixups;
+};
+
+#define CPU_REG(r)	(offsetof(struct riscv32_cpu, reg) + 4 * (r))
+#define CPU_PC		offsetof(struct riscv32_cpu, pc)
+
+static void emit1(struct riscv32_jit *j, uint8_t b)
+{
+	*j->code_ptr++ = b;
+}
+
+static void emit4(struct riscv32_jit *j, uint32_t v)
+{
+	memcpy(j->code_ptr, &v, 4);
+	j->code_ptr += 4;
+}
+
+static void emit8(struct riscv32_jit *j, uint64_t v)
+{
+	memcpy(j->code_ptr, &v, 8);
+	j->code_ptr += 8;
+}
+
+static void patch_rel32(uint8_t *rel, uint8_t *target)
+{
+	int32_t v = target - (rel + 4);
+	memcpy(rel, &v, 4);
+}
+
+/* op r32, [rbx + disp] */
+static void emit_cpu_modrm(struct riscv32_jit *j, uint8_t op, int r, uint32_t disp)
+{
+	emit1(j, op);
+	if (disp < 0x80) {
+		emit1(j, 0x40 | r << 3 | EBX);
+		emit1(j, disp);
+	} else {
+		emit1(j, 0x80 | r << 3 | EBX);
+		emit4(j, disp);
+	}
+}
+
+static void load_reg(struct riscv32_jit *j, int r, int greg)
+{
+	if (greg == 0) {
+		emit1(j, 0x31);			/* xor r, r */
+		emit1(j, 0xc0 | r << 3 | r);
+	} else {
+		emit_cpu_modrm(j, 0x8b, r, CPU_REG(greg));
+	}
+}
+
+static void store_reg(struct riscv32_jit *j, int r, int greg)
+{
+	if (greg != 32)
+		emit_cpu_modrm(j, 0x89, r, CPU_REG(greg));
+}
+
+/* mov dword [rbx + disp], imm32 */
+static void store_imm(struct riscv32_jit *j, uint32_t disp, uint32_t imm)
+{
+	emit_cpu_modrm(j, 0xc7, 0, disp);
+	emit4(j, imm);
+}
+
+static void store_reg_imm(struct riscv32_jit *j, int greg, uint32_t imm)
+{
+	if (greg != 32)
+		store_imm(j, CPU_REG(greg), imm);
+}
+
+/* jmp rel32 to the shared epilogue */
+static void emit_leave(struct riscv32_jit *j)
+{
+	emit1(j, 0xe9);
+	emit4(j, 0);
+	patch_rel32(j->code_ptr - 4, j->epilogue);
+}
+
+/* jcc rel32 to a stub that sets pc, gives back the budget of the
+ * instructions that did not run and asks for the interpreter */
+static void emit_jcc_interp(struct riscv32_jit *j, uint8_t cc, uint32_t pc, uint32_t restore)
+{
+	struct jit_fixup *f = &j->fixups[j->nfixups++];
+
+	emit1(j, 0x0f);
+	emit1(j, cc);
+	emit4(j, 0);
+	f->rel = j->code_ptr - 4;
+	f->pc = pc;
+	f->restore = restore;
+}
+
+/* leave for target through a jump that can later be chained */
+static void emit_exit(struct riscv32_jit *j, struct jit_exit *e, uint32_t target)
+{
+	e->target = target;
+	e->jmp = j->code_ptr;
+	emit1(j, 0xe9);			/* jmp next, patched when chained */
+	emit4(j, 0);
+	store_imm(j, CPU_PC, target);
+	emit1(j, 0x48);			/* mov rax, e */
+	emit1(j, 0xb8);
+	emit8(j, (uintptr_t)e);
+	emit_leave(j);
+}
+
+static uint32_t jit_div32(uint32_t a, uint32_t b) { return div32(a, b); }
+static uint32_t jit_divu32(uint32_t a, uint32_t b) { return divu32(a, b); }
+static uint32_t jit_rem32(uint32_t a, uint32_t b) { return rem32(a, b); }
+static uint32_t jit_remu32(uint32_t a, uint32_t b) { return remu32(a, b); }
+
+static void emit_call(struct riscv32_jit *j, uint32_t (*fn)(uint32_t, uint32_t))
+{
+	emit1(j, 0x89); emit1(j, 0xc7);		/* mov edi, eax */
+	emit1(j, 0x89); emit1(j, 0xce);		/* mov esi, ecx */
+	emit1(j, 0x48); emit1(j, 0xb8);		/* mov rax, fn */
+	emit8(j, (uintptr_t)fn);
+	emit1(j, 0xff); emit1(j, 0xd0);		/* call rax */
+}
+
+/* eax = setcc(eax - operand) */
+static void emit_setcc(struct riscv32_jit *j, uint8_t cc)
+{
+	emit1(j, 0x0f); emit1(j, cc); emit1(j, 0xc0);	/* setcc al */
+	emit1(j, 0x0f); emit1(j, 0xb6); emit1(j, 0xc0);	/* movzx eax, al */
+}
+
+static bool jit_translatable(struct riscv32_insn *d)
+{
+	switch (d->op) {
+	case RV_ILLEGAL:
+	case RV_FENCE_I:
+	case RV_CSRRW: case RV_CSRRS: case RV_CSRRC:
+	case RV_CSRRWI: case RV_CSRRSI: case RV_CSRRCI:
+	case RV_ECALL: case RV_EBREAK: case RV_MRET: case RV_WFI:
+	case RV_BREAKPOINT:
+		return false;
+	}
+	return true;
+}
+
+static bool jit_terminator(struct riscv32_insn *d)
+{
+	return d->op == RV_JAL || d->op == RV_JALR ||
+		(d->op >= RV_BEQ && d->op <= RV_BGEU);
+}
+
+/* emit eax = guest address of a load/store, leaving through the
+ * interpreter when [eax, eax + size) is outside guest memory */
+static void emit_addr(struct riscv32_jit *j, struct riscv32_vm *m, struct riscv32_insn *d,
+	unsigned size, uint32_t pc, uint32_t restore)
+{
+	uint32_t limit = m->memsize >= size ? m->memsize - size + 1 : 0;
+
+	load_reg(j, EAX, d->rs1);
+	if (d->imm) {
+		emit1(j, 0x05);			/* add eax, imm32 */
+		emit4(j, d->imm);
+	}
+	emit1(j, 0x3d);				/* cmp eax, limit */
+	emit4(j, limit);
+	emit_jcc_interp(j, 0x83, pc, restore);	/* jae */
+}
+
+static bool jit_insn(struct riscv32_jit *j, struct riscv32_vm *m, struct jit_block *b,
+	struct riscv32_insn *d, uint32_t pc, uint32_t restore)
+{
+	static const uint8_t alu_rr[] = {
+		[RV_ADD] = 0x01, [RV_SUB] = 0x29, [RV_AND] = 0x21,
+		[RV_OR] = 0x09, [RV_XOR] = 0x31,
+	};
+	static const uint8_t alu_ri[] = {
+		[RV_ADDI] = 0x05, [RV_XORI] = 0x35, [RV_ORI] = 0x0d, [RV_ANDI] = 0x25,
+	};
+	static const uint8_t shift_ri[] = {
+		[RV_SLLI] = 0xe0, [RV_SRLI] = 0xe8, [RV_SRAI] = 0xf8,
+	};
+	static const uint8_t shift_rr[] = {
+		[RV_SLL] = 0xe0, [RV_SRL] = 0xe8, [RV_SRA] = 0xf8,
+	};
+	static const uint8_t jcc[] = {
+		[RV_BEQ] = 0x84, [RV_BNE] = 0x85, [RV_BLT] = 0x8c,
+		[RV_BGE] = 0x8d, [RV_BLTU] = 0x82, [RV_BGEU] = 0x83,
+	};
+	uint8_t *taken;
+
+	switch (d->op) {
+	case RV_LUI:
+		store_reg_imm(j, d->rd, d->imm);
+	break;
+
+	case RV_AUIPC:
+		store_reg_imm(j, d->rd, pc + d->imm);
+	break;
+
+	case RV_JAL:
+		store_reg_imm(j, d->rd, pc + RISCV32_INSN_LEN(d));
+		emit_exit(j, &b->exit[0], pc + d->imm);
+	break;
+
+	case RV_JALR:
+		load_reg(j, EAX, d->rs1);
+		emit1(j, 0x05);			/* add eax, imm32 */
+		emit4(j, d->imm);
+		emit1(j, 0x83); emit1(j, 0xe0); emit1(j, 0xfe);	/* and eax, ~1 */
+		store_reg_imm(j, d->rd, pc + RISCV32_INSN_LEN(d));
+		emit_cpu_modrm(j, 0x89, EAX, CPU_PC);
+		emit1(j, 0x31); emit1(j, 0xc0);	/* xor eax, eax */
+		emit_leave(j);
+	break;
+
+	case RV_BEQ: case RV_BNE: case RV_BLT:
+	case RV_BGE: case RV_BLTU: case RV_BGEU:
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		emit1(j, 0x39); emit1(j, 0xc8);	/* cmp eax, ecx */
+		emit1(j, 0x0f); emit1(j, jcc[d->op]);
+		emit4(j, 0);
+		taken = j->code_ptr - 4;
+		emit_exit(j, &b->exit[1], pc + RISCV32_INSN_LEN(d));
+		patch_rel32(taken, j->code_ptr);
+		emit_exit(j, &b->exit[0], pc + d->imm);
+	break;
+
+	case RV_LB: case RV_LH: case RV_LW: case RV_LBU: case RV_LHU: {
+		static const uint8_t size[] = {
+			[RV_LB] = 1, [RV_LH] = 2, [RV_LW] = 4, [RV_LBU] = 1, [RV_LHU] = 2,
+		};
+		emit_addr(j, m, d, size[d->op], pc, restore);
+		emit1(j, 0x41);			/* eax = [r12 + rax] */
+		switch (d->op) {
+		case RV_LB: emit1(j, 0x0f); emit1(j, 0xbe); break;
+		case RV_LH: emit1(j, 0x0f); emit1(j, 0xbf); break;
+		case RV_LBU: emit1(j, 0x0f); emit1(j, 0xb6); break;
+		case RV_LHU: emit1(j, 0x0f); emit1(j, 0xb7); break;
+		default: emit1(j, 0x8b); break;
+		}
+		emit1(j, 0x04); emit1(j, 0x04);
+		store_reg(j, EAX, d->rd);
+	} break;
+
+	case RV_SB: case RV_SH: case RV_SW:
+		emit_addr(j, m, d, d->op == RV_SB ? 1 : d->op == RV_SH ? 2 : 4, pc, restore);
+		/* stores near translated code are left to the interpreter */
+		emit1(j, 0x89); emit1(j, 0xc2);	/* mov edx, eax */
+		emit1(j, 0xc1); emit1(j, 0xea); emit1(j, RISCV32_CODE_SHIFT);	/* shr edx, n */
+		emit1(j, 0x41); emit1(j, 0x80); emit1(j, 0x3c);	/* cmp byte [r15 + rdx], 0 */
+		emit1(j, 0x17); emit1(j, 0x00);
+		emit_jcc_interp(j, 0x85, pc, restore);	/* jne */
+		load_reg(j, ECX, d->rs2);
+		if (d->op == RV_SH)
+			emit1(j, 0x66);
+		emit1(j, 0x41);			/* [r12 + rax] = ecx */
+		emit1(j, d->op == RV_SB ? 0x88 : 0x89);
+		emit1(j, 0x0c); emit1(j, 0x04);
+	break;
+
+	case RV_ADDI: case RV_XORI: case RV_ORI: case RV_ANDI:
+		if (d->rd == 32)
+			break;
+		if (d->rs1 == 0) {
+			uint32_t v = d->op == RV_ANDI ? 0 : d->imm;
+			store_reg_imm(j, d->rd, v);
+			break;
+		}
+		load_reg(j, EAX, d->rs1);
+		emit1(j, alu_ri[d->op]);
+		emit4(j, d->imm);
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_SLTI: case RV_SLTIU:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		emit1(j, 0x3d);			/* cmp eax, imm32 */
+		emit4(j, d->imm);
+		emit_setcc(j, d->op == RV_SLTI ? 0x9c : 0x92);
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_SLLI: case RV_SRLI: case RV_SRAI:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		emit1(j, 0xc1); emit1(j, shift_ri[d->op]); emit1(j, d->imm);
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_ADD: case RV_SUB: case RV_AND: case RV_OR: case RV_XOR:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		emit1(j, alu_rr[d->op]); emit1(j, 0xc8);	/* op eax, ecx */
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_SLL: case RV_SRL: case RV_SRA:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		emit1(j, 0xd3); emit1(j, shift_rr[d->op]);	/* op eax, cl */
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_SLT: case RV_SLTU:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		emit1(j, 0x39); emit1(j, 0xc8);	/* cmp eax, ecx */
+		emit_setcc(j, d->op == RV_SLT ? 0x9c : 0x92);
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_MUL: case RV_MULH: case RV_MULHSU: case RV_MULHU:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		if (d->op == RV_MUL) {
+			emit1(j, 0x0f); emit1(j, 0xaf); emit1(j, 0xc1);	/* imul eax, ecx */
+		} else {
+			if (d->op != RV_MULHU) {
+				emit1(j, 0x48); emit1(j, 0x63); emit1(j, 0xc0);	/* movsxd rax, eax */
+			}
+			if (d->op == RV_MULH) {
+				emit1(j, 0x48); emit1(j, 0x63); emit1(j, 0xc9);	/* movsxd rcx, ecx */
+			}
+			emit1(j, 0x48); emit1(j, 0x0f); emit1(j, 0xaf); emit1(j, 0xc1);	/* imul rax, rcx */
+			emit1(j, 0x48); emit1(j, 0xc1);		/* sar/shr rax, 32 */
+			emit1(j, d->op == RV_MULHU ? 0xe8 : 0xf8);
+			emit1(j, 32);
+		}
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_DIV: case RV_DIVU: case RV_REM: case RV_REMU:
+		if (d->rd == 32)
+			break;
+		load_reg(j, EAX, d->rs1);
+		load_reg(j, ECX, d->rs2);
+		emit_call(j, d->op == RV_DIV ? jit_div32 : d->op == RV_DIVU ? jit_divu32 :
+			d->op == RV_REM ? jit_rem32 : jit_remu32);
+		store_reg(j, EAX, d->rd);
+	break;
+
+	case RV_FENCE:
+	break;
+
+	default:
+		return false;
+	}
+	return true;
+}
+
+static void jit_flush(struct riscv32_vm *m)
+{
+	struct riscv32_jit *j = m->jit;
+
+	/* code_map stays: the regions may still hold decoded instructions */
+	memset(j->blocks, 0, sizeof(j->blocks));
+	j->nblocks = 0;
+	j->ncompiled = 0;
+	j->code_ptr = j->code_start;
+}
+
+static void jit_mark_code(struct riscv32_vm *m, uint32_t start, uint32_t end)
+{
+	uint32_t i = start >> RISCV32_CODE_SHIFT;
+
+	/* the region before the block too, so the start of a store that
+	 * straddles into the block is enough to catch it */
+	if (i > 0)
+		i--;
+	for (; i <= (end - 1) >> RISCV32_CODE_SHIFT && i < m->jit->code_map_size; i++)
+		m->code_map[i] = 1;
+}
+
+/* a clone starts with the decoded instructions of its snapshot; nothing
+ * reads code_map before the first block, so short lived vms skip this */
+static void jit_seed(struct riscv32_vm *m)
+{
+	uint32_t i;
+
+	for (i = 0; i < RISCV32_ICACHE_SIZE; i++) {
+		if (m->icache[i].pc != RISCV32_ICACHE_INVALID)
+			riscv32_code_mark(m, m->icache[i].pc);
+	}
+	m->jit->seeded = 1;
+}
+
+static void jit_compile(struct riscv32_vm *m, struct jit_block *b)
+{
+	struct riscv32_jit *j = m->jit;
+	struct riscv32_insn *d, tmp;
+	uint32_t pc = b->pc, n = 0, ninsns = b->ninsns;
+	uint8_t *nofuel;
+	unsigned i;
+
+	if (j->code_end - j->code_ptr < JIT_MAX_BYTES)
+		return;
+	if (!j->seeded)
+		jit_seed(m);
+
+	b->code = j->code_ptr;
+	j->nfixups = 0;
+
+	emit1(j, 0x41); emit1(j, 0x81); emit1(j, 0xfe);	/* cmp r14d, ninsns */
+	emit4(j, ninsns);
+	emit1(j, 0x0f); emit1(j, 0x82);			/* jb nofuel */
+	emit4(j, 0);
+	nofuel = j->code_ptr - 4;
+	emit1(j, 0x41); emit1(j, 0x81); emit1(j, 0xee);	/* sub r14d, ninsns */
+	emit4(j, ninsns);
+
+	for (n = 0; n < ninsns; n++) {
+		d = riscv32_fetch(m, pc);
+		if (d)
+			d = riscv32_unfuse(d, &tmp);
+		if (d == NULL || !jit_translatable(d) ||
+			(jit_terminator(d) && n != ninsns - 1) ||
+			!jit_insn(j, m, b, d, pc, ninsns - n)) {
+			/* the code changed under the block, retranslate later */
+			j->code_ptr = b->code;
+			b->code = NULL;
+			b->count = 0;
+			return;
+		}
+		pc += RISCV32_INSN_LEN(d);
+	}
+	if (!jit_terminator(d))
+		emit_exit(j, &b->exit[0], pc);
+
+	patch_rel32(nofuel, j->code_ptr);
+	store_imm(j, CPU_PC, b->pc);
+	emit1(j, 0x31); emit1(j, 0xc0);			/* xor eax, eax */
+	emit_leave(j);
+
+	for (i = 0; i < j->nfixups; i++) {
+		patch_rel32(j->fixups[i].rel, j->code_ptr);
+		store_imm(j, CPU_PC, j->fixups[i].pc);
+		emit1(j, 0x41); emit1(j, 0x81); emit1(j, 0xc6);	/* add r14d, restore */
+		emit4(j, j->fixups[i].restore);
+		emit1(j, 0xb8);					/* mov eax, JIT_EXIT_INTERP */
+		emit4(j, JIT_EXIT_INTERP);
+		emit_leave(j);
+	}
+
+	jit_mark_code(m, b->pc, b->end);
+	j->compiled[j->ncompiled++] = b;
+}
+
+/* find or create the block starting at pc, NULL when the table is full */
+static struct jit_block *jit_block(struct riscv32_vm *m, uint32_t pc)
+{
+	struct riscv32_jit *j = m->jit;
+	struct riscv32_insn *d, tmp;
+	struct jit_block *b;
+	uint32_t i = (pc >> 1) & (JIT_BLOCKS - 1);
+
+	for (;; i = (i + 1) & (JIT_BLOCKS - 1)) {
+		b = &j->blocks[i];
+		if (b->end == 0)
+			break;
+		if (b->pc == pc)
+			return b;
+	}
+
+	if (j->nblocks >= JIT_BLOCKS / 4 * 3)
+		return NULL;
+
+	j->nblocks++;
+	b->pc = pc;
+	b->end = pc;
+	b->ninsns = 0;
+	b->count = 0;
+	b->code = NULL;
+	while (b->ninsns < JIT_MAX_INSNS) {
+		d = riscv32_fetch(m, b->end);
+		if (d)
+			d = riscv32_unfuse(d, &tmp);
+		if (d == NULL || !jit_translatable(d))
+			break;
+		b->end += RISCV32_INSN_LEN(d);
+		b->ninsns++;
+		if (jit_terminator(d))
+			break;
+	}
+	if (b->ninsns == 0)
+		b->end = pc + 4;
+	return b;
+}
+
+static int jit_init(struct riscv32_vm *m)
+{
+	struct riscv32_jit *j;
+	uint8_t *code;
+
+	code = mmap(NULL, RISCV32_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return -1;
+
+	j = calloc(1, sizeof(*j));
+	if (j)
+		j->code_map_size = (m->memsize >> RISCV32_CODE_SHIFT) + 1;
+	m->code_map = j ? calloc(1, j->code_map_size) : NULL;
+	if (m->code_map == NULL) {
+		free(j);
+		munmap(code, RISCV32_JIT_CODE_SIZE);
+		return -1;
+	}
+	j->code = j->code_ptr = code;
+	j->code_end = code + RISCV32_JIT_CODE_SIZE;
+
+	/* void *enter(struct riscv32_cpu *c, void *code, struct jit_ctx *ctx) */
+	j->enter = (void *)j->code_ptr;
+	emit1(j, 0x53);					/* push rbx */
+	emit1(j, 0x55);					/* push rbp */
+	emit1(j, 0x41); emit1(j, 0x54);			/* push r12 */
+	emit1(j, 0x41); emit1(j, 0x55);			/* push r13 */
+	emit1(j, 0x41); emit1(j, 0x56);			/* push r14 */
+	emit1(j, 0x41); emit1(j, 0x57);			/* push r15 */
+	emit1(j, 0x48); emit1(j, 0x83); emit1(j, 0xec); emit1(j, 8);	/* sub rsp, 8 */
+	emit1(j, 0x48); emit1(j, 0x89); emit1(j, 0xfb);	/* mov rbx, rdi */
+	emit1(j, 0x48); emit1(j, 0x89); emit1(j, 0xd5);	/* mov rbp, rdx */
+	emit1(j, 0x4c); emit1(j, 0x8b); emit1(j, 0x65);	/* mov r12, [rbp + mem] */
+	emit1(j, offsetof(struct jit_ctx, mem));
+	emit1(j, 0x4c); emit1(j, 0x8b); emit1(j, 0x7d);	/* mov r15, [rbp + code_map] */
+	emit1(j, offsetof(struct jit_ctx, code_map));
+	emit1(j, 0x44); emit1(j, 0x8b); emit1(j, 0x75);	/* mov r14d, [rbp + budget] */
+	emit1(j, offsetof(struct jit_ctx, budget));
+	emit1(j, 0xff); emit1(j, 0xe6);			/* jmp rsi */
+
+	j->epilogue = j->code_ptr;
+	emit1(j, 0x44); emit1(j, 0x89); emit1(j, 0x75);	/* mov [rbp + budget], r14d */
+	emit1(j, offsetof(struct jit_ctx, budget));
+	emit1(j, 0x48); emit1(j, 0x83); emit1(j, 0xc4); emit1(j, 8);	/* add rsp, 8 */
+	emit1(j, 0x41); emit1(j, 0x5f);			/* pop r15 */
+	emit1(j, 0x41); emit1(j, 0x5e);			/* pop r14 */
+	emit1(j, 0x41); emit1(j, 0x5d);			/* pop r13 */
+	emit1(j, 0x41); emit1(j, 0x5c);			/* pop r12 */
+	emit1(j, 0x5d);					/* pop rbp */
+	emit1(j, 0x5b);					/* pop rbx */
+	emit1(j, 0xc3);					/* ret */
+	j->code_start = j->code_ptr;
+
+	m->jit = j;
+	return 0;
+}
+
+void riscv32_jit_free(struct riscv32_vm *m)
+{
+	struct riscv32_jit *j = m->jit;
+
+	if (j == NULL)
+		return;
+
+	munmap(j->code, RISCV32_JIT_CODE_SIZE);
+	free(m->code_map);
+	free(j);
+	m->code_map = NULL;
+	m->jit = NULL;
+}
+
+void riscv32_jit_invalidate(struct riscv32_vm *m, uint32_t base, uint32_t size)
+{
+	struct riscv32_jit *j = m->jit;
+	uint64_t end = (uint64_t)base + size;
+	struct jit_block *b;
+	unsigned i;
+
+	if (j == NULL)
+		return;
+
+	/* rare enough (self modifying code, host writes over code) that
+	 * dropping every translation beats tracking chains per block */
+	for (i = 0; i < j->ncompiled; i++) {
+		b = j->compiled[i];
+		if (b->pc < end && b->end > base) {
+			jit_flush(m);
+			return;
+		}
+	}
+}
+
+unsigned riscv32_run_jit(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	struct riscv32_cpu *c = &m->cpu;
+	struct jit_ctx ctx;
+	struct jit_block *b, *t;
+	struct jit_exit *e;
+	unsigned n = 0, k;
+	int reason;
+
+	if (m->jit == NULL && jit_init(m)) {
+		/* no executable memory, stay on the interpreter */
+		m->engine = RISCV32_ENGINE_THREADED;
+		return riscv32_run_interp(m, max_insns, exit_reason);
+	}
+
+	ctx.mem = m->mem;
+	ctx.code_map = m->code_map;
+
+	while (n < max_insns) {
+		b = jit_block(m, c->pc);
+		if (b == NULL) {
+			jit_flush(m);
+			continue;
+		}
+
+		if (b->code == NULL && b->ninsns && ++b->count >= RISCV32_JIT_HOT)
+			jit_compile(m, b);
+
+		if (b->code && b->ninsns <= max_insns - n) {
+			ctx.budget = max_insns - n;
+			e = m->jit->enter(c, b->code, &ctx);
+			m->instret += max_insns - n - ctx.budget;
+			n = max_insns - ctx.budget;
+
+			if ((uintptr_t)e == JIT_EXIT_INTERP) {
+				k = riscv32_run_interp(m, 1, &reason);
+			} else {
+				if (e && e->jmp && (t = jit_block(m, e->target)) && t->code) {
+					patch_rel32(e->jmp + 1, t->code);
+					e->jmp = NULL;
+				}
+				continue;
+			}
+		} else {
+			k = b->ninsns ? b->ninsns : 1;
+			if (k > max_insns - n)
+				k = max_insns - n;
+			k = riscv32_run_interp(m, k, &reason);
+		}
+
+		n += k;
+		if (reason != RISCV32_EXIT_BUDGET) {
+			*exit_reason = reason;
+			return n;
+		}
+	}
+
+	*exit_reason = RISCV32_EXIT_BUDGET;
+	return n;
+}
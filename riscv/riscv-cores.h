@@ -0,0 +1,190 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+/*
+ * The interpreter cores, included by riscv.c once per memory backend.
+ * The includer defines RISCV32_RUN_SWITCH and RISCV32_RUN_THREADED to
+ * name the cores and GUARDED to 1 when guest memory is a guarded
+ * reservation whose faults arrive as SIGSEGV instead of failed bounds
+ * checks.  The register file lives in m->reg so a fault can recover it.
+ * WATCHED builds a switch core that checks watchpoints, without
+ * RISCV32_RUN_THREADED.  TRACED adds reporting every pc that does not
+ * follow the instruction before it to m->trace.
+ */
+#ifndef WATCHED
+#define WATCHED		0
+#endif
+#ifndef TRACED
+#define TRACED		0
+#endif
+#define ACCESS		((GUARDED ? RISCV32_ACCESS_GUARD : 0) | \
+			 (WATCHED ? RISCV32_ACCESS_WATCH : 0))
+
+/* the switch core: one shared dispatch point for every instruction */
+static unsigned RISCV32_RUN_SWITCH(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	int reason = RISCV32_EXIT_BUDGET, rc;
+	uint32_t addr, val, val2, cause, tval = 0;
+	uint32_t *reg = m->reg, pc;
+	struct riscv32_cpu *c = &m->cpu;
+	struct riscv32_insn *d;
+	unsigned n;
+#if TRACED
+	uint32_t next = m->trace->next, prev;
+	unsigned prev_n;
+#endif
+
+	memcpy(reg, c->reg, sizeof(c->reg));
+	reg[0] = 0;
+	pc = c->pc;
+
+	for (n = 0; n < max_insns; n++) {
+#if WATCHED
+		/* stop once the access a watchpoint covers has retired */
+		if (m->debug->hit) {
+			reason = RISCV32_EXIT_DEBUG;
+			goto out;
+		}
+#endif
+#if TRACED
+		/* a taken branch, a jump, a trap or the host moved pc */
+		if (pc != next) {
+			riscv32_trace_flow(m, n, pc);
+			next = pc;
+		}
+		prev = pc;
+		prev_n = n;
+#endif
+		d = riscv32_fetch(m, pc);
+		if (d == NULL) {
+			cause = CAUSE_FAULT_FETCH;
+			tval = pc;
+			goto trap;
+		}
+
+		//printf("insn: %08x op = %02x, rs1 = %02x, rs2 = %02x, rd = %02x\n",
+		//	d->insn, d->op, d->rs1, d->rs2, d->rd);
+
+		switch (d->op) {
+		default:
+#define OP(name)	case RV_##name:
+#define NEXT		break;
+#include "riscv-ops.h"
+#undef OP
+#undef NEXT
+		}
+#if TRACED
+		/* a fused pair retires two 32 bit instructions */
+		next = prev + (n != prev_n ? 8 : (d->insn & 3) == 3 ? 4 : 2);
+#endif
+	}
+
+out:
+#if TRACED
+	/* ops that leave the loop do not update next */
+	if (pc != next)
+		riscv32_trace_flow(m, n, pc);
+	m->trace->next = pc;
+#endif
+	memcpy(c->reg, reg, sizeof(c->reg));
+	c->pc = pc;
+	m->instret += n;
+	*exit_reason = reason;
+	return n;
+
+irq:
+	/* retired, and an interrupt may be due */
+	reason = RISCV32_EXIT_IRQ;
+	n++;
+	goto out;
+illegal_insn:
+	cause = CAUSE_ILLEGAL_INSTRUCTION;
+	tval = d->insn;
+trap:
+	reason = RISCV32_EXIT_TRAP;
+exception:
+	c->pc = pc;
+	raise_exception2(c, cause, tval);
+	pc = c->pc;
+	goto out;
+}
+
+#if defined(__GNUC__) && defined(RISCV32_RUN_THREADED)
+/* the threaded core: every handler fetches and jumps to its successor
+ * itself, so the host predicts each dispatch branch separately */
+static unsigned RISCV32_RUN_THREADED(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	static const void *const dispatch[RV_NR_OPS] = {
+#define X(name) [RV_##name] = &&op_##name,
+		RV_OPS(X)
+#undef X
+	};
+	int reason = RISCV32_EXIT_BUDGET, rc;
+	uint32_t addr, val, val2, cause, tval = 0;
+	uint32_t *reg = m->reg, pc;
+	struct riscv32_cpu *c = &m->cpu;
+	struct riscv32_insn *d;
+	unsigned n = 0;
+
+	memcpy(reg, c->reg, sizeof(c->reg));
+	reg[0] = 0;
+	pc = c->pc;
+
+	if (max_insns == 0)
+		goto out;
+
+#define DISPATCH()						\
+	do {							\
+		d = riscv32_fetch(m, pc);			\
+		if (d == NULL)					\
+			goto fetch_fault;			\
+		goto *dispatch[d->op];				\
+	} while (0)
+#define OP(name)	op_##name:
+#define NEXT								\
+	if (++n >= max_insns)						\
+		goto out;						\
+	DISPATCH();
+
+	DISPATCH();
+#include "riscv-ops.h"
+#undef OP
+#undef NEXT
+#undef DISPATCH
+
+out:
+	memcpy(c->reg, reg, sizeof(c->reg));
+	c->pc = pc;
+	m->instret += n;
+	*exit_reason = reason;
+	return n;
+
+fetch_fault:
+	cause = CAUSE_FAULT_FETCH;
+	tval = pc;
+	goto trap;
+irq:
+	/* retired, and an interrupt may be due */
+	reason = RISCV32_EXIT_IRQ;
+	n++;
+	goto out;
+illegal_insn:
+	cause = CAUSE_ILLEGAL_INSTRUCTION;
+	tval = d->insn;
+trap:
+	reason = RISCV32_EXIT_TRAP;
+exception:
+	c->pc = pc;
+	raise_exception2(c, cause, tval);
+	pc = c->pc;
+	goto out;
+}
+#endif
+
+#undef RISCV32_RUN_SWITCH
+#undef RISCV32_RUN_THREADED
+#undef GUARDED
+#undef WATCHED
+#undef TRACED
+#undef ACCESS
@@ -0,0 +1,341 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __RISCV_INTERNAL_H__
+#define __RISCV_INTERNAL_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "riscv.h"
+
+#if defined(RISCV_THREADED) && defined(__GNUC__)
+#define RISCV32_ENGINE_DEFAULT	RISCV32_ENGINE_THREADED
+#else
+#define RISCV32_ENGINE_DEFAULT	RISCV32_ENGINE_SWITCH
+#endif
+
+/* decoded instruction cache, direct mapped by halfword and tagged by
+ * guest pc */
+#ifndef RISCV32_ICACHE_BITS
+#define RISCV32_ICACHE_BITS	14
+#endif
+#define RISCV32_ICACHE_SIZE	(1u << RISCV32_ICACHE_BITS)
+#define RISCV32_ICACHE_MASK	(RISCV32_ICACHE_SIZE - 1)
+#define RISCV32_ICACHE_INVALID	0xffffffff	/* never a valid (even) pc */
+
+/* decoded handler indices; the M extension ops keep funct3 order */
+#define RV_OPS(X)							\
+	X(ILLEGAL)							\
+	X(LUI) X(AUIPC) X(JAL) X(JALR)					\
+	X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU)			\
+	X(LB) X(LH) X(LW) X(LBU) X(LHU)					\
+	X(SB) X(SH) X(SW)						\
+	X(ADDI) X(SLTI) X(SLTIU) X(XORI) X(ORI) X(ANDI)			\
+	X(SLLI) X(SRLI) X(SRAI)						\
+	X(ADD) X(SUB) X(SLL) X(SLT) X(SLTU) X(XOR)			\
+	X(SRL) X(SRA) X(OR) X(AND)					\
+	X(MUL) X(MULH) X(MULHSU) X(MULHU)				\
+	X(DIV) X(DIVU) X(REM) X(REMU)					\
+	X(FENCE) X(FENCE_I)						\
+	X(CSRRW) X(CSRRS) X(CSRRC) X(CSRRWI) X(CSRRSI) X(CSRRCI)	\
+	X(ECALL) X(EBREAK) X(MRET) X(WFI) X(BREAKPOINT)		\
+	X(C_LUI) X(C_JAL) X(C_JALR) X(C_BEQ) X(C_BNE)			\
+	X(C_LW) X(C_SW) X(C_ADDI) X(C_ANDI)				\
+	X(C_SLLI) X(C_SRLI) X(C_SRAI)					\
+	X(C_ADD) X(C_SUB) X(C_XOR) X(C_OR) X(C_AND)			\
+	X(LUI_ADDI) X(AUIPC_ADDI) X(AUIPC_JALR) X(AUIPC_LW)		\
+	X(SLT_BEQ) X(SLT_BNE) X(SLTU_BEQ) X(SLTU_BNE)			\
+	X(MULH_MUL) X(MULHSU_MUL) X(MULHU_MUL)				\
+	X(DIV_REM) X(DIVU_REMU)
+
+enum {
+#define X(name) RV_##name,
+	RV_OPS(X)
+#undef X
+	RV_NR_OPS,
+};
+
+/* RV_C_* are compressed instructions: the base op with length 2 */
+#define RV_RVC		RV_C_LUI
+
+/* ops from here on are pairs fused by the decoder */
+#define RV_FUSED	RV_LUI_ADDI
+
+#ifdef RISCV_FUSION_STATS
+#define RISCV32_FUSED(m, kind)	((m)->fused[kind]++)
+#else
+#define RISCV32_FUSED(m, kind)	((void)0)
+#endif
+
+struct riscv32_insn {
+	uint32_t pc;		/* tag, RISCV32_ICACHE_INVALID if empty */
+	uint8_t op;		/* RV_* handler index */
+	uint8_t rd;		/* 32 when the destination is x0 */
+	uint8_t rs1;		/* register number, or zimm for csr*i */
+	uint8_t rs2;
+	int32_t imm;		/* sign extended immediate, shamt, csr number
+				 * or a fused pair's second rd */
+	uint32_t insn;		/* raw bits (of the first of a fused pair); a
+				 * compressed instruction keeps its 32 bit
+				 * expansion with bit 1 clear */
+};
+
+/* 2 for a compressed instruction, else 4 */
+#define RISCV32_INSN_LEN(d)	(((d)->insn & 2) + 2)
+
+void riscv32_decode(struct riscv32_insn *d, uint32_t insn);
+struct riscv32_insn *riscv32_decode_at(struct riscv32_vm *m, struct riscv32_insn *d, uint32_t pc);
+
+/* slot d changes, a pool reset has to undo it */
+static inline void riscv32_icache_touch(struct riscv32_vm *m, struct riscv32_insn *d)
+{
+	uint32_t i = d - m->icache;
+
+	if (i < m->icache_lo)
+		m->icache_lo = i;
+	if (i > m->icache_hi)
+		m->icache_hi = i;
+}
+
+/* return the decoded instruction at pc, decoding it on a cache miss,
+ * or NULL if pc can not be fetched */
+static inline struct riscv32_insn *riscv32_fetch(struct riscv32_vm *m, uint32_t pc)
+{
+	struct riscv32_insn *d = &m->icache[(pc >> 1) & RISCV32_ICACHE_MASK];
+
+	if (d->pc == pc)
+		return d;
+
+	return riscv32_decode_at(m, d, pc);
+}
+
+/* the first instruction of a fused pair on its own, or a compressed one
+ * with its base op, decoded into tmp, for users that work one instruction
+ * at a time; RISCV32_INSN_LEN() still holds for the result */
+static inline struct riscv32_insn *riscv32_unfuse(struct riscv32_insn *d, struct riscv32_insn *tmp)
+{
+	if (d->op < RV_RVC)
+		return d;
+
+	riscv32_decode(tmp, d->insn | 2);
+	tmp->insn = d->insn;
+	tmp->pc = d->pc;
+	return tmp;
+}
+
+/* hosts where guest memory can be mmap()ed, and those with room to
+ * reserve the whole 32 bit guest space for RISCV32_VM_GUARD */
+#ifdef __unix__
+#define RISCV32_HAVE_MMAP
+#if UINTPTR_MAX > 0xffffffffu
+#define RISCV32_HAVE_GUARD
+#endif
+#endif
+
+struct riscv32_vm *riscv32_vm_alloc(unsigned memsize, unsigned flags);
+int riscv32_mem_commit(struct riscv32_vm *m, uint32_t base, uint32_t size, bool force);
+
+/* of a vm with riscv32_vm_limit: whether any access has touched the page
+ * of addr, the others are still inaccessible */
+static inline bool riscv32_mem_committed(struct riscv32_vm *m, uint32_t addr)
+{
+	uint32_t p = addr >> m->mem_shift;
+
+	return m->mem_pages[p >> 3] & (1 << (p & 7));
+}
+void riscv32_icache_invalidate_range(struct riscv32_vm *m, uint32_t base, uint32_t size);
+void riscv32_symtab_free(struct riscv32_vm *vm);
+uint64_t riscv32_time(struct riscv32_vm *m);
+void riscv32_set_time(struct riscv32_vm *m, uint64_t time);
+#ifdef RISCV32_HAVE_MMAP
+int riscv32_vm_map(struct riscv32_vm *vm, unsigned memsize, int fd, uint64_t off);
+#endif
+
+unsigned riscv32_run_interp(struct riscv32_vm *m, unsigned max_insns, int *exit_reason);
+
+/* translated code tracking: m->code_map has one byte per
+ * 1 << RISCV32_CODE_SHIFT guest bytes, set when a translated block may
+ * cover them, so stores only look further when they hit code */
+#define RISCV32_CODE_SHIFT	8
+
+/* how a core reaches guest memory, the mode of the access helpers */
+#define RISCV32_ACCESS_GUARD	(1 << 0)	/* not bounds checked, faults arrive as SIGSEGV */
+#define RISCV32_ACCESS_WATCH	(1 << 1)	/* watchpoints are checked */
+#define RISCV32_ACCESS_FETCH	(1 << 2)	/* an instruction, never a device */
+
+/* a core stopped because an interrupt may have become deliverable;
+ * riscv32_cpu_run takes it and goes on, its callers never see this */
+#define RISCV32_EXIT_IRQ	0x100
+/* instructions between two looks for a due interrupt while any is enabled */
+#define RISCV32_IRQ_SLICE	10000
+
+/*
+ * Debugger state, allocated by the first breakpoint or watchpoint.
+ * Breakpoints are looked up when an instruction is decoded, so they cost
+ * nothing once the icache holds them.  Watchpoints need the watching core,
+ * whose every access tests a bit per 1 << RISCV32_WATCH_SHIFT byte page
+ * and only compares against the list on a page that has one.
+ */
+#define RISCV32_WATCH_SHIFT	12
+#define RISCV32_MAX_WATCH	16
+
+struct riscv32_watch {
+	uint32_t addr;
+	uint32_t len;
+	int type;
+};
+
+struct riscv32_debug {
+	uint32_t *breaks;	/* open addressed set, RISCV32_ICACHE_INVALID is empty */
+	unsigned nbreaks;
+	unsigned break_mask;	/* slots - 1 */
+	struct riscv32_watch watch[RISCV32_MAX_WATCH];
+	unsigned nwatch;
+	uint8_t *watch_pages;
+	int hit;		/* type of the watchpoint that stops the vm */
+	uint32_t hit_addr;
+};
+
+struct riscv32_debug *riscv32_debug_get(struct riscv32_vm *m);
+int riscv32_break_at(struct riscv32_debug *g, uint32_t pc);
+void riscv32_watch_hit(struct riscv32_vm *m, uint32_t addr, uint32_t size, int type);
+void riscv32_debug_free(struct riscv32_vm *m);
+
+/*
+ * An execution trace, see trace.c.  The traced core keeps next, the pc
+ * that follows the last instruction it ran, and reports every other pc
+ * it finds through riscv32_trace_flow.
+ */
+struct riscv32_trace {
+	uint32_t next;
+	uint8_t *ring;
+	_Atomic uint64_t head;	/* free running, written by the vm */
+	_Atomic uint64_t tail;	/* free running, written by the writer */
+	uint64_t kick;		/* head when the writer was last woken */
+	uint32_t last;		/* target of the last record */
+	uint64_t mark;		/* instret at the last record */
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t data;	/* records queued, or stop set */
+	pthread_cond_t space;	/* the writer freed the ring */
+	bool waiting;		/* the vm sleeps on space */
+	bool stop;
+	bool failed;		/* a write failed, records are dropped */
+};
+
+void riscv32_trace_flow(struct riscv32_vm *m, unsigned n, uint32_t pc);
+
+#ifdef RISCV_JIT
+unsigned riscv32_run_jit(struct riscv32_vm *m, unsigned max_insns, int *exit_reason);
+void riscv32_jit_free(struct riscv32_vm *m);
+void riscv32_jit_invalidate(struct riscv32_vm *m, uint32_t base, uint32_t size);
+#endif
+
+/* decoded instructions count as code too: a translated store that lands
+ * on one must reach the interpreter, which drops its slot.  Like a block,
+ * the region before is marked when pc is near its end */
+static inline void riscv32_code_mark(struct riscv32_vm *m, uint32_t pc)
+{
+	uint32_t i = pc >> RISCV32_CODE_SHIFT;
+	uint64_t end = ((uint64_t)pc + 7) >> RISCV32_CODE_SHIFT;
+
+	if (m->code_map == NULL)
+		return;
+	if (i > 0 && (pc & ((1u << RISCV32_CODE_SHIFT) - 1)) < 4)
+		i--;
+	for (; i <= end && i <= m->memsize >> RISCV32_CODE_SHIFT; i++)
+		m->code_map[i] = 1;
+}
+
+static inline void riscv32_code_invalidate(struct riscv32_vm *m, uint32_t addr, uint32_t size)
+{
+#ifdef RISCV_JIT
+	if (m->code_map && m->code_map[addr >> RISCV32_CODE_SHIFT])
+		riscv32_jit_invalidate(m, addr, size);
+#endif
+}
+
+static inline int32_t div32(int32_t a, int32_t b)
+{
+    if (b == 0) {
+        return -1;
+    } else if (a == ((int32_t)1 << (32 - 1)) && b == -1) {
+        return a;
+    } else {
+        return a / b;
+    }
+}
+
+static inline uint32_t divu32(uint32_t a, uint32_t b)
+{
+    if (b == 0) {
+        return -1;
+    } else {
+        return a / b;
+    }
+}
+
+static inline int32_t rem32(int32_t a, int32_t b)
+{
+    if (b == 0) {
+        return a;
+    } else if (a == ((int32_t)1 << (32 - 1)) && b == -1) {
+        return 0;
+    } else {
+        return a % b;
+    }
+}
+
+static inline uint32_t remu32(uint32_t a, uint32_t b)
+{
+    if (b == 0) {
+        return a;
+    } else {
+        return a % b;
+    }
+}
+
+static inline void divrem32(int32_t a, int32_t b, uint32_t *q, uint32_t *r)
+{
+    if (b == 0) {
+        *q = -1;
+        *r = a;
+    } else if (a == ((int32_t)1 << (32 - 1)) && b == -1) {
+        *q = a;
+        *r = 0;
+    } else {
+        *q = a / b;
+        *r = a % b;
+    }
+}
+
+static inline void divremu32(uint32_t a, uint32_t b, uint32_t *q, uint32_t *r)
+{
+    if (b == 0) {
+        *q = -1;
+        *r = a;
+    } else {
+        *q = a / b;
+        *r = a % b;
+    }
+}
+
+static inline uint32_t mulh32(int32_t a, int32_t b)
+{
+    return ((int64_t)a * (int64_t)b) >> 32;
+}
+
+static inline uint32_t mulhsu32(int32_t a, uint32_t b)
+{
+    return ((int64_t)a * (int64_t)b) >> 32;
+}
+
+static inline uint32_t mulhu32(uint32_t a, uint32_t b)
+{
+    return ((uint64_t)a * (uint64_t)b) >> 32;
+}
+
+#endif /* __RISCV_INTERNAL_H__*/
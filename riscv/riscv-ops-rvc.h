@@ -0,0 +1,106 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+/*
+ * Bodies of the ops an RV32C instruction can expand to, included twice by
+ * riscv-ops.h: RVC(name) opens the handler and LEN is the instruction
+ * length, 4 for the base op and 2 for its RV_C_* twin.  No include guard.
+ */
+
+RVC(LUI)
+	reg[d->rd] = d->imm;
+	pc += LEN;
+NEXT
+
+RVC(JAL)
+	reg[d->rd] = pc + LEN;
+	pc += d->imm;
+NEXT
+
+RVC(JALR)
+	addr = (reg[d->rs1] + d->imm) & ~1;
+	reg[d->rd] = pc + LEN;
+	pc = addr;
+NEXT
+
+RVC(BEQ)
+	pc += reg[d->rs1] == reg[d->rs2] ? d->imm : LEN;
+NEXT
+
+RVC(BNE)
+	pc += reg[d->rs1] != reg[d->rs2] ? d->imm : LEN;
+NEXT
+
+RVC(LW) {
+	uint32_t rval;
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_LOAD;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_read_u32(m, addr, &rval, ACCESS))
+		goto trap;
+	reg[d->rd] = rval;
+	pc += LEN;
+}
+NEXT
+
+RVC(SW)
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_STORE;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_write_u32(m, addr, reg[d->rs2], ACCESS))
+		goto trap;
+	pc += LEN;
+NEXT
+
+RVC(ADDI)
+	reg[d->rd] = reg[d->rs1] + d->imm;
+	pc += LEN;
+NEXT
+
+RVC(ANDI)
+	reg[d->rd] = reg[d->rs1] & d->imm;
+	pc += LEN;
+NEXT
+
+RVC(SLLI)
+	reg[d->rd] = reg[d->rs1] << d->imm;
+	pc += LEN;
+NEXT
+
+RVC(SRLI)
+	reg[d->rd] = reg[d->rs1] >> d->imm;
+	pc += LEN;
+NEXT
+
+RVC(SRAI)
+	reg[d->rd] = (int32_t)reg[d->rs1] >> d->imm;
+	pc += LEN;
+NEXT
+
+RVC(ADD)
+	reg[d->rd] = reg[d->rs1] + reg[d->rs2];
+	pc += LEN;
+NEXT
+
+RVC(SUB)
+	reg[d->rd] = reg[d->rs1] - reg[d->rs2];
+	pc += LEN;
+NEXT
+
+RVC(XOR)
+	reg[d->rd] = reg[d->rs1] ^ reg[d->rs2];
+	pc += LEN;
+NEXT
+
+RVC(OR)
+	reg[d->rd] = reg[d->rs1] | reg[d->rs2];
+	pc += LEN;
+NEXT
+
+RVC(AND)
+	reg[d->rd] = reg[d->rs1] & reg[d->rs2];
+	pc += LEN;
+NEXT
@@ -0,0 +1,474 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+/*
+ * Instruction semantics shared by the interpreter cores, one body per
+ * decoded RV_* op.  The including core defines OP(name) to open a
+ * handler and NEXT to close it, and provides the locals m, c, d, reg,
+ * pc, n, max_insns, addr, val, val2, cause, tval and reason and the labels
+ * illegal_insn, trap, exception and out.  GUARDED selects the memory
+ * backend and ACCESS how loads and stores reach it, see riscv-cores.h.
+ */
+
+OP(ILLEGAL)
+	goto illegal_insn;
+NEXT
+
+/* ops with a compressed form, once as themselves and once as the
+ * RV_C_* variant with a constant length, so neither loads it */
+#define RVC(name)	OP(name)
+#define LEN		4
+#include "riscv-ops-rvc.h"
+#undef RVC
+#undef LEN
+#define RVC(name)	OP(C_##name)
+#define LEN		2
+#include "riscv-ops-rvc.h"
+#undef RVC
+#undef LEN
+
+OP(AUIPC)
+	reg[d->rd] = pc + d->imm;
+	pc += 4;
+NEXT
+
+OP(BLT)
+	pc += (int32_t)reg[d->rs1] < (int32_t)reg[d->rs2] ? d->imm : 4;
+NEXT
+
+OP(BGE)
+	pc += (int32_t)reg[d->rs1] >= (int32_t)reg[d->rs2] ? d->imm : 4;
+NEXT
+
+OP(BLTU)
+	pc += reg[d->rs1] < reg[d->rs2] ? d->imm : 4;
+NEXT
+
+OP(BGEU)
+	pc += reg[d->rs1] >= reg[d->rs2] ? d->imm : 4;
+NEXT
+
+OP(LB) {
+	uint8_t rval;
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_LOAD;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_read_u8(m, addr, &rval, ACCESS))
+		goto trap;
+	reg[d->rd] = (int8_t)rval;
+	pc += 4;
+}
+NEXT
+
+OP(LH) {
+	uint16_t rval;
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_LOAD;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_read_u16(m, addr, &rval, ACCESS))
+		goto trap;
+	reg[d->rd] = (int16_t)rval;
+	pc += 4;
+}
+NEXT
+
+OP(LBU) {
+	uint8_t rval;
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_LOAD;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_read_u8(m, addr, &rval, ACCESS))
+		goto trap;
+	reg[d->rd] = rval;
+	pc += 4;
+}
+NEXT
+
+OP(LHU) {
+	uint16_t rval;
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_LOAD;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_read_u16(m, addr, &rval, ACCESS))
+		goto trap;
+	reg[d->rd] = rval;
+	pc += 4;
+}
+NEXT
+
+OP(SB)
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_STORE;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_write_u8(m, addr, reg[d->rs2], ACCESS))
+		goto trap;
+	pc += 4;
+NEXT
+
+OP(SH)
+	tval = addr = reg[d->rs1] + d->imm;
+	cause = CAUSE_FAULT_STORE;
+	if (GUARDED)
+		riscv32_guard_mark(m, pc, n);
+	if (riscv32_write_u16(m, addr, reg[d->rs2], ACCESS))
+		goto trap;
+	pc += 4;
+NEXT
+
+OP(SLTI)
+	reg[d->rd] = (int32_t)reg[d->rs1] < d->imm;
+	pc += 4;
+NEXT
+
+OP(SLTIU)
+	reg[d->rd] = reg[d->rs1] < (uint32_t)d->imm;
+	pc += 4;
+NEXT
+
+OP(XORI)
+	reg[d->rd] = reg[d->rs1] ^ d->imm;
+	pc += 4;
+NEXT
+
+OP(ORI)
+	reg[d->rd] = reg[d->rs1] | d->imm;
+	pc += 4;
+NEXT
+
+OP(SLL)
+	reg[d->rd] = reg[d->rs1] << (reg[d->rs2] & (32 - 1));
+	pc += 4;
+NEXT
+
+OP(SLT)
+	reg[d->rd] = (int32_t)reg[d->rs1] < (int32_t)reg[d->rs2];
+	pc += 4;
+NEXT
+
+OP(SLTU)
+	reg[d->rd] = reg[d->rs1] < reg[d->rs2];
+	pc += 4;
+NEXT
+
+OP(SRL)
+	reg[d->rd] = reg[d->rs1] >> (reg[d->rs2] & (32 - 1));
+	pc += 4;
+NEXT
+
+OP(SRA)
+	reg[d->rd] = (int32_t)reg[d->rs1] >> (reg[d->rs2] & (32 - 1));
+	pc += 4;
+NEXT
+
+OP(MUL)
+	reg[d->rd] = (int32_t)reg[d->rs1] * (int32_t)reg[d->rs2];
+	pc += 4;
+NEXT
+
+OP(MULH)
+	reg[d->rd] = mulh32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(MULHSU)
+	reg[d->rd] = mulhsu32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(MULHU)
+	reg[d->rd] = mulhu32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(DIV)
+	reg[d->rd] = div32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(DIVU)
+	reg[d->rd] = divu32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(REM)
+	reg[d->rd] = rem32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(REMU)
+	reg[d->rd] = remu32(reg[d->rs1], reg[d->rs2]);
+	pc += 4;
+NEXT
+
+OP(FENCE)
+	pc += 4;
+NEXT
+
+OP(FENCE_I)
+	riscv32_icache_invalidate_range(m, 0, m->memsize);
+	pc += 4;
+NEXT
+
+OP(CSRRW)
+	val = reg[d->rs1];
+csrrw:
+	if (csr_read(m, n, &val2, d->imm, true))
+		goto illegal_insn;
+	rc = csr_write(c, d->imm, val);
+	if (rc < 0)
+		goto illegal_insn;
+	reg[d->rd] = val2;
+	pc += 4;
+	if (rc)
+		goto irq;
+NEXT
+
+OP(CSRRS)
+	val = reg[d->rs1];
+csrrs:
+	if (csr_read(m, n, &val2, d->imm, (d->rs1 != 0)))
+		goto illegal_insn;
+	rc = d->rs1 != 0 ? csr_write(c, d->imm, val2 | val) : 0;
+	if (rc < 0)
+		goto illegal_insn;
+	reg[d->rd] = val2;
+	pc += 4;
+	if (rc)
+		goto irq;
+NEXT
+
+OP(CSRRC)
+	val = reg[d->rs1];
+csrrc:
+	if (csr_read(m, n, &val2, d->imm, (d->rs1 != 0)))
+		goto illegal_insn;
+	rc = d->rs1 != 0 ? csr_write(c, d->imm, val2 & ~val) : 0;
+	if (rc < 0)
+		goto illegal_insn;
+	reg[d->rd] = val2;
+	pc += 4;
+	if (rc)
+		goto irq;
+NEXT
+
+OP(CSRRWI)
+	val = d->rs1;
+	goto csrrw;
+NEXT
+
+OP(CSRRSI)
+	val = d->rs1;
+	goto csrrs;
+NEXT
+
+OP(CSRRCI)
+	val = d->rs1;
+	goto csrrc;
+NEXT
+
+OP(ECALL)
+#ifndef	RISCV_ECALL
+	reason = RISCV32_EXIT_ECALL;
+	pc += 4;
+	n++;
+	goto out;
+#else
+	/* delivered to the guest handler, not a stop */
+	c->pc = pc;
+	raise_exception2(c, CAUSE_MACHINE_ECALL, 0);
+	pc = c->pc;
+#endif
+NEXT
+
+OP(EBREAK)
+	reason = RISCV32_EXIT_EBREAK;
+	cause = CAUSE_BREAKPOINT;
+	goto exception;
+NEXT
+
+OP(MRET)
+	rc = handle_mret(c);
+	pc = c->pc;
+	if (rc)
+		goto irq;
+NEXT
+
+OP(WFI)
+	/* the host decides whether to wait, run someone else or resume */
+	reason = RISCV32_EXIT_WFI;
+	pc += 4;
+	n++;
+	goto out;
+NEXT
+
+OP(BREAKPOINT)
+	/* a debugger's, decoded over the instruction that has not run yet */
+	reason = RISCV32_EXIT_DEBUG;
+	goto out;
+NEXT
+
+/*
+ * Fused pairs of 32 bit instructions built by riscv32_fuse().  Each
+ * retires both instructions at once; with a single instruction left in
+ * the budget it runs only the first, from the raw bits in d->insn, and
+ * a fault in the second leaves the first retired.
+ */
+OP(LUI_ADDI)
+	if (n + 1 >= max_insns) {
+		reg[d->rd] = d->insn & 0xfffff000;
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_LUI_ADDI);
+		reg[d->rd] = d->imm;
+		pc += 8;
+		n++;
+	}
+NEXT
+
+OP(AUIPC_ADDI)
+	if (n + 1 >= max_insns) {
+		reg[d->rd] = pc + (d->insn & 0xfffff000);
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_AUIPC_ADDI);
+		reg[d->rd] = pc + d->imm;
+		pc += 8;
+		n++;
+	}
+NEXT
+
+OP(AUIPC_JALR)
+	reg[d->rs1] = pc + (d->insn & 0xfffff000);
+	if (n + 1 >= max_insns) {
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_AUIPC_JALR);
+		addr = (pc + d->imm) & ~1;
+		reg[d->rd] = pc + 8;
+		pc = addr;
+		n++;
+	}
+NEXT
+
+OP(AUIPC_LW) {
+	uint32_t rval;
+	reg[d->rs1] = pc + (d->insn & 0xfffff000);
+	tval = addr = pc + d->imm;
+	pc += 4;
+	if (n + 1 < max_insns) {
+		n++;
+		cause = CAUSE_FAULT_LOAD;
+		if (GUARDED)
+			riscv32_guard_mark(m, pc, n);
+		if (riscv32_read_u32(m, addr, &rval, ACCESS))
+			goto trap;
+		RISCV32_FUSED(m, RISCV32_FUSE_AUIPC_LW);
+		reg[d->rd] = rval;
+		pc += 4;
+	}
+}
+NEXT
+
+OP(SLT_BEQ)
+	val = (int32_t)reg[d->rs1] < (int32_t)reg[d->rs2];
+	goto slt_beq;
+NEXT
+
+OP(SLTU_BEQ)
+	val = reg[d->rs1] < reg[d->rs2];
+slt_beq:
+	reg[d->rd] = val;
+	if (n + 1 >= max_insns) {
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_SLT_BRANCH);
+		pc += val ? 8 : 4 + d->imm;
+		n++;
+	}
+NEXT
+
+OP(SLT_BNE)
+	val = (int32_t)reg[d->rs1] < (int32_t)reg[d->rs2];
+	goto slt_bne;
+NEXT
+
+OP(SLTU_BNE)
+	val = reg[d->rs1] < reg[d->rs2];
+slt_bne:
+	reg[d->rd] = val;
+	if (n + 1 >= max_insns) {
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_SLT_BRANCH);
+		pc += val ? 4 + d->imm : 8;
+		n++;
+	}
+NEXT
+
+/* rd takes the high half, imm names the register for the low half */
+OP(MULH_MUL) {
+	int64_t p = (int64_t)(int32_t)reg[d->rs1] * (int32_t)reg[d->rs2];
+	val = p;
+	val2 = p >> 32;
+}
+	goto mul_pair;
+NEXT
+
+OP(MULHSU_MUL) {
+	int64_t p = (int64_t)(int32_t)reg[d->rs1] * (int64_t)reg[d->rs2];
+	val = p;
+	val2 = p >> 32;
+}
+	goto mul_pair;
+NEXT
+
+OP(MULHU_MUL) {
+	uint64_t p = (uint64_t)reg[d->rs1] * reg[d->rs2];
+	val = p;
+	val2 = p >> 32;
+}
+mul_pair:
+	if (n + 1 >= max_insns) {
+		if (((d->insn >> 12) & 7) == 0)
+			reg[d->imm] = val;
+		else
+			reg[d->rd] = val2;
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_MUL_PAIR);
+		reg[d->rd] = val2;
+		reg[d->imm] = val;
+		pc += 8;
+		n++;
+	}
+NEXT
+
+/* rd takes the quotient, imm names the register for the remainder */
+OP(DIV_REM)
+	divrem32(reg[d->rs1], reg[d->rs2], &val, &val2);
+	goto div_pair;
+NEXT
+
+OP(DIVU_REMU)
+	divremu32(reg[d->rs1], reg[d->rs2], &val, &val2);
+div_pair:
+	if (n + 1 >= max_insns) {
+		if (((d->insn >> 12) & 7) < 6)
+			reg[d->rd] = val;
+		else
+			reg[d->imm] = val2;
+		pc += 4;
+	} else {
+		RISCV32_FUSED(m, RISCV32_FUSE_DIV_PAIR);
+		reg[d->rd] = val;
+		reg[d->imm] = val2;
+		pc += 8;
+		n++;
+	}
+NEXT
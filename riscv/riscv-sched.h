@@ -0,0 +1,37 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __RISCV_SCHED_H__
+#define __RISCV_SCHED_H__
+#include "riscv.h"
+
+/*
+ * Runs many riscv32_vm on a fixed pool of worker threads.  Every worker
+ * has its own run queue and steals from the others when it runs dry.
+ * A vm runs for at most quantum instructions at a time and then goes to
+ * the back of its worker's queue; any other stop is handed to the exit
+ * callback on the worker thread, whose return value decides what
+ * happens to the vm next.
+ */
+
+/* exit callback results */
+enum {
+	RISCV32_SCHED_RUN,	/* queue the vm again */
+	RISCV32_SCHED_PARK,	/* keep it off the queues until riscv32_sched_wake */
+	RISCV32_SCHED_DONE,	/* the vm finished, forget it */
+};
+
+struct riscv32_sched;
+
+typedef int (*riscv32_sched_exit_t)(struct riscv32_sched *s,
+	struct riscv32_vm *vm, int exit_reason, void *arg);
+
+struct riscv32_sched *riscv32_sched_create(unsigned nworkers, unsigned quantum,
+	riscv32_sched_exit_t exit, void *arg);
+int riscv32_sched_add(struct riscv32_sched *s, struct riscv32_vm *vm);
+void riscv32_sched_wake(struct riscv32_sched *s, struct riscv32_vm *vm);
+void riscv32_sched_wait(struct riscv32_sched *s);
+void riscv32_sched_destroy(struct riscv32_sched *s);
+
+#endif /* __RISCV_SCHED_H__*/
@@ -1,7 +1,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "riscv.h"
+#include "riscv-internal.h"
+
+#ifdef RISCV32_HAVE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef RISCV32_HAVE_GUARD
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+/* 4 GiB of guest space and a guard for accesses straddling its end */
+#define RISCV32_GUARD_SIZE	(((uint64_t)1 << 32) + 0x10000)
+#endif
 
 #define CAUSE_MISALIGNED_FETCH    0x0
 #define CAUSE_FAULT_FETCH         0x1
@@ -66,122 +82,189 @@
 #define MIP_HEIP (1 << 10)
 #define MIP_MEIP (1 << 11)
 
-extern void hostapi_ecall(struct riscv32_vm *vm,
+extern int hostapi_ecall(struct riscv32_vm *vm,
 	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
 	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7);
 
-static int riscv32_read_u8(struct riscv32_vm *m, uint32_t addr, uint8_t *val)
+/* empties the slot holding pc; with fused only if it holds a fused pair */
+static inline void riscv32_icache_drop(struct riscv32_vm *m, uint32_t pc, int fused)
 {
-	if ((uint64_t)addr + 0 >= m->memsize)
-		return -1;
+	struct riscv32_insn *d = &m->icache[(pc >> 1) & RISCV32_ICACHE_MASK];
 
-	*val = m->mem[addr];
-	return 0;
+	if (d->pc == pc && (!fused || d->op >= RV_FUSED)) {
+		d->pc = RISCV32_ICACHE_INVALID;
+		riscv32_icache_touch(m, d);
+	}
 }
 
-static int riscv32_read_u16(struct riscv32_vm *m, uint32_t addr, uint16_t *val)
+/* drops every slot whose instruction may cover one of the size bytes at
+ * addr: one starting in them or the halfword before, and a fused pair of
+ * two 32 bit instructions starting up to 6 bytes before.  The trip count
+ * is fixed by size alone so the word store path unrolls */
+static inline void riscv32_icache_invalidate(struct riscv32_vm *m, uint32_t addr, uint32_t size)
 {
-	if ((uint64_t)addr + 1 >= m->memsize)
-		return -1;
+	uint32_t h = addr & ~1, k;
 
-	*val = m->mem[addr] | m->mem[addr + 1] << 8;
-	return 0;
+	riscv32_icache_drop(m, h - 6, 1);
+	riscv32_icache_drop(m, h - 4, 1);
+	riscv32_icache_drop(m, h - 2, 0);
+	for (k = 0; k <= size / 2; k++)
+		riscv32_icache_drop(m, h + k * 2, 0);
 }
 
-static int riscv32_read_u32(struct riscv32_vm *m, uint32_t addr, uint32_t *val)
+void riscv32_icache_invalidate_range(struct riscv32_vm *m, uint32_t base, uint32_t size)
 {
-	if ((uint64_t)addr + 3 >= m->memsize)
-		return -1;
+	uint32_t addr;
 
-	*val = m->mem[addr] | m->mem[addr + 1] << 8
-		| m->mem[addr + 2] << 16 | m->mem[addr + 3] << 24;
-	return 0;
-}
+#ifdef RISCV_JIT
+	if (m->code_map)
+		riscv32_jit_invalidate(m, base, size);
+#endif
 
-static int riscv32_write_u8(struct riscv32_vm *m, uint32_t addr, uint8_t val)
-{
-	if ((uint64_t)addr >= m->memsize)
-		return -1;
+	if (size >= RISCV32_ICACHE_SIZE * 2) {
+		for (addr = 0; addr < RISCV32_ICACHE_SIZE; addr++)
+			m->icache[addr].pc = RISCV32_ICACHE_INVALID;
+		m->icache_lo = 0;
+		m->icache_hi = RISCV32_ICACHE_MASK;
+		return;
+	}
 
-	m->mem[addr] = val;
-	return 0;
+	if (size)
+		riscv32_icache_invalidate(m, base, size);
 }
 
-static int riscv32_write_u16(struct riscv32_vm *m, uint32_t addr, uint16_t val)
-{  
-	if ((uint64_t)addr + 1 >= m->memsize)
-		return -1;
-
-	m->mem[addr] = val & 0xff;
-	m->mem[addr + 1] = (val >> 8) & 0xff;
-	return 0;
+/* guest memory is little endian; on a matching host an access is a
+ * single native load or store of any alignment */
+static inline uint16_t riscv32_ld16(const uint8_t *p)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return v;
+#else
+	return p[0] | p[1] << 8;
+#endif
 }
 
-static int riscv32_write_u32(struct riscv32_vm *m, uint32_t addr, uint32_t val)
+static inline uint32_t riscv32_ld32(const uint8_t *p)
 {
-	if ((uint64_t)addr + 3 >= m->memsize)
-		return -1;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+#else
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+#endif
+}
 
-	m->mem[addr] = val & 0xff;
-	m->mem[addr + 1] = (val >> 8) & 0xff;
-	m->mem[addr + 2] = (val >> 16) & 0xff;
-	m->mem[addr + 3] = (val >> 24) & 0xff;
-	return 0;
+static inline void riscv32_st16(uint8_t *p, uint16_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, 2);
+#else
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+#endif
 }
 
-static inline int32_t div32(int32_t a, int32_t b)
+static inline void riscv32_st32(uint8_t *p, uint32_t v)
 {
-    if (b == 0) {
-        return -1;
-    } else if (a == ((int32_t)1 << (32 - 1)) && b == -1) {
-        return a;
-    } else {
-        return a / b;
-    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &v, 4);
+#else
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+#endif
 }
 
-static inline uint32_t divu32(uint32_t a, uint32_t b)
+/* with RISCV32_ACCESS_GUARD set the access is not bounds checked:
+ * everything past memsize is an inaccessible reservation and a fault
+ * arrives as SIGSEGV */
+static inline void riscv32_watch(struct riscv32_vm *m, uint32_t addr, uint32_t size,
+	int type, int mode)
 {
-    if (b == 0) {
-        return -1;
-    } else {
-        return a / b;
-    }
+	const uint8_t *pages;
+	uint32_t p, q;
+
+	if (!(mode & RISCV32_ACCESS_WATCH))
+		return;
+
+	pages = m->debug->watch_pages;
+	p = addr >> RISCV32_WATCH_SHIFT;
+	q = (addr + size - 1) >> RISCV32_WATCH_SHIFT;
+	if ((pages[p >> 3] & 1 << (p & 7)) || (pages[q >> 3] & 1 << (q & 7)))
+		riscv32_watch_hit(m, addr, size, type);
 }
 
-static inline int32_t rem32(int32_t a, int32_t b)
+static inline int riscv32_read_u8(struct riscv32_vm *m, uint32_t addr, uint8_t *val, int mode)
 {
-    if (b == 0) {
-        return a;
-    } else if (a == ((int32_t)1 << (32 - 1)) && b == -1) {
-        return 0;
-    } else {
-        return a % b;
-    }
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr + 0 >= m->memsize)
+		return -1;
+
+	*val = m->mem[addr];
+	riscv32_watch(m, addr, 1, RISCV32_WATCH_READ, mode);
+	return 0;
 }
 
-static inline uint32_t remu32(uint32_t a, uint32_t b)
+static inline int riscv32_read_u16(struct riscv32_vm *m, uint32_t addr, uint16_t *val, int mode)
 {
-    if (b == 0) {
-        return a;
-    } else {
-        return a % b;
-    }
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr + 1 >= m->memsize)
+		return -1;
+
+	*val = riscv32_ld16(m->mem + addr);
+	riscv32_watch(m, addr, 2, RISCV32_WATCH_READ, mode);
+	return 0;
 }
 
-static inline uint32_t mulh32(int32_t a, int32_t b)
+static int riscv32_mmio_read(struct riscv32_vm *m, uint32_t addr, uint32_t *val);
+static int riscv32_mmio_write(struct riscv32_vm *m, uint32_t addr, uint32_t val);
+
+static inline int riscv32_read_u32(struct riscv32_vm *m, uint32_t addr, uint32_t *val, int mode)
 {
-    return ((int64_t)a * (int64_t)b) >> 32;
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr + 3 >= m->memsize)
+		return mode & RISCV32_ACCESS_FETCH ? -1 : riscv32_mmio_read(m, addr, val);
+
+	*val = riscv32_ld32(m->mem + addr);
+	riscv32_watch(m, addr, 4, RISCV32_WATCH_READ, mode);
+	return 0;
 }
 
-static inline uint32_t mulhsu32(int32_t a, uint32_t b)
+static inline int riscv32_write_u8(struct riscv32_vm *m, uint32_t addr, uint8_t val, int mode)
 {
-    return ((int64_t)a * (int64_t)b) >> 32;
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr >= m->memsize)
+		return -1;
+
+	m->mem[addr] = val;
+	riscv32_watch(m, addr, 1, RISCV32_WATCH_WRITE, mode);
+	riscv32_icache_invalidate(m, addr, 1);
+	riscv32_code_invalidate(m, addr, 1);
+	return 0;
 }
 
-static inline uint32_t mulhu32(uint32_t a, uint32_t b)
+static inline int riscv32_write_u16(struct riscv32_vm *m, uint32_t addr, uint16_t val, int mode)
+{  
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr + 1 >= m->memsize)
+		return -1;
+
+	riscv32_st16(m->mem + addr, val);
+	riscv32_watch(m, addr, 2, RISCV32_WATCH_WRITE, mode);
+	riscv32_icache_invalidate(m, addr, 2);
+	riscv32_code_invalidate(m, addr, 2);
+	return 0;
+}
+
+static inline int riscv32_write_u32(struct riscv32_vm *m, uint32_t addr, uint32_t val, int mode)
 {
-    return ((int64_t)a * (int64_t)b) >> 32;
+	if (!(mode & RISCV32_ACCESS_GUARD) && (uint64_t)addr + 3 >= m->memsize)
+		return riscv32_mmio_write(m, addr, val);
+
+	riscv32_st32(m->mem + addr, val);
+	riscv32_watch(m, addr, 4, RISCV32_WATCH_WRITE, mode);
+	riscv32_icache_invalidate(m, addr, 4);
+	riscv32_code_invalidate(m, addr, 4);
+	return 0;
 }
 
 static void raise_exception2(struct riscv32_cpu *c, uint32_t cause, uint32_t tval)
@@ -195,7 +278,9 @@ static void raise_exception2(struct riscv32_cpu *c, uint32_t cause, uint32_t tva
 	c->mcause = causel;
 	c->mepc = c->pc;
 	c->mtval = tval;
-	c->mstatus &= ~MSTATUS_MIE;
+	/* MPIE keeps MIE for mret, MPP stays M on a machine mode only hart */
+	c->mstatus = (c->mstatus & ~(MSTATUS_MIE | MSTATUS_MPIE)) | MSTATUS_MPP |
+		((c->mstatus & MSTATUS_MIE) << (MSTATUS_MPIE_SHIFT - 3));
 	c->pc = c->mtvec;
 }
 
@@ -204,23 +289,185 @@ static void raise_exception(struct riscv32_cpu *c, uint32_t cause)
     raise_exception2(c, cause, 0);
 }
 
-static void handle_mret(struct riscv32_cpu *c)
+/* the interrupts a pending bit in mip can raise */
+#define RISCV32_IRQ_MASK	(MIP_MSIP | MIP_MTIP | MIP_MEIP)
+
+/* whether an interrupt can be taken once it is pending */
+static inline bool riscv32_irq_armed(const struct riscv32_cpu *c)
 {
-    int mpp, mpie;
-    mpp = (c->mstatus >> MSTATUS_MPP_SHIFT) & 3;
+	return (c->mstatus & MSTATUS_MIE) && (c->mie & RISCV32_IRQ_MASK);
+}
+
+/* 1 when it enabled interrupts, the run stops to look for a due one */
+static int handle_mret(struct riscv32_cpu *c)
+{
+    bool armed = riscv32_irq_armed(c);
+    int mpie;
+
     /* set the IE state to previous IE state */
     mpie = (c->mstatus >> MSTATUS_MPIE_SHIFT) & 1;
-    c->mstatus = (c->mstatus & ~(1 << mpp)) |
-        (mpie << mpp);
+    c->mstatus = (c->mstatus & ~MSTATUS_MIE) | (mpie << 3);
     /* set MPIE to 1 */
     c->mstatus |= MSTATUS_MPIE;
-    /* set MPP to U */
-    c->mstatus &= ~MSTATUS_MPP;
+    /* MPP can only hold M */
+    c->mstatus |= MSTATUS_MPP;
     c->pc = c->mepc;
+    return !armed && riscv32_irq_armed(c);
+}
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* guest time, in RISCV32_TIME_HZ ticks */
+uint64_t riscv32_time(struct riscv32_vm *m)
+{
+	return (host_ns() - m->time_base) / (1000000000 / RISCV32_TIME_HZ);
+}
+
+void riscv32_set_time(struct riscv32_vm *m, uint64_t time)
+{
+	m->time_base = host_ns() - time * (1000000000 / RISCV32_TIME_HZ);
+}
+
+/* what the time csr reads, which the host may see and replace */
+static uint64_t csr_time(struct riscv32_vm *m)
+{
+	uint64_t time = riscv32_time(m);
+
+	return m->time_hook ? m->time_hook(m, time) : time;
+}
+
+/* mip as of now: the timer's bit follows mtime against mtimecmp, the
+ * external one the line the host drives */
+static uint32_t riscv32_mip(struct riscv32_vm *m)
+{
+	m->cpu.mip &= ~(MIP_MTIP | MIP_MEIP);
+	if (m->mtimecmp != UINT64_MAX && csr_time(m) >= m->mtimecmp)
+		m->cpu.mip |= MIP_MTIP;
+	if (__atomic_load_n(&m->meip, __ATOMIC_ACQUIRE))
+		m->cpu.mip |= MIP_MEIP;
+	return m->cpu.mip;
+}
+
+/* the enabled interrupts that are pending, whatever mstatus.MIE says */
+static uint32_t riscv32_irq_pending(struct riscv32_vm *m)
+{
+	uint32_t mie = m->cpu.mie & RISCV32_IRQ_MASK;
+
+	if (mie == 0)
+		return 0;
+	if (mie & (MIP_MTIP | MIP_MEIP))
+		riscv32_mip(m);
+	return m->cpu.mip & mie;
+}
+
+/* trap to the highest priority interrupt that is due, if any */
+static void riscv32_irq_take(struct riscv32_vm *m)
+{
+	uint32_t pending;
+
+	if (!riscv32_irq_armed(&m->cpu))
+		return;
+
+	pending = riscv32_irq_pending(m);
+	if (pending & MIP_MEIP)
+		raise_exception2(&m->cpu, CAUSE_INTERRUPT | 11, 0);
+	else if (pending & MIP_MSIP)
+		raise_exception2(&m->cpu, CAUSE_INTERRUPT | 3, 0);
+	else if (pending & MIP_MTIP)
+		raise_exception2(&m->cpu, CAUSE_INTERRUPT | 7, 0);
+}
+
+/* raise or lower the external interrupt line, from any thread; a running
+ * vm sees it at its next interrupt check */
+void riscv32_irq_external(struct riscv32_vm *m, int level)
+{
+	__atomic_store_n(&m->meip, !!level, __ATOMIC_RELEASE);
+}
+
+/* non-zero once a wfi is over: an enabled interrupt is pending */
+int riscv32_wfi_done(struct riscv32_vm *m)
+{
+	return riscv32_irq_pending(m) != 0;
+}
+
+/* after RISCV32_EXIT_WFI: host nanoseconds until the timer can end the
+ * wait, 0 when it already has, -1 when the guest has no timer enabled */
+int64_t riscv32_timer_deadline(struct riscv32_vm *m)
+{
+	uint64_t now, ticks;
+
+	if (!(m->cpu.mie & MIP_MTIP) || m->mtimecmp == UINT64_MAX)
+		return -1;
+
+	now = riscv32_time(m);
+	if (now >= m->mtimecmp)
+		return 0;
+	ticks = m->mtimecmp - now;
+	if (ticks > INT64_MAX / (1000000000 / RISCV32_TIME_HZ))
+		return INT64_MAX;
+	return ticks * (1000000000 / RISCV32_TIME_HZ);
+}
+
+/* the CLINT registers as 32 bit halves; -1 for anything else */
+static int riscv32_mmio_read(struct riscv32_vm *m, uint32_t addr, uint32_t *val)
+{
+	switch (addr - RISCV32_CLINT_BASE) {
+	case RISCV32_CLINT_MSIP:
+		*val = !!(m->cpu.mip & MIP_MSIP);
+		return 0;
+	case RISCV32_CLINT_MTIMECMP:
+		*val = m->mtimecmp;
+		return 0;
+	case RISCV32_CLINT_MTIMECMP + 4:
+		*val = m->mtimecmp >> 32;
+		return 0;
+	case RISCV32_CLINT_MTIME:
+		*val = csr_time(m);
+		return 0;
+	case RISCV32_CLINT_MTIME + 4:
+		*val = csr_time(m) >> 32;
+		return 0;
+	}
+	return -1;
+}
+
+static int riscv32_mmio_write(struct riscv32_vm *m, uint32_t addr, uint32_t val)
+{
+	uint64_t time;
+
+	switch (addr - RISCV32_CLINT_BASE) {
+	case RISCV32_CLINT_MSIP:
+		m->cpu.mip = (m->cpu.mip & ~MIP_MSIP) | (val & 1 ? MIP_MSIP : 0);
+		return 0;
+	case RISCV32_CLINT_MTIMECMP:
+		m->mtimecmp = (m->mtimecmp & ~(uint64_t)UINT32_MAX) | val;
+		return 0;
+	case RISCV32_CLINT_MTIMECMP + 4:
+		m->mtimecmp = (m->mtimecmp & UINT32_MAX) | (uint64_t)val << 32;
+		return 0;
+	case RISCV32_CLINT_MTIME:
+		time = csr_time(m);
+		riscv32_set_time(m, (time & ~(uint64_t)UINT32_MAX) | val);
+		return 0;
+	case RISCV32_CLINT_MTIME + 4:
+		time = csr_time(m);
+		riscv32_set_time(m, (time & UINT32_MAX) | (uint64_t)val << 32);
+		return 0;
+	}
+	return -1;
 }
 
-static int csr_read(struct riscv32_cpu *c, uint32_t *pval, uint32_t csr, bool will_write)
+/* n is the count retired so far by the running core, which only adds it
+ * to m->instret when it stops; cycles are instructions here */
+static int csr_read(struct riscv32_vm *m, unsigned n, uint32_t *pval, uint32_t csr, bool will_write)
 {
+    struct riscv32_cpu *c = &m->cpu;
     uint32_t val;
 
     if (((csr & 0xc00) == 0xc00) && will_write)
@@ -249,7 +496,21 @@ static int csr_read(struct riscv32_cpu *c, uint32_t *pval, uint32_t csr, bool wi
         val = c->mtval;
         break;
     case 0x344:
-        val = c->mip;
+        val = riscv32_mip(m);
+        break;
+    case 0xc00: /* cycle */
+    case 0xc02: /* instret */
+        val = m->instret + n;
+        break;
+    case 0xc80: /* cycleh */
+    case 0xc82: /* instreth */
+        val = (m->instret + n) >> 32;
+        break;
+    case 0xc01: /* time */
+        val = csr_time(m);
+        break;
+    case 0xc81: /* timeh */
+        val = csr_time(m) >> 32;
         break;
     default:
     invalid_csr:
@@ -266,9 +527,10 @@ static int csr_read(struct riscv32_cpu *c, uint32_t *pval, uint32_t csr, bool wi
                       MSTATUS_FS | \
                       MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR)
 /* return -1 if invalid CSR, 0 if OK, 1 if the interpreter loop must be
-   exited (e.g. XLEN was modified), 2 if TLBs have been flushed. */
+   exited (interrupts were enabled) */
 static int csr_write(struct riscv32_cpu *c, uint32_t csr, uint32_t val)
 {
+    bool armed = riscv32_irq_armed(c);
     uint32_t mask;
 
     switch(csr) {
@@ -277,7 +539,7 @@ static int csr_write(struct riscv32_cpu *c, uint32_t csr, uint32_t val)
 		c->mstatus = (c->mstatus & ~mask) | (val & mask);
         break;
     case 0x304:
-        mask = MIP_MSIP | MIP_MTIP | MIP_SSIP | MIP_STIP | MIP_SEIP;
+        mask = MIP_MSIP | MIP_MTIP | MIP_MEIP | MIP_SSIP | MIP_STIP | MIP_SEIP;
         c->mie = (c->mie & ~mask) | (val & mask);
         break;
     case 0x305:
@@ -302,422 +564,938 @@ static int csr_write(struct riscv32_cpu *c, uint32_t csr, uint32_t val)
     default:
         return -1;
     }
-    return 0;
+    return !armed && riscv32_irq_armed(c);
 }
 
-int riscv32_cpu_exec(struct riscv32_vm *m)
+void riscv32_decode(struct riscv32_insn *d, uint32_t insn)
 {
-	bool debug = false;
-	int32_t imm, cond, err;
-	uint32_t addr, val, val2, cause = CAUSE_LOAD_PAGE_FAULT, tval;
-	uint32_t opcode, insn, rd, rs1, rs2, funct3;
-	struct riscv32_cpu *c = &m->cpu;
-
-	if (riscv32_read_u32(m, c->pc, &insn)) {
-		addr = c->pc;
-		goto mmu_exception;
-	}
-
-
-	opcode = insn & 0x7f;
-	rd = (insn >> 7) & 0x1f;
-	rs1 = (insn >> 15) & 0x1f;
-	rs2 = (insn >> 20) & 0x1f;
+	uint32_t funct3 = (insn >> 12) & 7;
+	int32_t imm;
 
-	//printf("insn: %08x opcode = %02x, rs1 = %02x, rs2 = %02x, rd = %02x\n",
-	//	insn, opcode, rs1, rs2, rd);
-
-	c->zero = 0;
-	switch (opcode) {
-	default: goto illegal_insn;
+	d->op = RV_ILLEGAL;
+	d->rd = (insn >> 7) & 0x1f;
+	d->rs1 = (insn >> 15) & 0x1f;
+	d->rs2 = (insn >> 20) & 0x1f;
+	d->imm = 0;
+	d->insn = insn;
 
+	switch (insn & 0x7f) {
 	case 0x37:	/* lui */
-		c->reg[rd] = (int32_t)(insn & 0xfffff000);
-		c->pc += 4;
+		d->op = RV_LUI;
+		d->imm = (int32_t)(insn & 0xfffff000);
 	break;
 
-	case 0x17: /* auipc */
-		c->reg[rd] = (int32_t)(c->pc + (int32_t)(insn & 0xfffff000));
-		c->pc += 4;
+	case 0x17:	/* auipc */
+		d->op = RV_AUIPC;
+		d->imm = (int32_t)(insn & 0xfffff000);
 	break;
 
-	case 0x6f: /* jal */
+	case 0x6f:	/* jal */
 		imm = ((insn >> (31 - 20)) & (1 << 20))
 			| ((insn >> (21 - 1)) & 0x7fe)
 			| ((insn >> (20 - 11)) & (1 << 11))
 			| (insn & 0xff000);
-		imm = (imm << 11) >> 11;
-		c->reg[rd] = c->pc + 4;
-		c->pc += imm;
+		d->op = RV_JAL;
+		d->imm = (imm << 11) >> 11;
 	break;
 
-	case 0x67: /* jalr */
-		imm = (int32_t)insn >> 20;
-		c->reg[rd] = c->pc + 4;
-		c->pc = (int32_t)(c->reg[rs1] + imm) & ~1;
+	case 0x67:	/* jalr */
+		d->op = RV_JALR;
+		d->imm = (int32_t)insn >> 20;
 	break;
 
 	case 0x63:
-		funct3 = (insn >> 12) & 7;
-		switch (funct3 >> 1) {
-		case 0: /* beq/bne */
-			cond = (c->reg[rs1] == c->reg[rs2]);
-		break;
-
-		case 1: /* blt/bge */
-			cond = ((int32_t)c->reg[rs1] < (int32_t)c->reg[rs2]);
-		break;
-
-		case 2: /* bltu/bgeu */
-			cond = (c->reg[rs1] < c->reg[rs2]);
-		break;
-
-		default:
-			goto illegal_insn;
-		break;
-		}
-		cond ^= (funct3 & 1);
-		if (cond) {
-			imm = ((insn >> (31 - 12)) & (1 << 12)) |
-				((insn >> (25 - 5)) & 0x7e0) |
-				((insn >> (8 - 1)) & 0x1e) |
-				((insn << (11 - 7)) & (1 << 11));
-			imm = (imm << 19) >> 19;
-			c->pc += imm;
-		} else {
-			c->pc += 4;
+		imm = ((insn >> (31 - 12)) & (1 << 12)) |
+			((insn >> (25 - 5)) & 0x7e0) |
+			((insn >> (8 - 1)) & 0x1e) |
+			((insn << (11 - 7)) & (1 << 11));
+		d->imm = (imm << 19) >> 19;
+		switch (funct3) {
+		case 0: d->op = RV_BEQ; break;
+		case 1: d->op = RV_BNE; break;
+		case 4: d->op = RV_BLT; break;
+		case 5: d->op = RV_BGE; break;
+		case 6: d->op = RV_BLTU; break;
+		case 7: d->op = RV_BGEU; break;
 		}
 	break;
 
-	case 0x03: /* load*/
-		funct3 = (insn >> 12) & 7;
-		imm = (int32_t)insn >> 20;
-		addr = c->reg[rs1] + imm;
-
-		tval = addr;
-		cause = CAUSE_FAULT_LOAD;
+	case 0x03:	/* load */
+		d->imm = (int32_t)insn >> 20;
 		switch (funct3) {
-		case 0: { /* lb */
-			uint8_t rval;
-			if (riscv32_read_u8(m, addr, &rval))
-				goto mmu_exception;
-			val = (int8_t)rval;
-		} break;
-
-		case 1: { /* lh */
-			uint16_t rval;
-			if (riscv32_read_u16(m, addr, &rval))
-				goto mmu_exception;
-			val = (int16_t)rval;
-		} break;
-
-		case 2: { /* lw */
-			uint32_t rval;
-			if (riscv32_read_u32(m, addr, &rval))
-				goto mmu_exception;
-			val = (int32_t)rval;
-		} break;
-
-		case 4: { /* lbu */
-			uint8_t rval;
-			if (riscv32_read_u8(m, addr, &rval))
-				goto mmu_exception;
-			val = rval;
-		} break;
-
-		case 5: { /* lhu */
-			uint16_t rval;
-			if (riscv32_read_u16(m, addr, &rval))
-				goto mmu_exception;
-			val = rval;
-		} break;
-
-		default:
-			goto illegal_insn;
+		case 0: d->op = RV_LB; break;
+		case 1: d->op = RV_LH; break;
+		case 2: d->op = RV_LW; break;
+		case 4: d->op = RV_LBU; break;
+		case 5: d->op = RV_LHU; break;
 		}
-
-		c->reg[rd] = val;
-		c->pc += 4;
 	break;
 
-	case 0x23: /* store */
-		funct3 = (insn >> 12) & 7;
-		imm = rd | ((insn >> (25 - 5)) & 0xfe0);
-		imm = (imm << 20) >> 20;
-		addr = c->reg[rs1] + imm;
-		val = c->reg[rs2];
-
-		tval = addr;
-		cause = CAUSE_FAULT_STORE;
+	case 0x23:	/* store */
+		imm = ((insn >> 7) & 0x1f) | ((insn >> (25 - 5)) & 0xfe0);
+		d->imm = (imm << 20) >> 20;
 		switch (funct3) {
-		case 0: /* sb */
-			if (riscv32_write_u8(m, addr, val))
-				goto mmu_exception;
-		break;
-
-		case 1: /* sh */
-			if (riscv32_write_u16(m, addr, val))
-				goto mmu_exception;
-		break;
-
-		case 2: /* sw */
-			if (riscv32_write_u32(m, addr, val))
-				goto mmu_exception;
-		break;
-
-		default:
-			goto illegal_insn;
+		case 0: d->op = RV_SB; break;
+		case 1: d->op = RV_SH; break;
+		case 2: d->op = RV_SW; break;
 		}
-		c->pc += 4;
 	break;
 
 	case 0x13:
-		funct3 = (insn >> 12) & 7;
-		imm = (int32_t) insn >> 20;
+		d->imm = imm = (int32_t)insn >> 20;
 		switch (funct3) {
-		case 0: /* addi */
-			val = (int32_t)(c->reg[rs1] + imm);
+		case 0: d->op = RV_ADDI; break;
+		case 2: d->op = RV_SLTI; break;
+		case 3: d->op = RV_SLTIU; break;
+		case 4: d->op = RV_XORI; break;
+		case 6: d->op = RV_ORI; break;
+		case 7: d->op = RV_ANDI; break;
+		case 1:	/* slli */
+			if ((imm & ~(32 - 1)) == 0)
+				d->op = RV_SLLI;
 		break;
-
-		case 1: /* slli */
-			if ((imm & ~(32 - 1)) != 0)
-				goto illegal_insn;
-			val = (int32_t)(c->reg[rs1] << (imm & (32 - 1)));
-		break;
-
-		case 2: /* slti */
-			val = (int32_t)(c->reg[rs1] < imm);
-		break;
-
-		case 3: /* sltiu */
-			val = c->reg[rs1] < imm;
-		break;
-
-		case 4: /* xori */
-			val = c->reg[rs1] ^ imm;
-		break;
-
-		case 5: /* srli/srai */
-			if ((imm & ~((32 - 1) | 0x400)) != 0)
-				goto illegal_insn;
-
-			if (imm & 0x400)
-				val = (int32_t)c->reg[rs1] >> (imm & (32 - 1));
-			else
-				val = (int32_t)(c->reg[rs1] >> (imm & (32 - 1)));
-		break;
-
-		case 6: /* ori */
-			val = c->reg[rs1] | imm;
-		break;
-
-		default:
-		case 7: /* andi */
-			val = c->reg[rs1] & imm;
+		case 5:	/* srli/srai */
+			if ((imm & ~((32 - 1) | 0x400)) == 0)
+				d->op = (imm & 0x400) ? RV_SRAI : RV_SRLI;
+			d->imm = imm & (32 - 1);
 		break;
 		}
-		c->reg[rd] = val;
-		c->pc += 4;
 	break;
 
 	case 0x33:
 		imm = insn >> 25;
-		val = c->reg[rs1];
-		val2 = c->reg[rs2];
 		if (imm == 1) {
-			funct3 = (insn >> 12) & 7;
-			switch(funct3) {
-			case 0: /* mul */
-				val = (int32_t)((int32_t)val * (int32_t)val2);
-			break;
-			case 1: /* mulh */
-				val = (int32_t)mulh32(val, val2);
-			break;
-			case 2:/* mulhsu */
-				val = (int32_t)mulhsu32(val, val2);
-			break;
-			case 3:/* mulhu */
-				val = (int32_t)mulhu32(val, val2);
-			break;
-			case 4:/* div */
-				val = div32(val, val2);
-			break;
-			case 5:/* divu */
-				val = (int32_t)divu32(val, val2);
-			break;
-			case 6:/* rem */
-				val = rem32(val, val2);
-			break;
-			case 7:/* remu */
-				val = (int32_t)remu32(val, val2);
-			break;
-			default:
-				goto illegal_insn;
+			d->op = RV_MUL + funct3;
+		} else if ((imm & ~0x20) == 0) {
+			switch (funct3 | ((insn >> (30 - 3)) & (1 << 3))) {
+			case 0: d->op = RV_ADD; break;
+			case 0 | 8: d->op = RV_SUB; break;
+			case 1: d->op = RV_SLL; break;
+			case 2: d->op = RV_SLT; break;
+			case 3: d->op = RV_SLTU; break;
+			case 4: d->op = RV_XOR; break;
+			case 5: d->op = RV_SRL; break;
+			case 5 | 8: d->op = RV_SRA; break;
+			case 6: d->op = RV_OR; break;
+			case 7: d->op = RV_AND; break;
 			}
-		} else {
-			if (imm & ~0x20)
-				goto illegal_insn;
-			funct3 = ((insn >> 12) & 7) | ((insn >> (30 - 3)) & (1 << 3));
-			switch(funct3) {
-			case 0: /* add */
-				val = (int32_t)(val + val2);
-			break;
-			case 0 | 8: /* sub */
-				val = (int32_t)(val - val2);
-			break;
-			case 1: /* sll */
-				val = (int32_t)(val << (val2 & (32 - 1)));
-			break;
-			case 2: /* slt */
-				val = (int32_t)val < (int32_t)val2;
-			break;
-			case 3: /* sltu */
-				val = val < val2;
-			break;
-			case 4: /* xor */
-				val = val ^ val2;
-			break;
-			case 5: /* srl */
-				val = (int32_t)((uint32_t)val >> (val2 & (32 - 1)));
+		}
+	break;
+
+	case 0x0f:
+		if (funct3 == 0)
+			d->op = RV_FENCE;
+		else if (funct3 == 1)
+			d->op = RV_FENCE_I;
+	break;
+
+	case 0x73:
+		d->imm = insn >> 20;
+		switch (funct3) {
+		case 1: d->op = RV_CSRRW; break;
+		case 2: d->op = RV_CSRRS; break;
+		case 3: d->op = RV_CSRRC; break;
+		case 5: d->op = RV_CSRRWI; break;
+		case 6: d->op = RV_CSRRSI; break;
+		case 7: d->op = RV_CSRRCI; break;
+		case 0:
+			switch (d->imm) {
+			case 0x000:	/* ecall */
+				if (!(insn & 0x000fff80))
+					d->op = RV_ECALL;
 			break;
-			case 5 | 8: /* sra */
-				val = (int32_t)val >> (val2 & (32 - 1));
+			case 0x001:	/* ebreak */
+				if (!(insn & 0x000fff80))
+					d->op = RV_EBREAK;
 			break;
-			case 6: /* or */
-				val = val | val2;
+			case 0x302:	/* mret */
+				if (!(insn & 0x000fff80))
+					d->op = RV_MRET;
 			break;
-			case 7: /* and */
-				val = val & val2;
+			case 0x105:	/* wfi */
+				if (!(insn & 0x00007f80))
+					d->op = RV_WFI;
 			break;
-			default:
-				goto illegal_insn;
 			}
+		break;
 		}
-		c->reg[rd] = val;
-		c->pc +=4;
 	break;
+	}
 
-	case 0x73:
-		funct3 = (insn >> 12) & 7;
-		imm = insn >> 20;
-		if (funct3 & 4)
-			val = rs1;
-		else
-			val = c->reg[rs1];
-		funct3 &= 3;
-		switch(funct3) {
-		case 1: /* csrrw */
-			if (csr_read(c, &val2, imm, true))
-				goto illegal_insn;
-			val2 = (int32_t)val2;
-			err = csr_write(c, imm, val);
-			if (err < 0)
-				goto illegal_insn;
-			c->reg[rd] = val2;
-			c->pc += 4;
-		break;
+	/* writes to x0 land in a sink register */
+	if (d->rd == 0)
+		d->rd = 32;
+}
 
-		case 2: /* csrrs */
-		case 3: /* csrrc */
-			if (csr_read(c, &val2, imm, (rs1 != 0)))
-				goto illegal_insn;
-			val2 = (int32_t)val2;
-			if (rs1 != 0) {
-				if (funct3 == 2)
-					val = val2 | val;
-				else
-					val = val2 & ~val;
-				err = csr_write(c, imm, val);
-				if (err < 0)
-					goto illegal_insn;
-			} else {
-				err = 0;
+/* the 32 bit instruction a compressed one stands for, 0 if it has none
+ * here (reserved, or F/D and RV64 only encodings) */
+static uint32_t riscv32_expand(uint32_t c)
+{
+#define C_RD(c)		(((c) >> 7) & 0x1f)
+#define C_RS2(c)	(((c) >> 2) & 0x1f)
+#define C_RDP(c)	((((c) >> 2) & 7) + 8)	/* rd', rs2' */
+#define C_RS1P(c)	((((c) >> 7) & 7) + 8)	/* rs1', rd' */
+#define I_TYPE(imm, rs1, f3, rd, opc)	\
+	(((uint32_t)(imm) << 20) | (rs1) << 15 | (f3) << 12 | (rd) << 7 | (opc))
+#define S_TYPE(imm, rs2, rs1, f3)	\
+	(((uint32_t)(imm) >> 5 << 25) | (rs2) << 20 | (rs1) << 15 | (f3) << 12 | \
+	 ((imm) & 0x1f) << 7 | 0x23)
+#define R_TYPE(f7, rs2, rs1, f3, rd)	\
+	((f7) << 25 | (rs2) << 20 | (rs1) << 15 | (f3) << 12 | (rd) << 7 | 0x33)
+	uint32_t funct3 = (c >> 13) & 7, imm, rd;
+
+	switch ((c & 3) << 3 | funct3) {
+	case 0 << 3 | 0:	/* c.addi4spn */
+		imm = ((c >> 7) & 0x30) | ((c >> 1) & 0x3c0) | ((c >> 4) & 4) | ((c >> 2) & 8);
+		if (imm == 0)
+			return 0;
+		return I_TYPE(imm, 2, 0, C_RDP(c), 0x13);
+
+	case 0 << 3 | 2:	/* c.lw */
+		imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+		return I_TYPE(imm, C_RS1P(c), 2, C_RDP(c), 0x03);
+
+	case 0 << 3 | 6:	/* c.sw */
+		imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+		return S_TYPE(imm, C_RDP(c), C_RS1P(c), 2);
+
+	case 1 << 3 | 0:	/* c.addi, c.nop */
+	case 1 << 3 | 2:	/* c.li */
+		imm = (((int32_t)(c << 19) >> 26) & ~0x1f) | ((c >> 2) & 0x1f);
+		return I_TYPE(imm & 0xfff, funct3 ? 0 : C_RD(c), 0, C_RD(c), 0x13);
+
+	case 1 << 3 | 1:	/* c.jal */
+	case 1 << 3 | 5:	/* c.j */
+		imm = ((int32_t)(c << 19) >> 20 & ~0x7ff) | ((c >> 7) & 0x10) |
+			((c >> 1) & 0x300) | ((c << 2) & 0x400) | ((c >> 1) & 0x40) |
+			((c << 1) & 0x80) | ((c >> 2) & 0xe) | ((c << 3) & 0x20);
+		return (imm & 0x100000) << 11 | (imm & 0x7fe) << 20 | (imm & 0x800) << 9 |
+			(imm & 0xff000) | (funct3 == 1) << 7 | 0x6f;
+
+	case 1 << 3 | 3:
+		rd = C_RD(c);
+		if (rd == 2) {	/* c.addi16sp */
+			imm = ((int32_t)(c << 19) >> 22 & ~0x1ff) | ((c >> 2) & 0x10) |
+				((c << 1) & 0x40) | ((c << 4) & 0x180) | ((c << 3) & 0x20);
+			if (imm == 0)
+				return 0;
+			return I_TYPE(imm & 0xfff, 2, 0, 2, 0x13);
+		}
+		/* c.lui */
+		imm = ((int32_t)(c << 19) >> 14 & ~0x1ffff) | ((c << 10) & 0x1f000);
+		if (imm == 0)
+			return 0;
+		return (imm & 0xfffff000) | rd << 7 | 0x37;
+
+	case 1 << 3 | 4:
+		rd = C_RS1P(c);
+		imm = (((int32_t)(c << 19) >> 26) & ~0x1f) | ((c >> 2) & 0x1f);
+		switch ((c >> 10) & 3) {
+		case 0:		/* c.srli */
+		case 1:		/* c.srai */
+			if (c & 0x1000)
+				return 0;
+			return I_TYPE((imm & 0x1f) | ((c >> 10) & 1) << 10, rd, 5, rd, 0x13);
+		case 2:		/* c.andi */
+			return I_TYPE(imm & 0xfff, rd, 7, rd, 0x13);
+		default:
+			if (c & 0x1000)
+				return 0;
+			switch ((c >> 5) & 3) {
+			case 0: return R_TYPE(0x20, C_RDP(c), rd, 0, rd);	/* c.sub */
+			case 1: return R_TYPE(0, C_RDP(c), rd, 4, rd);		/* c.xor */
+			case 2: return R_TYPE(0, C_RDP(c), rd, 6, rd);		/* c.or */
+			default: return R_TYPE(0, C_RDP(c), rd, 7, rd);		/* c.and */
 			}
-			c->reg[rd] = val2;
-			c->pc += 4;
-		break;
+		}
 
-		case 0:
-			switch(imm) {
-			case 0x000: /* ecall */
-				if (insn & 0x000fff80)
-					goto illegal_insn;
-#ifndef	RISCV_ECALL
-				hostapi_ecall(m, &c->a0, &c->a1, &c->a2, &c->a3,
-					&c->a4, &c->a5, &c->a6, &c->a7);
-				c->pc += 4;
-#else
-				cause = CAUSE_MACHINE_ECALL;
-				goto exception;
-#endif
-			break;
+	case 1 << 3 | 6:	/* c.beqz */
+	case 1 << 3 | 7:	/* c.bnez */
+		imm = ((int32_t)(c << 19) >> 23 & ~0xff) | ((c >> 7) & 0x18) |
+			((c << 1) & 0xc0) | ((c >> 2) & 6) | ((c << 3) & 0x20);
+		return (imm & 0x1000) << 19 | (imm & 0x7e0) << 20 | C_RS1P(c) << 15 |
+			(funct3 & 1) << 12 | (imm & 0x1e) << 7 | (imm & 0x800) >> 4 | 0x63;
+
+	case 2 << 3 | 0:	/* c.slli */
+		if (c & 0x1000)
+			return 0;
+		return I_TYPE((c >> 2) & 0x1f, C_RD(c), 1, C_RD(c), 0x13);
+
+	case 2 << 3 | 2:	/* c.lwsp */
+		if (C_RD(c) == 0)
+			return 0;
+		imm = ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0);
+		return I_TYPE(imm, 2, 2, C_RD(c), 0x03);
+
+	case 2 << 3 | 4:
+		rd = C_RD(c);
+		if (!(c & 0x1000)) {
+			if (C_RS2(c))	/* c.mv */
+				return R_TYPE(0, C_RS2(c), 0, 0, rd);
+			if (rd == 0)
+				return 0;
+			return I_TYPE(0, rd, 0, 0, 0x67);	/* c.jr */
+		}
+		if (C_RS2(c))		/* c.add */
+			return R_TYPE(0, C_RS2(c), rd, 0, rd);
+		if (rd == 0)		/* c.ebreak */
+			return 0x00100073;
+		return I_TYPE(0, rd, 0, 1, 0x67);	/* c.jalr */
+
+	case 2 << 3 | 6:	/* c.swsp */
+		imm = ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0);
+		return S_TYPE(imm, C_RS2(c), 2, 2);
+	}
+	return 0;
+#undef C_RD
+#undef C_RS2
+#undef C_RDP
+#undef C_RS1P
+#undef I_TYPE
+#undef S_TYPE
+#undef R_TYPE
+}
 
-			case 0x001: /* ebreak */
-				debug = true;
-				if (insn & 0x000fff80)
-					goto illegal_insn;
-				cause = CAUSE_BREAKPOINT;
-				goto exception;
-			break;
+/* fold d and the plain decode e of the instruction after it into one
+ * op when they form an idiom compilers emit in fixed pairs.  The first
+ * one's destination must not feed the second in any other way. */
+static void riscv32_fuse(struct riscv32_insn *d, const struct riscv32_insn *e)
+{
+	uint32_t rd = (d->insn >> 7) & 0x1f;
+	uint32_t rs1 = (d->insn >> 15) & 0x1f, rs2 = (d->insn >> 20) & 0x1f;
+	uint32_t erd = (e->insn >> 7) & 0x1f;
+	uint32_t ers1 = (e->insn >> 15) & 0x1f, ers2 = (e->insn >> 20) & 0x1f;
+
+	if (rd == 0)
+		return;
+
+	switch (d->op) {
+	case RV_LUI:
+		if (e->op == RV_ADDI && erd == rd && ers1 == rd) {
+			d->op = RV_LUI_ADDI;
+			d->imm += e->imm;
+		}
+	break;
 
-			case 0x302: /* mret */
-				if (insn & 0x000fff80)
-					goto illegal_insn;
-				handle_mret(c);
+	case RV_AUIPC:
+		if (ers1 != rd)
+			break;
+		if (e->op == RV_ADDI && erd == rd) {
+			d->op = RV_AUIPC_ADDI;
+		} else if (e->op == RV_JALR) {
+			d->op = RV_AUIPC_JALR;
+		} else if (e->op == RV_LW) {
+			d->op = RV_AUIPC_LW;
+		} else {
 			break;
+		}
+		d->rs1 = rd;
+		d->rd = e->rd;
+		d->imm += e->imm;
+	break;
 
-			case 0x105: /* wfi */
-				if (insn & 0x00007f80)
-					goto illegal_insn;
-				c->pc += 4;
+	case RV_SLT:
+	case RV_SLTU:
+		if ((e->op != RV_BEQ && e->op != RV_BNE) ||
+			!((ers1 == rd && ers2 == 0) || (ers1 == 0 && ers2 == rd)))
 			break;
+		if (d->op == RV_SLT)
+			d->op = e->op == RV_BEQ ? RV_SLT_BEQ : RV_SLT_BNE;
+		else
+			d->op = e->op == RV_BEQ ? RV_SLTU_BEQ : RV_SLTU_BNE;
+		d->imm = e->imm;
+	break;
 
-			default: goto illegal_insn;
+	case RV_MUL: case RV_MULH: case RV_MULHSU: case RV_MULHU:
+	case RV_DIV: case RV_DIVU: case RV_REM: case RV_REMU:
+		if (ers1 != rs1 || ers2 != rs2 || rd == rs1 || rd == rs2 || rd == erd)
 			break;
-			}
+		switch (d->op << 8 | e->op) {
+		case RV_MULH << 8 | RV_MUL: case RV_MUL << 8 | RV_MULH:
+			d->op = RV_MULH_MUL;
+		break;
+		case RV_MULHSU << 8 | RV_MUL: case RV_MUL << 8 | RV_MULHSU:
+			d->op = RV_MULHSU_MUL;
+		break;
+		case RV_MULHU << 8 | RV_MUL: case RV_MUL << 8 | RV_MULHU:
+			d->op = RV_MULHU_MUL;
+		break;
+		case RV_DIV << 8 | RV_REM: case RV_REM << 8 | RV_DIV:
+			d->op = RV_DIV_REM;
 		break;
-		default: goto illegal_insn;
+		case RV_DIVU << 8 | RV_REMU: case RV_REMU << 8 | RV_DIVU:
+			d->op = RV_DIVU_REMU;
+		break;
+		default:
+			return;
+		}
+		/* rd: high half or quotient, imm: low half or remainder */
+		if (e->op == RV_MUL || e->op == RV_REM || e->op == RV_REMU) {
+			d->imm = e->rd;
+		} else {
+			d->imm = d->rd;
+			d->rd = e->rd;
 		}
 	break;
 	}
+}
 
-the_end:
-	c->zero = 0;
-	return debug;
+/* decode the instruction at pc into its cache slot d; returns NULL if pc
+ * can not be fetched */
+/* the RV_C_* twin of every op a compressed instruction expands to */
+static const uint8_t rvc_ops[RV_RVC] = {
+	[RV_LUI] = RV_C_LUI, [RV_JAL] = RV_C_JAL, [RV_JALR] = RV_C_JALR,
+	[RV_BEQ] = RV_C_BEQ, [RV_BNE] = RV_C_BNE,
+	[RV_LW] = RV_C_LW, [RV_SW] = RV_C_SW,
+	[RV_ADDI] = RV_C_ADDI, [RV_ANDI] = RV_C_ANDI,
+	[RV_SLLI] = RV_C_SLLI, [RV_SRLI] = RV_C_SRLI, [RV_SRAI] = RV_C_SRAI,
+	[RV_ADD] = RV_C_ADD, [RV_SUB] = RV_C_SUB, [RV_XOR] = RV_C_XOR,
+	[RV_OR] = RV_C_OR, [RV_AND] = RV_C_AND,
+};
+
+struct riscv32_insn *riscv32_decode_at(struct riscv32_vm *m, struct riscv32_insn *d, uint32_t pc)
+{
+	struct riscv32_insn e;
+	uint32_t insn;
+	uint16_t half;
+
+	riscv32_icache_touch(m, d);
+	riscv32_code_mark(m, pc);
+	/* code on a page of a limited vm that nothing touched yet */
+	if (m->mem_pages && pc < m->memsize && riscv32_mem_commit(m, pc, 2, false))
+		return NULL;
+	if (riscv32_read_u16(m, pc, &half, RISCV32_ACCESS_FETCH))
+		return NULL;
+
+	/* d->insn only keeps the length of the instruction under it */
+	if (m->debug && riscv32_break_at(m->debug, pc)) {
+		d->op = RV_BREAKPOINT;
+		d->insn = (half & 3) == 3 ? 3 : 1;
+		d->pc = pc;
+		return d;
+	}
+
+	/* compressed: decoded as its expansion, never fused; only ILLEGAL
+	 * and EBREAK, which do not advance pc, keep their base op */
+	if ((half & 3) != 3) {
+		insn = riscv32_expand(half);
+		riscv32_decode(d, insn);
+		if (rvc_ops[d->op])
+			d->op = rvc_ops[d->op];
+		d->insn = insn ? insn & ~2 : half;
+		d->pc = pc;
+		return d;
+	}
 
-illegal_insn:
-	cause = CAUSE_ILLEGAL_INSTRUCTION;
-	tval = insn;
-mmu_exception:
-	debug = true;
-exception:
-	raise_exception2(c, cause, tval) ;
-	goto the_end;
+	if (m->mem_pages && (uint64_t)pc + 4 <= m->memsize && riscv32_mem_commit(m, pc, 4, false))
+		return NULL;
+	if (riscv32_read_u32(m, pc, &insn, RISCV32_ACCESS_FETCH))
+		return NULL;
+
+	/* fusing only looks at a next instruction that is already there */
+	riscv32_decode(d, insn);
+	if (m->mem_pages && (uint64_t)pc + 8 <= m->memsize &&
+			!riscv32_mem_committed(m, pc + 7))
+		insn = 0;
+	else if (riscv32_read_u32(m, pc + 4, &insn, RISCV32_ACCESS_FETCH))
+		insn = 0;
+	if ((insn & 3) == 3 &&
+			!(m->debug && riscv32_break_at(m->debug, pc + 4))) {
+		riscv32_decode(&e, insn);
+		riscv32_fuse(d, &e);
+	}
+	d->pc = pc;
+	return d;
 }
 
-struct riscv32_vm *riscv32_vm(unsigned memsize)
+/* the state a guarded access leaves for riscv32_guard_fault; the fence
+ * keeps the register file stores ahead of the access that may fault */
+static inline void riscv32_guard_mark(struct riscv32_vm *m, uint32_t pc, unsigned n)
+{
+	m->fault_pc = pc;
+	m->fault_n = n;
+	atomic_signal_fence(memory_order_seq_cst);
+}
+
+#define RISCV32_RUN_SWITCH	riscv32_run_switch
+#define RISCV32_RUN_THREADED	riscv32_run_threaded
+#define GUARDED			0
+#include "riscv-cores.h"
+
+#define RISCV32_RUN_SWITCH	riscv32_run_switch_watched
+#define GUARDED			0
+#define WATCHED			1
+#include "riscv-cores.h"
+
+#define RISCV32_RUN_SWITCH	riscv32_run_switch_traced
+#define GUARDED			0
+#define WATCHED			1
+#define TRACED			1
+#include "riscv-cores.h"
+
+#ifdef RISCV32_HAVE_GUARD
+#define RISCV32_RUN_SWITCH	riscv32_run_switch_guarded
+#define RISCV32_RUN_THREADED	riscv32_run_threaded_guarded
+#define GUARDED			1
+#include "riscv-cores.h"
+
+static __thread struct riscv32_vm *riscv32_guard_vm;
+static struct sigaction riscv32_guard_old;
+static pthread_once_t riscv32_guard_once = PTHREAD_ONCE_INIT;
+
+/* make the pages of [base, base + size) of a limited vm accessible,
+ * counting the new ones against its limit unless force; -1 when that
+ * would go past it.  Called from the SIGSEGV handler too. */
+int riscv32_mem_commit(struct riscv32_vm *m, uint32_t base, uint32_t size, bool force)
+{
+	uint64_t page = (uint64_t)1 << m->mem_shift;
+	uint32_t p, end;
+
+	if (size == 0)
+		return 0;
+
+	end = (uint32_t)(((uint64_t)base + size - 1) >> m->mem_shift);
+	for (p = base >> m->mem_shift; p <= end; p++) {
+		if (m->mem_pages[p >> 3] & (1 << (p & 7)))
+			continue;
+		if (!force && m->mem_committed + page > m->mem_limit)
+			return -1;
+		if (mprotect(m->mem + ((uint64_t)p << m->mem_shift), page, PROT_READ | PROT_WRITE))
+			return -1;
+		m->mem_pages[p >> 3] |= 1 << (p & 7);
+		m->mem_committed += page;
+	}
+	return 0;
+}
+
+static void riscv32_guard_handler(int sig, siginfo_t *si, void *uc)
+{
+	struct riscv32_vm *m = riscv32_guard_vm;
+	uint8_t *addr = si->si_addr;
+
+	if (m && addr >= m->mem && addr < m->mem + RISCV32_GUARD_SIZE) {
+		/* the first touch of a page of a limited vm; a core that can not
+		 * take the fault back commits it past the limit */
+		if (m->mem_pages && addr < m->mem + m->memsize &&
+				!riscv32_mem_commit(m, addr - m->mem, 1, m->fault_jmp == NULL))
+			return;
+		if (m->fault_jmp)
+			siglongjmp(*(sigjmp_buf *)m->fault_jmp, 1);
+	}
+
+	/* not a guest access, fault again under the old disposition */
+	sigaction(SIGSEGV, &riscv32_guard_old, NULL);
+}
+
+static void riscv32_guard_install(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = riscv32_guard_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &riscv32_guard_old);
+}
+
+/* the faulting op is still the decoded instruction at fault_pc and has
+ * not written rd yet, so its address can be computed again */
+static unsigned riscv32_guard_fault(struct riscv32_vm *m, int *exit_reason)
+{
+	struct riscv32_cpu *c = &m->cpu;
+	struct riscv32_insn *d = riscv32_fetch(m, m->fault_pc);
+	uint32_t cause, addr = m->reg[d->rs1] + d->imm;
+
+	switch (d->op) {
+	case RV_SB: case RV_SH: case RV_SW: case RV_C_SW:
+		cause = CAUSE_FAULT_STORE;
+		break;
+	default:
+		cause = CAUSE_FAULT_LOAD;
+		break;
+	}
+
+	/* a device access completes here and ends the run */
+	if (((d->op == RV_LW || d->op == RV_C_LW) && !riscv32_mmio_read(m, addr, &m->reg[d->rd])) ||
+			((d->op == RV_SW || d->op == RV_C_SW) && !riscv32_mmio_write(m, addr, m->reg[d->rs2]))) {
+		memcpy(c->reg, m->reg, sizeof(c->reg));
+		c->pc = m->fault_pc + RISCV32_INSN_LEN(d);
+		*exit_reason = RISCV32_EXIT_BUDGET;
+		m->instret += m->fault_n + 1;
+		return m->fault_n + 1;
+	}
+
+	memcpy(c->reg, m->reg, sizeof(c->reg));
+	c->pc = m->fault_pc;
+	raise_exception2(c, cause, addr);
+	*exit_reason = RISCV32_EXIT_TRAP;
+	m->instret += m->fault_n;
+	return m->fault_n;
+}
+
+static unsigned riscv32_run_guarded(struct riscv32_vm *m, unsigned max_insns, int *exit_reason,
+	unsigned (*core)(struct riscv32_vm *, unsigned, int *))
+{
+	struct riscv32_vm *prev = riscv32_guard_vm;
+	sigjmp_buf fault;
+	void *prev_jmp = m->fault_jmp;
+	unsigned n;
+
+	if (sigsetjmp(fault, 0)) {
+		riscv32_guard_vm = prev;
+		m->fault_jmp = prev_jmp;
+		return riscv32_guard_fault(m, exit_reason);
+	}
+
+	m->fault_jmp = &fault;
+	riscv32_guard_vm = m;
+	n = core(m, max_insns, exit_reason);
+	riscv32_guard_vm = prev;
+	m->fault_jmp = prev_jmp;
+	return n;
+}
+
+/* the bounds checked cores on a limited vm: its pages still commit on
+ * first touch, but as the faulting access can not be undone, without
+ * regard to the limit */
+static unsigned riscv32_run_committing(struct riscv32_vm *m, unsigned max_insns, int *exit_reason,
+	unsigned (*core)(struct riscv32_vm *, unsigned, int *))
+{
+	struct riscv32_vm *prev = riscv32_guard_vm;
+	unsigned n;
+
+	riscv32_guard_vm = m;
+	n = core(m, max_insns, exit_reason);
+	riscv32_guard_vm = prev;
+	return n;
+}
+#else
+int riscv32_mem_commit(struct riscv32_vm *m, uint32_t base, uint32_t size, bool force)
+{
+	return -1;
+}
+#endif
+
+/* the interpreter used where no translated code exists */
+unsigned riscv32_run_interp(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+#ifdef RISCV32_HAVE_GUARD
+	if (m->flags & RISCV32_VM_GUARD)
+		return riscv32_run_guarded(m, max_insns, exit_reason, riscv32_run_threaded_guarded);
+#endif
+#ifdef __GNUC__
+	return riscv32_run_threaded(m, max_insns, exit_reason);
+#else
+	return riscv32_run_switch(m, max_insns, exit_reason);
+#endif
+}
+
+static unsigned riscv32_run_engine(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	unsigned (*core)(struct riscv32_vm *, unsigned, int *) = NULL;
+
+	/* bounds checked accesses work on every backend */
+	if (m->trace)
+		core = riscv32_run_switch_traced;
+	else if (m->debug && m->debug->nwatch)
+		core = riscv32_run_switch_watched;
+	if (core != NULL) {
+#ifdef RISCV32_HAVE_GUARD
+		if (m->mem_pages)
+			return riscv32_run_committing(m, max_insns, exit_reason, core);
+#endif
+		return core(m, max_insns, exit_reason);
+	}
+#ifdef RISCV_JIT
+	/* translated code has no way back from an access past the limit */
+	if (m->engine == RISCV32_ENGINE_JIT && m->mem_pages == NULL)
+		return riscv32_run_jit(m, max_insns, exit_reason);
+#endif
+#ifdef RISCV32_HAVE_GUARD
+	if (m->flags & RISCV32_VM_GUARD)
+		return riscv32_run_guarded(m, max_insns, exit_reason,
+			m->engine == RISCV32_ENGINE_THREADED ?
+			riscv32_run_threaded_guarded : riscv32_run_switch_guarded);
+#endif
+#ifdef __GNUC__
+	if (m->engine == RISCV32_ENGINE_THREADED)
+		return riscv32_run_threaded(m, max_insns, exit_reason);
+#endif
+	return riscv32_run_switch(m, max_insns, exit_reason);
+}
+
+/* the engine in slices while interrupts are enabled, taking a due one
+ * before each; a wfi with one pending is done waiting */
+static unsigned riscv32_run_irq(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	unsigned n = 0, k;
+
+	do {
+		k = max_insns - n;
+		if (riscv32_irq_armed(&m->cpu)) {
+			riscv32_irq_take(m);
+			if (k > RISCV32_IRQ_SLICE)
+				k = RISCV32_IRQ_SLICE;
+		}
+		n += riscv32_run_engine(m, k, exit_reason);
+		if (*exit_reason == RISCV32_EXIT_IRQ ||
+				(*exit_reason == RISCV32_EXIT_WFI && riscv32_irq_pending(m)))
+			*exit_reason = RISCV32_EXIT_BUDGET;
+	} while (*exit_reason == RISCV32_EXIT_BUDGET && n < max_insns);
+	return n;
+}
+
+/* run up to max_insns instructions on the engine selected by vm->engine;
+ * returns the number of instructions retired and stores why it stopped
+ * in *exit_reason.  vm->fuel only narrows the budget every engine already
+ * counts, so a limited vm costs nothing more per instruction. */
+unsigned riscv32_cpu_run(struct riscv32_vm *m, unsigned max_insns, int *exit_reason)
+{
+	unsigned n;
+
+	if (m->fuel == 0) {
+		*exit_reason = RISCV32_EXIT_FUEL;
+		return 0;
+	}
+	if (max_insns > m->fuel)
+		max_insns = m->fuel;
+	if (m->debug)
+		m->debug->hit = 0;
+
+	n = riscv32_run_irq(m, max_insns, exit_reason);
+	/* a watchpoint hit by the last instruction of the budget */
+	if (m->debug && m->debug->hit)
+		*exit_reason = RISCV32_EXIT_DEBUG;
+
+	if (m->fuel != RISCV32_FUEL_UNLIMITED) {
+		m->fuel -= n;
+		if (m->fuel == 0 && *exit_reason == RISCV32_EXIT_BUDGET)
+			*exit_reason = RISCV32_EXIT_FUEL;
+	}
+	return n;
+}
+
+int riscv32_cpu_exec(struct riscv32_vm *m)
+{
+	int reason;
+	struct riscv32_cpu *c = &m->cpu;
+
+	riscv32_cpu_run(m, 1, &reason);
+	if (reason == RISCV32_EXIT_ECALL)
+		hostapi_ecall(m, &c->a0, &c->a1, &c->a2, &c->a3,
+			&c->a4, &c->a5, &c->a6, &c->a7);
+
+	return reason == RISCV32_EXIT_EBREAK || reason == RISCV32_EXIT_TRAP;
+}
+
+/* the vm without guest memory, or with memsize bytes of it trailing the
+ * struct when it is neither guarded nor mapped */
+struct riscv32_vm *riscv32_vm_alloc(unsigned memsize, unsigned flags)
 {
 	struct riscv32_vm *vm;
+	uint32_t i;
+
 	vm = calloc(1, sizeof(struct riscv32_vm) + memsize);
-	if (vm) {
-		vm->memsize = memsize;
+	if (vm == NULL)
+		return NULL;
+
+	vm->icache = malloc(RISCV32_ICACHE_SIZE * sizeof(struct riscv32_insn));
+	if (vm->icache == NULL) {
+		free(vm);
+		return NULL;
 	}
+
+	for (i = 0; i < RISCV32_ICACHE_SIZE; i++)
+		vm->icache[i].pc = RISCV32_ICACHE_INVALID;
+	vm->icache_lo = RISCV32_ICACHE_SIZE;
+	vm->mem = (uint8_t *)(vm + 1);
+	vm->memsize = memsize;
+	vm->engine = RISCV32_ENGINE_DEFAULT;
+	vm->flags = flags;
+	vm->fuel = RISCV32_FUEL_UNLIMITED;
+	vm->mtimecmp = UINT64_MAX;
+	riscv32_set_time(vm, 0);
 	return vm;
 }
 
+#ifdef RISCV32_HAVE_MMAP
+/* give vm memsize bytes of guest memory, rounded up to host pages: zero
+ * pages when fd is -1, otherwise a private copy on write mapping of fd
+ * from the page aligned off.
+ * RISCV32_VM_GUARD vms get them at the start of a reservation of the
+ * whole 32 bit guest space plus a guard for accesses straddling its end. */
+int riscv32_vm_map(struct riscv32_vm *vm, unsigned memsize, int fd, uint64_t off)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t size = ((uint64_t)memsize + page - 1) & ~(page - 1);
+	uint64_t mapsize = size;
+	uint8_t *mem;
+
+	if (size > ((uint64_t)1 << 32))
+		return -1;
+
+	if (vm->flags & RISCV32_VM_GUARD) {
+#ifdef RISCV32_HAVE_GUARD
+		mapsize = RISCV32_GUARD_SIZE;
+#else
+		return -1;
+#endif
+	}
+
+	mem = mmap(NULL, mapsize, mapsize == size ? PROT_READ | PROT_WRITE : PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+
+	if (fd >= 0 && size) {
+		if (mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+				fd, off) == MAP_FAILED)
+			goto err;
+	} else if (mapsize != size && size) {
+		if (mprotect(mem, size, PROT_READ | PROT_WRITE))
+			goto err;
+	}
+
+#ifdef RISCV32_HAVE_GUARD
+	if (vm->flags & RISCV32_VM_GUARD) {
+		pthread_once(&riscv32_guard_once, riscv32_guard_install);
+		/* the whole pages are guest memory, nothing traps below size */
+		memsize = size;
+	}
+#endif
+	vm->mem = mem;
+	vm->mapsize = mapsize;
+	vm->memsize = memsize;
+	return 0;
+
+err:
+	munmap(mem, mapsize);
+	return -1;
+}
+#endif
+
+/* guest memory is mapped where possible: page aligned, so loaders can
+ * map files into it, and lazily zero filled */
+struct riscv32_vm *riscv32_vm_create(unsigned memsize, unsigned flags)
+{
+	struct riscv32_vm *vm;
+
+#ifdef RISCV32_HAVE_MMAP
+	vm = riscv32_vm_alloc(0, flags);
+	if (vm == NULL)
+		return NULL;
+
+	if (riscv32_vm_map(vm, memsize, -1, 0) == 0)
+		return vm;
+
+	riscv32_vm_destroy(vm);
+#endif
+	if (flags & RISCV32_VM_GUARD)
+		return NULL;
+
+	return riscv32_vm_alloc(memsize, flags);
+}
+
+/* let the guarded vm commit at most limit bytes of its memory: each page
+ * is inaccessible until first touched, and a guest access that would go
+ * past the limit traps as an access fault.  Pages already resident count,
+ * so it is set once the image is loaded; later calls only move the limit.
+ * Clones do not inherit it. */
+int riscv32_vm_limit(struct riscv32_vm *vm, uint64_t limit)
+{
+#ifdef RISCV32_HAVE_GUARD
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint32_t pages, p, run;
+	unsigned char *vec;
+
+	if (!(vm->flags & RISCV32_VM_GUARD) || vm->mapsize == 0)
+		return -1;
+	if (vm->mem_pages) {
+		vm->mem_limit = limit;
+		return 0;
+	}
+
+	/* memsize of a guarded vm is whole pages */
+	pages = (uint64_t)vm->memsize / page;
+	vm->mem_pages = calloc(1, (pages >> 3) + 1);
+	vec = malloc(pages + 1);
+	if (vm->mem_pages == NULL || vec == NULL || (pages && mincore(vm->mem, vm->memsize, vec)))
+		goto err;
+
+	for (vm->mem_shift = 0; ((uint64_t)1 << vm->mem_shift) < page; vm->mem_shift++)
+		;
+	for (p = 0; p < pages; p += run) {
+		if (vec[p] & 1) {
+			vm->mem_pages[p >> 3] |= 1 << (p & 7);
+			vm->mem_committed += page;
+			run = 1;
+			continue;
+		}
+		for (run = 1; p + run < pages && !(vec[p + run] & 1); run++)
+			;
+		if (mprotect(vm->mem + (uint64_t)p * page, (uint64_t)run * page, PROT_NONE))
+			goto err;
+	}
+	free(vec);
+	vm->mem_limit = limit;
+	return 0;
+
+err:
+	if (vm->mem_pages)
+		mprotect(vm->mem, vm->memsize, PROT_READ | PROT_WRITE);
+	free(vm->mem_pages);
+	free(vec);
+	vm->mem_pages = NULL;
+	vm->mem_committed = 0;
+#endif
+	return -1;
+}
+
+struct riscv32_vm *riscv32_vm(unsigned memsize)
+{
+	return riscv32_vm_create(memsize, 0);
+}
+
+void riscv32_vm_destroy(struct riscv32_vm *vm)
+{
+#ifdef RISCV_JIT
+	riscv32_jit_free(vm);
+#endif
+#ifdef RISCV32_HAVE_MMAP
+	if (vm->mapsize)
+		munmap(vm->mem, vm->mapsize);
+#endif
+	riscv32_trace_stop(vm);
+	riscv32_symtab_free(vm);
+	riscv32_debug_free(vm);
+	free(vm->mem_pages);
+	free(vm->icache);
+	free(vm);
+}
+
 int riscv32_load_rom(struct riscv32_vm *vm, const void *rom, unsigned romsize, unsigned romoff)
 {
 	if (romsize + romoff > vm->memsize)
 		return -1;
+	if (vm->mem_pages && riscv32_mem_commit(vm, romoff, romsize, false))
+		return -1;
 
 	memcpy(vm->mem + romoff, rom, romsize);
+	riscv32_icache_invalidate_range(vm, romoff, romsize);
 
 	return 0;
 }
 
+/* the returned window may be written by the host, so it drops any decoded
+ * instructions it covers */
 void *riscv32_mem_map(struct riscv32_vm *vm, unsigned base, unsigned size)
 {
-	if ((uint64_t)base + size < vm->memsize)
+	if ((uint64_t)base + size < vm->memsize) {
+		/* the host touches the window without faulting */
+		if (vm->mem_pages && riscv32_mem_commit(vm, base, size, false))
+			return NULL;
+		riscv32_icache_invalidate_range(vm, base, size);
 		return vm->mem + base;
+	}
 	return NULL;
 }
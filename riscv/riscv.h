@@ -56,17 +56,141 @@ struct riscv32_cpu {
 	uint32_t pc;
 };
 
+/* interpreter cores for riscv32_vm.engine */
+enum {
+	RISCV32_ENGINE_SWITCH,		/* one switch over the decoded op */
+	RISCV32_ENGINE_THREADED,	/* computed goto from handler to handler */
+	RISCV32_ENGINE_JIT,		/* x86-64 translation of hot blocks */
+};
+
+/* decoder fused pairs, counted in riscv32_vm.fused by builds with
+ * RISCV_FUSION_STATS */
+enum {
+	RISCV32_FUSE_LUI_ADDI,		/* lui+addi constant */
+	RISCV32_FUSE_AUIPC_ADDI,	/* auipc+addi pc relative address */
+	RISCV32_FUSE_AUIPC_JALR,	/* auipc+jalr far call */
+	RISCV32_FUSE_AUIPC_LW,		/* auipc+lw pc relative load */
+	RISCV32_FUSE_SLT_BRANCH,	/* slt[u]+beq/bne against zero */
+	RISCV32_FUSE_MUL_PAIR,		/* mulh[su|u]+mul of the same operands */
+	RISCV32_FUSE_DIV_PAIR,		/* div[u]+rem[u] of the same operands */
+	RISCV32_NR_FUSE,
+};
+
+/* riscv32_vm_create flags */
+#define RISCV32_VM_GUARD	(1 << 0)	/* 4 GiB reservation, faults caught by SIGSEGV */
+
+struct riscv32_insn;
+struct riscv32_jit;
+struct riscv32_symtab;
+struct riscv32_debug;
+struct riscv32_trace;
+
 struct riscv32_vm
 {
 	struct riscv32_cpu cpu;
+	struct riscv32_insn *icache;
+	uint32_t icache_lo;	/* span of the slots written since allocation or */
+	uint32_t icache_hi;	/* the last pool reset, empty when lo > hi */
+	int engine;
+	struct riscv32_jit *jit;
+	uint8_t *code_map;	/* guest ranges covered by translated code */
+	unsigned flags;
+	uint32_t reg[33];	/* cpu.reg while running, reg[32] sinks writes to x0 */
+	uint32_t fault_pc;	/* pc and retired count at the last guarded access */
+	unsigned fault_n;
+	void *fault_jmp;
+	uint64_t fused[RISCV32_NR_FUSE];
 	unsigned memsize;
-	uint8_t	mem[0];
+	uint8_t	*mem;
+	uint64_t mapsize;	/* bytes mmap()ed at mem, 0 when mem trails the vm */
+	uint8_t *mem_pages;	/* a bit per committed page, NULL without a limit */
+	uint64_t mem_limit;	/* bytes of guest memory that may be committed */
+	uint64_t mem_committed;
+	unsigned mem_shift;	/* log2 of the host page */
+	struct riscv32_symtab *symtab;	/* from riscv32_load_elf */
+	uint64_t fuel;		/* instructions left, RISCV32_FUEL_UNLIMITED for no limit */
+	uint64_t instret;	/* retired by finished runs, the cycle and instret csrs */
+	uint64_t time_base;	/* host monotonic ns at guest time 0 */
+	/* sees every read of the time csr and returns the value it gives */
+	uint64_t (*time_hook)(struct riscv32_vm *vm, uint64_t time);
+	uint64_t mtimecmp;	/* the CLINT's, UINT64_MAX until the guest sets it */
+	int meip;		/* the external interrupt line, driven by the host */
+	void *host;		/* the embedder's, the library never touches it */
+	struct riscv32_debug *debug;	/* breakpoints and watchpoints */
+	struct riscv32_trace *trace;	/* from riscv32_trace_start */
+};
+
+/* frequency of the time csr */
+#define RISCV32_TIME_HZ		10000000
+
+/* the CLINT of the hart, for aligned 32 bit accesses past the end of
+ * guest memory: msip, mtimecmp and mtime, which is the time csr */
+#define RISCV32_CLINT_BASE	0x02000000
+#define RISCV32_CLINT_MSIP	0x0000
+#define RISCV32_CLINT_MTIMECMP	0x4000
+#define RISCV32_CLINT_MTIME	0xbff8
+
+#define RISCV32_FUEL_UNLIMITED	UINT64_MAX
+
+/* why riscv32_cpu_run stopped */
+enum {
+	RISCV32_EXIT_BUDGET,	/* max_insns retired */
+	RISCV32_EXIT_ECALL,	/* ecall for the host: a0-a7 hold the request, pc is past it */
+	RISCV32_EXIT_EBREAK,	/* breakpoint raised, mepc is the ebreak */
+	RISCV32_EXIT_TRAP,	/* exception raised, mepc is the faulting instruction */
+	RISCV32_EXIT_FUEL,	/* vm->fuel ran out, refill it to resume */
+	RISCV32_EXIT_WFI,	/* wfi: nothing to do until an interrupt, pc is past it */
+	RISCV32_EXIT_DEBUG,	/* at a breakpoint, or past an access a watchpoint covers */
 };
 
 struct riscv32_vm *riscv32_vm(unsigned memsize);
+struct riscv32_vm *riscv32_vm_create(unsigned memsize, unsigned flags);
+void riscv32_vm_destroy(struct riscv32_vm *vm);
+int riscv32_vm_limit(struct riscv32_vm *vm, uint64_t limit);
+
+/* copy on write images of a vm, for cheap fresh instances */
+struct riscv32_snapshot;
+struct riscv32_snapshot *riscv32_snapshot(struct riscv32_vm *vm);
+struct riscv32_vm *riscv32_vm_clone(struct riscv32_snapshot *snap);
+void riscv32_snapshot_free(struct riscv32_snapshot *snap);
+/* snapshots in files, memory mapped back */
+int riscv32_snapshot_save(struct riscv32_snapshot *snap, struct riscv32_vm *warm, int fd);
+struct riscv32_snapshot *riscv32_snapshot_load(int fd, unsigned flags);
+/* clones of a snapshot recycled in place instead of destroyed */
+struct riscv32_pool;
+struct riscv32_pool *riscv32_pool_create(struct riscv32_snapshot *snap, unsigned max);
+void riscv32_pool_destroy(struct riscv32_pool *pool);
+struct riscv32_vm *riscv32_pool_get(struct riscv32_pool *pool);
+void riscv32_pool_put(struct riscv32_pool *pool, struct riscv32_vm *vm);
 int riscv32_cpu_exec(struct riscv32_vm *vm);
+unsigned riscv32_cpu_run(struct riscv32_vm *vm, unsigned max_insns, int *exit_reason);
+int64_t riscv32_timer_deadline(struct riscv32_vm *vm);
+void riscv32_irq_external(struct riscv32_vm *vm, int level);
+int riscv32_wfi_done(struct riscv32_vm *vm);
 int riscv32_load_rom(struct riscv32_vm *vm, const void *rom, unsigned romsize, unsigned romoff);
 void *riscv32_mem_map(struct riscv32_vm *vm, unsigned base, unsigned size);
+int riscv32_load_elf(struct riscv32_vm *vm, int fd, uint32_t *end);
+const char *riscv32_symbol(struct riscv32_vm *vm, uint32_t addr, uint32_t *offset);
+int riscv32_symbol_addr(struct riscv32_vm *vm, const char *name, uint32_t *addr);
+
+/* gdb's Z packet types for riscv32_watch_insert */
+enum {
+	RISCV32_WATCH_WRITE = 1,
+	RISCV32_WATCH_READ = 2,
+	RISCV32_WATCH_ACCESS = 3,
+};
+
+int riscv32_break_insert(struct riscv32_vm *vm, uint32_t addr);
+int riscv32_break_remove(struct riscv32_vm *vm, uint32_t addr);
+int riscv32_watch_insert(struct riscv32_vm *vm, uint32_t addr, uint32_t len, int type);
+int riscv32_watch_remove(struct riscv32_vm *vm, uint32_t addr, uint32_t len, int type);
+int riscv32_debug_hit(struct riscv32_vm *vm, uint32_t *addr);
+
+/* compact traces of the control flow of a vm, replayed against its image */
+typedef void (*riscv32_trace_fn)(void *arg, uint32_t pc, uint32_t insn);
+int riscv32_trace_start(struct riscv32_vm *vm, int fd);
+int riscv32_trace_stop(struct riscv32_vm *vm);
+int riscv32_trace_replay(struct riscv32_vm *vm, int fd, riscv32_trace_fn fn, void *arg);
 
 #endif /* __RISCV_H__*/
 
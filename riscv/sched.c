@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "riscv.h"
+#include "riscv-sched.h"
+
+#define SCHED_QUEUE_INIT	64
+
+/* a ring of runnable vms; the owner takes from the head, pushes to the
+ * tail and thieves take from the tail */
+struct sched_queue {
+	pthread_mutex_t lock;
+	struct riscv32_vm **vms;
+	unsigned head, tail;	/* free running, masked by size - 1 */
+	unsigned size;
+};
+
+struct sched_worker {
+	struct riscv32_sched *s;
+	pthread_t thread;
+	unsigned id;
+	struct sched_queue q;
+};
+
+struct riscv32_sched {
+	unsigned nworkers;
+	unsigned quantum;
+	riscv32_sched_exit_t exit;
+	void *arg;
+	atomic_uint nready;	/* vms sitting in some queue */
+	atomic_uint nidle;	/* workers asleep on wake */
+	atomic_uint next;	/* round robin for vms queued from outside */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/* work was queued, or stop was set */
+	pthread_cond_t done;	/* live dropped to zero */
+	unsigned live;		/* added and not yet done */
+	bool stop;
+	struct sched_worker workers[];
+};
+
+static __thread struct sched_worker *sched_self;
+
+static int sched_push(struct sched_queue *q, struct riscv32_vm *vm)
+{
+	struct riscv32_vm **vms;
+	unsigned i, n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->tail - q->head;
+	if (n == q->size) {
+		vms = malloc(q->size * 2 * sizeof(*vms));
+		if (vms == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		for (i = 0; i < n; i++)
+			vms[i] = q->vms[(q->head + i) & (q->size - 1)];
+		free(q->vms);
+		q->vms = vms;
+		q->head = 0;
+		q->tail = n;
+		q->size *= 2;
+	}
+	q->vms[q->tail++ & (q->size - 1)] = vm;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+static struct riscv32_vm *sched_pop(struct sched_queue *q, bool steal)
+{
+	struct riscv32_vm *vm = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		if (steal)
+			vm = q->vms[--q->tail & (q->size - 1)];
+		else
+			vm = q->vms[q->head++ & (q->size - 1)];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return vm;
+}
+
+/* queue vm on w and wake a sleeping worker if there is one */
+static void sched_ready(struct riscv32_sched *s, struct sched_worker *w, struct riscv32_vm *vm)
+{
+	/* counted first so a thief never sees more vms than nready */
+	atomic_fetch_add(&s->nready, 1);
+
+	/* on allocation failure try the other queues, one has room */
+	while (sched_push(&w->q, vm))
+		w = &s->workers[(w->id + 1) % s->nworkers];
+
+	if (atomic_load(&s->nidle)) {
+		pthread_mutex_lock(&s->lock);
+		pthread_cond_signal(&s->wake);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static struct riscv32_vm *sched_next(struct riscv32_sched *s, struct sched_worker *w)
+{
+	struct riscv32_vm *vm;
+	unsigned i;
+
+	vm = sched_pop(&w->q, false);
+	for (i = 1; vm == NULL && i < s->nworkers; i++)
+		vm = sched_pop(&s->workers[(w->id + i) % s->nworkers].q, true);
+
+	if (vm)
+		atomic_fetch_sub(&s->nready, 1);
+	return vm;
+}
+
+static void sched_finish(struct riscv32_sched *s)
+{
+	pthread_mutex_lock(&s->lock);
+	if (--s->live == 0)
+		pthread_cond_broadcast(&s->done);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *sched_worker(void *arg)
+{
+	struct sched_worker *w = arg;
+	struct riscv32_sched *s = w->s;
+	struct riscv32_vm *vm;
+	int reason;
+
+	sched_self = w;
+	for (;;) {
+		vm = sched_next(s, w);
+		if (vm == NULL) {
+			pthread_mutex_lock(&s->lock);
+			atomic_fetch_add(&s->nidle, 1);
+			while (!s->stop && atomic_load(&s->nready) == 0)
+				pthread_cond_wait(&s->wake, &s->lock);
+			atomic_fetch_sub(&s->nidle, 1);
+			if (s->stop) {
+				pthread_mutex_unlock(&s->lock);
+				break;
+			}
+			pthread_mutex_unlock(&s->lock);
+			continue;
+		}
+
+		riscv32_cpu_run(vm, s->quantum, &reason);
+		if (reason == RISCV32_EXIT_BUDGET) {
+			sched_ready(s, w, vm);
+			continue;
+		}
+
+		switch (s->exit(s, vm, reason, s->arg)) {
+		case RISCV32_SCHED_RUN:
+			sched_ready(s, w, vm);
+		break;
+
+		case RISCV32_SCHED_DONE:
+			sched_finish(s);
+		break;
+		}
+	}
+
+	sched_self = NULL;
+	return NULL;
+}
+
+struct riscv32_sched *riscv32_sched_create(unsigned nworkers, unsigned quantum,
+	riscv32_sched_exit_t exit, void *arg)
+{
+	struct riscv32_sched *s;
+	struct sched_worker *w;
+	unsigned i;
+
+	if (nworkers == 0 || quantum == 0 || exit == NULL)
+		return NULL;
+
+	s = calloc(1, sizeof(*s) + nworkers * sizeof(s->workers[0]));
+	if (s == NULL)
+		return NULL;
+
+	s->nworkers = nworkers;
+	s->quantum = quantum;
+	s->exit = exit;
+	s->arg = arg;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->wake, NULL);
+	pthread_cond_init(&s->done, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		w = &s->workers[i];
+		w->s = s;
+		w->id = i;
+		pthread_mutex_init(&w->q.lock, NULL);
+		w->q.size = SCHED_QUEUE_INIT;
+		w->q.vms = malloc(w->q.size * sizeof(w->q.vms[0]));
+		if (w->q.vms == NULL)
+			goto err;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&s->workers[i].thread, NULL, sched_worker, &s->workers[i]))
+			break;
+	}
+	if (i == nworkers)
+		return s;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+	while (i--)
+		pthread_join(s->workers[i].thread, NULL);
+
+err:
+	for (i = 0; i < nworkers; i++)
+		free(s->workers[i].q.vms);
+	free(s);
+	return NULL;
+}
+
+/* hand vm to the scheduler; it runs until the exit callback says it is done */
+int riscv32_sched_add(struct riscv32_sched *s, struct riscv32_vm *vm)
+{
+	pthread_mutex_lock(&s->lock);
+	s->live++;
+	pthread_mutex_unlock(&s->lock);
+
+	riscv32_sched_wake(s, vm);
+	return 0;
+}
+
+/* queue a parked vm again, from any thread */
+void riscv32_sched_wake(struct riscv32_sched *s, struct riscv32_vm *vm)
+{
+	struct sched_worker *w = sched_self;
+
+	if (w == NULL || w->s != s)
+		w = &s->workers[atomic_fetch_add(&s->next, 1) % s->nworkers];
+	sched_ready(s, w, vm);
+}
+
+/* wait until every vm added has finished */
+void riscv32_sched_wait(struct riscv32_sched *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->live)
+		pthread_cond_wait(&s->done, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* stop the workers; vms still queued or parked are left to the caller */
+void riscv32_sched_destroy(struct riscv32_sched *s)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->wake);
+	pthread_mutex_unlock(&s->lock);
+
+	for (i = 0; i < s->nworkers; i++)
+		pthread_join(s->workers[i].thread, NULL);
+
+	for (i = 0; i < s->nworkers; i++) {
+		pthread_mutex_destroy(&s->workers[i].q.lock);
+		free(s->workers[i].q.vms);
+	}
+	pthread_cond_destroy(&s->done);
+	pthread_cond_destroy(&s->wake);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "riscv.h"
+#include "riscv-internal.h"
+
+#ifdef RISCV32_HAVE_MMAP
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * A snapshot is the cpu state of a vm plus its memory image in an
+ * anonymous file.  Clones map that file privately, so they share every
+ * page they have not written with each other and with the page cache,
+ * and start without copying guest memory.
+ */
+struct riscv32_snapshot {
+	struct riscv32_cpu cpu;
+	unsigned memsize;
+	unsigned flags;
+	int engine;
+	uint64_t fuel;
+	uint64_t instret;
+	uint64_t time;
+	uint64_t mtimecmp;
+	int fd;
+	uint64_t off;			/* of the memory image in fd */
+	struct riscv32_insn *icache;	/* decoded ahead, NULL for none */
+};
+
+/*
+ * A saved snapshot: this header, the decoded instruction cache and the
+ * memory image, each starting on a page.  Pages of zeros are holes.  The
+ * instruction cache holds op numbers, so a build that changes the decoder
+ * must change RISCV32_IMAGE_VERSION.
+ */
+#define RISCV32_IMAGE_MAGIC	"rv32img"
+#define RISCV32_IMAGE_VERSION	2
+
+struct riscv32_image {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_ops;	/* RV_NR_OPS */
+	uint32_t icache_size;	/* RISCV32_ICACHE_SIZE */
+	uint32_t memsize;
+	uint64_t icache_off;
+	uint64_t mem_off;
+	uint64_t instret;
+	uint64_t time;
+	uint64_t mtimecmp;
+	struct riscv32_cpu cpu;
+};
+
+#ifdef RISCV32_HAVE_MMAP
+static int snapshot_file(void)
+{
+#ifdef __linux__
+	return memfd_create("riscv32-snapshot", MFD_CLOEXEC);
+#else
+	char path[] = "/tmp/riscv32-snapshot-XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd >= 0)
+		unlink(path);
+	return fd;
+#endif
+}
+
+static bool page_zero(const uint8_t *p, uint64_t size)
+{
+	return p[0] == 0 && !memcmp(p, p + 1, size - 1);
+}
+
+/* whether the page at off of vm holds anything the file needs */
+static bool page_used(struct riscv32_vm *vm, uint64_t off, uint64_t page)
+{
+	if (vm->mem_pages && !riscv32_mem_committed(vm, off))
+		return false;
+	return !page_zero(vm->mem + off, vm->memsize - off < page ? vm->memsize - off : page);
+}
+#endif
+
+struct riscv32_snapshot *riscv32_snapshot(struct riscv32_vm *vm)
+{
+#ifdef RISCV32_HAVE_MMAP
+	struct riscv32_snapshot *snap;
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t off, end;
+	ssize_t rn;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		return NULL;
+
+	snap->fd = snapshot_file();
+	if (snap->fd < 0)
+		goto err;
+
+	/* clones map whole pages, the file must cover them */
+	if (ftruncate(snap->fd, ((uint64_t)vm->memsize + page - 1) & ~(page - 1)))
+		goto err;
+
+	/* runs of used pages; the others stay holes that read as zeros, so
+	 * a large sparse vm costs what it touched */
+	for (off = 0; off < vm->memsize; off = end) {
+		for (end = off; end < vm->memsize && page_used(vm, end, page); end += page)
+			;
+		if (end == off) {
+			end += page;
+			continue;
+		}
+		if (end > vm->memsize)
+			end = vm->memsize;
+		while (off < end) {
+			rn = pwrite(snap->fd, vm->mem + off, end - off, off);
+			if (rn <= 0)
+				goto err;
+			off += rn;
+		}
+	}
+
+	snap->cpu = vm->cpu;
+	snap->memsize = vm->memsize;
+	snap->flags = vm->flags;
+	snap->engine = vm->engine;
+	snap->fuel = vm->fuel;
+	snap->instret = vm->instret;
+	snap->time = riscv32_time(vm);
+	snap->mtimecmp = vm->mtimecmp;
+	return snap;
+
+err:
+	if (snap->fd >= 0)
+		close(snap->fd);
+	free(snap);
+#endif
+	return NULL;
+}
+
+/* the state of snap other than its memory and decoded instructions */
+static void snapshot_state(struct riscv32_snapshot *snap, struct riscv32_vm *vm)
+{
+	vm->cpu = snap->cpu;
+	vm->engine = snap->engine;
+	vm->fuel = snap->fuel;
+	vm->instret = snap->instret;
+	riscv32_set_time(vm, snap->time);
+	vm->mtimecmp = snap->mtimecmp;
+}
+
+/* a new vm in the state vm was in when snapshot was taken */
+struct riscv32_vm *riscv32_vm_clone(struct riscv32_snapshot *snap)
+{
+#ifdef RISCV32_HAVE_MMAP
+	struct riscv32_vm *vm;
+
+	vm = riscv32_vm_alloc(0, snap->flags);
+	if (vm == NULL)
+		return NULL;
+
+	if (riscv32_vm_map(vm, snap->memsize, snap->fd, snap->off)) {
+		riscv32_vm_destroy(vm);
+		return NULL;
+	}
+
+	if (snap->icache)
+		memcpy(vm->icache, snap->icache, RISCV32_ICACHE_SIZE * sizeof(*vm->icache));
+	snapshot_state(snap, vm);
+	return vm;
+#else
+	return NULL;
+#endif
+}
+
+void riscv32_snapshot_free(struct riscv32_snapshot *snap)
+{
+#ifdef RISCV32_HAVE_MMAP
+	if (snap->icache)
+		munmap(snap->icache, RISCV32_ICACHE_SIZE * sizeof(*snap->icache));
+	close(snap->fd);
+#endif
+	free(snap);
+}
+
+#ifdef RISCV32_HAVE_MMAP
+static int image_write(int fd, const void *buf, uint64_t size, uint64_t off)
+{
+	ssize_t rn;
+
+	while (size) {
+		rn = pwrite(fd, buf, size, off);
+		if (rn <= 0)
+			return -1;
+		buf = (const uint8_t *)buf + rn;
+		size -= rn;
+		off += rn;
+	}
+	return 0;
+}
+#endif
+
+/* write snap to fd, with the instructions warm has decoded decoded ahead
+ * from snap's own memory; warm may be NULL */
+int riscv32_snapshot_save(struct riscv32_snapshot *snap, struct riscv32_vm *warm, int fd)
+{
+#ifdef RISCV32_HAVE_MMAP
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t icache_size = RISCV32_ICACHE_SIZE * sizeof(struct riscv32_insn);
+	struct riscv32_image h = { RISCV32_IMAGE_MAGIC };
+	struct riscv32_vm *vm;
+	uint64_t off, n;
+	uint32_t i, pc;
+	int rc = -1;
+
+	/* a clone reads the image as the snapshot has it, whatever warm
+	 * went on to write over */
+	vm = riscv32_vm_clone(snap);
+	if (vm == NULL)
+		return -1;
+
+	if (warm) {
+		for (i = 0; i < RISCV32_ICACHE_SIZE; i++) {
+			pc = warm->icache[i].pc;
+			if (pc != RISCV32_ICACHE_INVALID && !riscv32_decode_at(vm, &vm->icache[i], pc))
+				vm->icache[i].pc = RISCV32_ICACHE_INVALID;
+		}
+	}
+
+	h.version = RISCV32_IMAGE_VERSION;
+	h.nr_ops = RV_NR_OPS;
+	h.icache_size = RISCV32_ICACHE_SIZE;
+	h.memsize = snap->memsize;
+	h.icache_off = (sizeof(h) + page - 1) & ~(page - 1);
+	h.mem_off = (h.icache_off + icache_size + page - 1) & ~(page - 1);
+	h.instret = snap->instret;
+	h.time = snap->time;
+	h.mtimecmp = snap->mtimecmp;
+	h.cpu = snap->cpu;
+
+	n = ((uint64_t)snap->memsize + page - 1) & ~(page - 1);
+	if (ftruncate(fd, h.mem_off + n) ||
+			image_write(fd, vm->icache, icache_size, h.icache_off))
+		goto out;
+
+	for (off = 0; off < snap->memsize; off += n) {
+		n = snap->memsize - off < page ? snap->memsize - off : page;
+		if (!page_zero(vm->mem + off, n) &&
+				image_write(fd, vm->mem + off, n, h.mem_off + off))
+			goto out;
+	}
+
+	/* the header last, a torn write is never a valid image */
+	rc = image_write(fd, &h, sizeof(h), 0);
+out:
+	riscv32_vm_destroy(vm);
+	return rc;
+#else
+	return -1;
+#endif
+}
+
+/* a slot of a loaded image the cores can run without checks of their
+ * own: a known op, registers (or the zimm in rs1) no further than the x0
+ * sink and an even pc inside memory that hashes to this very slot */
+static bool image_slot_valid(const struct riscv32_insn *d, uint32_t i, uint32_t memsize)
+{
+	if (d->op >= RV_NR_OPS || d->rd > 32 || d->rs1 > 32 || d->rs2 > 32)
+		return false;
+	/* the pairs keep their second rd in imm */
+	if (d->op >= RV_MULH_MUL && (uint32_t)d->imm > 32)
+		return false;
+	return !(d->pc & 1) && d->pc < memsize &&
+		((d->pc >> 1) & RISCV32_ICACHE_MASK) == i;
+}
+
+/* the snapshot riscv32_snapshot_save wrote to fd, for vms with flags;
+ * fd belongs to the snapshot once this succeeds */
+struct riscv32_snapshot *riscv32_snapshot_load(int fd, unsigned flags)
+{
+#ifdef RISCV32_HAVE_MMAP
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t icache_size = RISCV32_ICACHE_SIZE * sizeof(struct riscv32_insn);
+	struct riscv32_snapshot *snap;
+	struct riscv32_image h;
+	struct stat st;
+	struct riscv32_insn *icache;
+	uint32_t i;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || fstat(fd, &st) ||
+			memcmp(h.magic, RISCV32_IMAGE_MAGIC, sizeof(h.magic)) ||
+			h.version != RISCV32_IMAGE_VERSION || h.nr_ops != RV_NR_OPS ||
+			h.icache_size != RISCV32_ICACHE_SIZE ||
+			h.icache_off % page || h.mem_off % page ||
+			h.icache_off + icache_size > h.mem_off ||
+			(uint64_t)st.st_size < h.mem_off + h.memsize)
+		return NULL;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		return NULL;
+
+	/* private, so a slot that fails the checks is dropped in memory only */
+	icache = mmap(NULL, icache_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, h.icache_off);
+	if (icache == MAP_FAILED) {
+		free(snap);
+		return NULL;
+	}
+	for (i = 0; i < RISCV32_ICACHE_SIZE; i++) {
+		if (icache[i].pc != RISCV32_ICACHE_INVALID &&
+				!image_slot_valid(&icache[i], i, h.memsize))
+			icache[i].pc = RISCV32_ICACHE_INVALID;
+	}
+
+	snap->cpu = h.cpu;
+	snap->memsize = h.memsize;
+	snap->flags = flags;
+	snap->engine = RISCV32_ENGINE_DEFAULT;
+	snap->fuel = RISCV32_FUEL_UNLIMITED;
+	snap->instret = h.instret;
+	snap->time = h.time;
+	snap->mtimecmp = h.mtimecmp;
+	snap->fd = fd;
+	snap->off = h.mem_off;
+	snap->icache = icache;
+	return snap;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * A pool of clones of one snapshot.  A vm put back is reset in place
+ * instead of destroyed: its private copies of guest pages are dropped,
+ * so its memory reads as the snapshot's again, and its decoded and
+ * translated code is forgotten, while the mappings, the instruction
+ * cache and the JIT's code buffer are kept for the next get.
+ */
+struct riscv32_pool {
+	struct riscv32_snapshot *snap;
+	pthread_mutex_t lock;
+	unsigned max;
+	unsigned nfree;
+	struct riscv32_vm *free[];
+};
+
+/* a pool keeping up to max idle vms; snap must outlive it */
+struct riscv32_pool *riscv32_pool_create(struct riscv32_snapshot *snap, unsigned max)
+{
+	struct riscv32_pool *pool;
+
+	pool = calloc(1, sizeof(*pool) + max * sizeof(pool->free[0]));
+	if (pool == NULL)
+		return NULL;
+
+	pool->snap = snap;
+	pool->max = max;
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+void riscv32_pool_destroy(struct riscv32_pool *pool)
+{
+	while (pool->nfree)
+		riscv32_vm_destroy(pool->free[--pool->nfree]);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* a vm in the state of the pool's snapshot, an idle one if there is any */
+struct riscv32_vm *riscv32_pool_get(struct riscv32_pool *pool)
+{
+	struct riscv32_vm *vm = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nfree)
+		vm = pool->free[--pool->nfree];
+	pthread_mutex_unlock(&pool->lock);
+
+	return vm ? vm : riscv32_vm_clone(pool->snap);
+}
+
+/* back to the snapshot's state without unmapping anything; -1 when vm
+ * can not be reset and has to be destroyed instead */
+static int pool_reset(struct riscv32_pool *pool, struct riscv32_vm *vm)
+{
+#if defined(RISCV32_HAVE_MMAP) && defined(__linux__)
+	struct riscv32_snapshot *snap = pool->snap;
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t size = ((uint64_t)vm->memsize + page - 1) & ~(page - 1);
+	uint32_t i;
+
+	if (vm->memsize != snap->memsize || vm->flags != snap->flags || vm->mapsize == 0)
+		return -1;
+
+	/* private pages of a file mapping go, the file's show through */
+	if (size && madvise(vm->mem, size, MADV_DONTNEED))
+		return -1;
+	if (vm->mem_pages) {
+		if (size && mprotect(vm->mem, size, PROT_NONE))
+			return -1;
+		memset(vm->mem_pages, 0, (size >> vm->mem_shift >> 3) + 1);
+		vm->mem_committed = 0;
+	}
+
+	riscv32_trace_stop(vm);
+	riscv32_debug_free(vm);
+	riscv32_symtab_free(vm);
+	/* only the slots written since the last reset differ from snap's */
+	for (i = vm->icache_lo; i <= vm->icache_hi; i++) {
+		if (snap->icache)
+			vm->icache[i] = snap->icache[i];
+		else
+			vm->icache[i].pc = RISCV32_ICACHE_INVALID;
+		if (vm->icache[i].pc != RISCV32_ICACHE_INVALID)
+			riscv32_code_mark(vm, vm->icache[i].pc);
+	}
+	vm->icache_lo = RISCV32_ICACHE_SIZE;
+	vm->icache_hi = 0;
+#ifdef RISCV_JIT
+	riscv32_jit_invalidate(vm, 0, vm->memsize);
+#endif
+	memset(vm->fused, 0, sizeof(vm->fused));
+	vm->time_hook = NULL;
+	vm->meip = 0;
+	snapshot_state(snap, vm);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* done with vm, which came from riscv32_pool_get */
+void riscv32_pool_put(struct riscv32_pool *pool, struct riscv32_vm *vm)
+{
+	if (pool_reset(pool, vm) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nfree < pool->max) {
+			pool->free[pool->nfree++] = vm;
+			vm = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	if (vm != NULL)
+		riscv32_vm_destroy(vm);
+}
@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "riscv.h"
+#include "riscv-internal.h"
+
+/*
+ * Execution traces.  The traced core reports only where control flow
+ * leaves the straight line: a taken branch, a jump, a trap or a pc the
+ * host changed.  Each of those becomes a record of how many instructions
+ * ran in order since the last one and where the next one is, so the
+ * instructions themselves come back from the guest image.
+ *
+ * A trace is the header below and then records, each starting with an
+ * unsigned LEB128 v:
+ *   v even	v / 2 instructions ran in order, then a signed LEB128 delta
+ *		from the previous target to the new pc
+ *   v odd	the event (v - 1) / 2, TRACE_SYNC or TRACE_END
+ * Records go through a ring in memory that a thread of the trace writes
+ * to the file, so the vm only waits when the disk falls a ring behind.
+ */
+#define TRACE_MAGIC		"rv32trc"
+#define TRACE_VERSION		1
+#define TRACE_RING		(1u << 20)
+#define TRACE_RECORD_MAX	32	/* bytes of the longest record */
+#define TRACE_FLUSH_MS		100	/* the writer looks at least this often */
+
+enum {
+	TRACE_SYNC,	/* pc and instret, absolute */
+	TRACE_END,	/* the count of instructions that ran in order last */
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+static int trace_write(int fd, const uint8_t *buf, size_t size)
+{
+	ssize_t rn;
+
+	while (size) {
+		rn = write(fd, buf, size);
+		if (rn <= 0)
+			return -1;
+		buf += rn;
+		size -= rn;
+	}
+	return 0;
+}
+
+static void *trace_thread(void *arg)
+{
+	struct riscv32_trace *t = arg;
+	uint64_t head, tail = 0;
+	struct timespec ts;
+	size_t off, size;
+	bool stop;
+
+	do {
+		pthread_mutex_lock(&t->lock);
+		if (!t->stop && atomic_load(&t->head) == tail) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&t->data, &t->lock, &ts);
+		}
+		stop = t->stop;
+		pthread_mutex_unlock(&t->lock);
+
+		/* after stop the vm no longer runs, this takes the rest */
+		head = atomic_load_explicit(&t->head, memory_order_acquire);
+		while (tail != head && !t->failed) {
+			off = tail & (TRACE_RING - 1);
+			size = head - tail < TRACE_RING - off ? head - tail : TRACE_RING - off;
+			if (trace_write(t->fd, t->ring + off, size))
+				t->failed = true;
+			tail += size;
+		}
+		atomic_store_explicit(&t->tail, head, memory_order_release);
+		tail = head;
+
+		pthread_mutex_lock(&t->lock);
+		if (t->waiting)
+			pthread_cond_broadcast(&t->space);
+		pthread_mutex_unlock(&t->lock);
+	} while (!stop);
+	return NULL;
+}
+
+/* the ring is full: sleep until the writer makes room */
+static void trace_wait(struct riscv32_trace *t, uint64_t head)
+{
+	pthread_mutex_lock(&t->lock);
+	t->waiting = true;
+	pthread_cond_signal(&t->data);
+	while (TRACE_RING - (head - atomic_load(&t->tail)) < TRACE_RECORD_MAX)
+		pthread_cond_wait(&t->space, &t->lock);
+	t->waiting = false;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static unsigned put_uleb(uint8_t *p, uint64_t v)
+{
+	unsigned n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static unsigned put_sleb(uint8_t *p, int32_t v)
+{
+	/* zigzag, so small deltas either way take one byte */
+	return put_uleb(p, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+static void trace_put(struct riscv32_trace *t, const uint8_t *rec, unsigned size)
+{
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	unsigned off, part;
+
+	if (TRACE_RING - (head - atomic_load_explicit(&t->tail, memory_order_acquire)) < TRACE_RECORD_MAX)
+		trace_wait(t, head);
+
+	off = head & (TRACE_RING - 1);
+	part = size < TRACE_RING - off ? size : TRACE_RING - off;
+	memcpy(t->ring + off, rec, part);
+	memcpy(t->ring, rec + part, size - part);
+	head += size;
+	atomic_store_explicit(&t->head, head, memory_order_release);
+
+	/* a quarter of the ring is worth a write before the timer */
+	if (head - t->kick >= TRACE_RING / 4) {
+		t->kick = head;
+		pthread_mutex_lock(&t->lock);
+		pthread_cond_signal(&t->data);
+		pthread_mutex_unlock(&t->lock);
+	}
+}
+
+static void trace_event(struct riscv32_trace *t, int event, uint64_t a, uint64_t b)
+{
+	uint8_t rec[TRACE_RECORD_MAX];
+	unsigned n;
+
+	n = put_uleb(rec, (uint64_t)event << 1 | 1);
+	n += put_uleb(rec + n, a);
+	if (event == TRACE_SYNC)
+		n += put_uleb(rec + n, b);
+	trace_put(t, rec, n);
+}
+
+/* from the traced core: the n instructions of this run so far left
+ * control at pc, not at the instruction after the last of them */
+void riscv32_trace_flow(struct riscv32_vm *m, unsigned n, uint32_t pc)
+{
+	struct riscv32_trace *t = m->trace;
+	uint8_t rec[TRACE_RECORD_MAX];
+	unsigned size;
+
+	size = put_uleb(rec, (m->instret + n - t->mark) << 1);
+	size += put_sleb(rec + size, pc - t->last);
+	trace_put(t, rec, size);
+	t->mark = m->instret + n;
+	t->last = pc;
+}
+
+/* record the instructions vm runs from now on to fd, which stays the
+ * caller's.  The vm runs them on the traced interpreter core. */
+int riscv32_trace_start(struct riscv32_vm *m, int fd)
+{
+	struct trace_header h = { TRACE_MAGIC, TRACE_VERSION };
+	struct riscv32_trace *t;
+
+	/* watchpoints keep working on the traced core */
+	if (m->trace != NULL || riscv32_debug_get(m) == NULL)
+		return -1;
+
+	if (trace_write(fd, (const uint8_t *)&h, sizeof(h)))
+		return -1;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return -1;
+	t->ring = malloc(TRACE_RING);
+	if (t->ring == NULL) {
+		free(t);
+		return -1;
+	}
+
+	t->fd = fd;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->data, NULL);
+	pthread_cond_init(&t->space, NULL);
+	if (pthread_create(&t->thread, NULL, trace_thread, t)) {
+		pthread_cond_destroy(&t->space);
+		pthread_cond_destroy(&t->data);
+		pthread_mutex_destroy(&t->lock);
+		free(t->ring);
+		free(t);
+		return -1;
+	}
+
+	t->last = m->cpu.pc;
+	t->mark = m->instret;
+	t->next = m->cpu.pc;
+	trace_event(t, TRACE_SYNC, m->cpu.pc, m->instret);
+	m->trace = t;
+	return 0;
+}
+
+/* end the trace of a vm that is not running and wait until all of it is
+ * in the file; -1 if some of it could not be written */
+int riscv32_trace_stop(struct riscv32_vm *m)
+{
+	struct riscv32_trace *t = m->trace;
+	int rc;
+
+	if (t == NULL)
+		return 0;
+
+	/* the run since the last record, which no branch ended */
+	trace_event(t, TRACE_END, m->instret - t->mark, 0);
+
+	pthread_mutex_lock(&t->lock);
+	t->stop = true;
+	pthread_cond_signal(&t->data);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+
+	rc = t->failed ? -1 : 0;
+	pthread_cond_destroy(&t->space);
+	pthread_cond_destroy(&t->data);
+	pthread_mutex_destroy(&t->lock);
+	free(t->ring);
+	free(t);
+	m->trace = NULL;
+	return rc;
+}
+
+static int get_uleb(FILE *fp, uint64_t *v)
+{
+	unsigned shift = 0;
+	int ch;
+
+	*v = 0;
+	do {
+		ch = getc(fp);
+		if (ch == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+	return 0;
+}
+
+/* the next count instructions in order from *pc */
+static int replay_run(struct riscv32_vm *m, uint32_t *pc, uint64_t count,
+	riscv32_trace_fn fn, void *arg)
+{
+	uint32_t insn;
+	uint16_t half;
+
+	while (count--) {
+		if ((uint64_t)*pc + 2 > m->memsize)
+			return -1;
+		memcpy(&half, m->mem + *pc, 2);
+		if ((half & 3) != 3) {
+			fn(arg, *pc, half);
+			*pc += 2;
+			continue;
+		}
+		if ((uint64_t)*pc + 4 > m->memsize)
+			return -1;
+		memcpy(&insn, m->mem + *pc, 4);
+		fn(arg, *pc, insn);
+		*pc += 4;
+	}
+	return 0;
+}
+
+/* call fn for every instruction of the trace in fd, in the order they
+ * ran, reading them from vm's memory.  That must hold the code as it was
+ * traced: code the guest wrote or changed comes back as what vm has.
+ * Returns 0 when the trace is complete, -1 on one cut short. */
+int riscv32_trace_replay(struct riscv32_vm *m, int fd, riscv32_trace_fn fn, void *arg)
+{
+	struct trace_header h;
+	uint64_t v, a, b;
+	uint32_t pc = 0, last = 0;
+	int rc = -1;
+	FILE *fp;
+
+	fd = dup(fd);
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "rb");
+	if (fp == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) ||
+			h.version != TRACE_VERSION)
+		goto out;
+
+	while (!get_uleb(fp, &v)) {
+		if (!(v & 1)) {
+			if (replay_run(m, &pc, v >> 1, fn, arg) || get_uleb(fp, &a))
+				goto out;
+			last += (uint32_t)(a >> 1) ^ -(uint32_t)(a & 1);
+			pc = last;
+			continue;
+		}
+
+		switch (v >> 1) {
+		case TRACE_SYNC:
+			if (get_uleb(fp, &a) || get_uleb(fp, &b))
+				goto out;
+			pc = last = a;
+		break;
+
+		case TRACE_END:
+			if (get_uleb(fp, &a) == 0 && replay_run(m, &pc, a, fn, arg) == 0)
+				rc = 0;
+			goto out;
+
+		default:
+			goto out;
+		}
+	}
+out:
+	fclose(fp);
+	return rc;
+}
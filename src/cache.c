@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+struct ribp_cache {
+	char *dir;
+	int dirfd;
+	uint64_t limit;		/* bytes of images kept */
+};
+
+struct cache_entry {
+	char name[NAME_MAX + 1];
+	struct timespec mtime;
+	uint64_t size;
+};
+
+#define KEY_HEX		(SHA256_SIZE * 2)
+
+static void cache_name(char *name, size_t size, const uint8_t *key, unsigned memsize)
+{
+	int i;
+
+	for (i = 0; i < SHA256_SIZE; i++)
+		sprintf(name + 2 * i, "%02x", key[i]);
+	snprintf(name + KEY_HEX, size - KEY_HEX, "-%u", memsize);
+}
+
+/* images are named KEY-MEMSIZE, anything else in the directory is not
+ * ours, temporaries among them */
+static int cache_image(const char *name)
+{
+	return strlen(name) > KEY_HEX + 1 && name[KEY_HEX] == '-' &&
+		strspn(name, "0123456789abcdef") == KEY_HEX;
+}
+
+struct ribp_cache *ribp_cache_open(const char *dir, uint64_t limit)
+{
+	struct ribp_cache *c;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return NULL;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+
+	c->dir = strdup(dir);
+	c->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	c->limit = limit;
+	if (c->dir == NULL || c->dirfd < 0) {
+		ribp_cache_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+void ribp_cache_close(struct ribp_cache *c)
+{
+	if (c->dirfd >= 0)
+		close(c->dirfd);
+	free(c->dir);
+	free(c);
+}
+
+/* the key of the program in fd */
+int ribp_cache_key(int fd, uint8_t key[SHA256_SIZE])
+{
+	struct sha256 s;
+	char buf[65536];
+	ssize_t rn;
+	off_t off = 0;
+
+	sha256_init(&s);
+	while (0 < (rn = pread(fd, buf, sizeof(buf), off))) {
+		sha256_update(&s, buf, rn);
+		off += rn;
+	}
+	if (rn < 0)
+		return -1;
+	sha256_final(&s, key);
+	return 0;
+}
+
+/* a key given as 64 hex digits, for programs the cache already has */
+int ribp_cache_parse_key(const char *hex, uint8_t key[SHA256_SIZE])
+{
+	unsigned i, b;
+
+	if (strlen(hex) != KEY_HEX)
+		return -1;
+	for (i = 0; i < SHA256_SIZE; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+			return -1;
+		key[i] = b;
+	}
+	return 0;
+}
+
+struct riscv32_snapshot *ribp_cache_get(struct ribp_cache *c, const uint8_t key[SHA256_SIZE],
+	unsigned memsize, unsigned flags)
+{
+	struct riscv32_snapshot *snap;
+	char name[NAME_MAX + 1];
+	int fd;
+
+	cache_name(name, sizeof(name), key, memsize);
+	fd = openat(c->dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	snap = riscv32_snapshot_load(fd, flags);
+	if (snap == NULL) {
+		/* from another build, or damaged: made again on this miss */
+		unlinkat(c->dirfd, name, 0);
+		close(fd);
+		return NULL;
+	}
+	futimens(fd, NULL);
+	return snap;
+}
+
+static int entry_older(const void *a, const void *b)
+{
+	const struct cache_entry *x = a, *y = b;
+
+	if (x->mtime.tv_sec != y->mtime.tv_sec)
+		return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+	if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+		return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* drop the least recently used images until the rest fit the limit */
+static void cache_evict(struct ribp_cache *c)
+{
+	struct cache_entry *e = NULL, *ne;
+	unsigned n = 0, max = 0, i;
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd;
+
+	fd = dup(c->dirfd);
+	if (fd < 0)
+		return;
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return;
+	}
+	rewinddir(d);
+
+	while ((de = readdir(d)) != NULL) {
+		if (!cache_image(de->d_name) || fstatat(c->dirfd, de->d_name, &st, 0))
+			continue;
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			ne = realloc(e, max * sizeof(*e));
+			if (ne == NULL)
+				break;
+			e = ne;
+		}
+		snprintf(e[n].name, sizeof(e[n].name), "%s", de->d_name);
+		e[n].mtime = st.st_mtim;
+		/* images are sparse, count what they take */
+		e[n].size = (uint64_t)st.st_blocks * 512;
+		total += e[n++].size;
+	}
+	closedir(d);
+
+	qsort(e, n, sizeof(*e), entry_older);
+	for (i = 0; i < n && total > c->limit; i++) {
+		if (unlinkat(c->dirfd, e[i].name, 0) == 0)
+			total -= e[i].size;
+	}
+	free(e);
+}
+
+/* save snap, the program with key loaded into memsize bytes, decoding
+ * ahead what warm ran of it */
+int ribp_cache_put(struct ribp_cache *c, const uint8_t key[SHA256_SIZE], unsigned memsize,
+	struct riscv32_snapshot *snap, struct riscv32_vm *warm)
+{
+	char name[NAME_MAX + 1], tmp[PATH_MAX];
+	int fd, rc;
+
+	cache_name(name, sizeof(name), key, memsize);
+	snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", c->dir, name);
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	fchmod(fd, 0644);
+
+	/* readers only ever see whole images */
+	rc = riscv32_snapshot_save(snap, warm, fd);
+	close(fd);
+	if (rc == 0)
+		rc = renameat(AT_FDCWD, tmp, c->dirfd, name);
+	if (rc) {
+		unlink(tmp);
+		return -1;
+	}
+
+	cache_evict(c);
+	return 0;
+}
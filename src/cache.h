@@ -0,0 +1,30 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __CACHE_H__
+#define __CACHE_H__
+#include <stdint.h>
+#include "riscv.h"
+#include "sha256.h"
+
+/*
+ * Prepared guest images on disk, named by the SHA-256 of the program and
+ * the memory size it was loaded into.  An image is a saved riscv32
+ * snapshot: loaded memory, registers and the instructions its first run
+ * decoded, so a hit maps it back without reading, parsing or decoding the
+ * program.  The directory is kept under a size limit by evicting the
+ * least recently used images; a hit renews its file's mtime.
+ */
+struct ribp_cache;
+
+struct ribp_cache *ribp_cache_open(const char *dir, uint64_t limit);
+void ribp_cache_close(struct ribp_cache *c);
+int ribp_cache_key(int fd, uint8_t key[SHA256_SIZE]);
+int ribp_cache_parse_key(const char *hex, uint8_t key[SHA256_SIZE]);
+struct riscv32_snapshot *ribp_cache_get(struct ribp_cache *c, const uint8_t key[SHA256_SIZE],
+	unsigned memsize, unsigned flags);
+int ribp_cache_put(struct ribp_cache *c, const uint8_t key[SHA256_SIZE], unsigned memsize,
+	struct riscv32_snapshot *snap, struct riscv32_vm *warm);
+
+#endif /* __CACHE_H__*/
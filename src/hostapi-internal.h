@@ -0,0 +1,15 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __HOSTAPI_INTERNAL_H__
+#define __HOSTAPI_INTERNAL_H__
+#include <sys/uio.h>
+#include <hostapi.h>
+
+/* shared by the blocking and the io_uring host api */
+int hostapi_ring_iov(struct riscv32_vm *vm, uint32_t addr,
+	struct iovec iov[2], struct ribp_ring **ring);
+void hostapi_ring_done(struct ribp_ring *ring, int res);
+
+#endif /* __HOSTAPI_INTERNAL_H__*/
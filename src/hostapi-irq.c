@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <hostapi.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <riscv.h>
+
+#define IRQ_EVENTS	64
+
+struct irq_vm;
+
+/* an armed descriptor of a vm, or the timer of its parks when fd is -1.
+ * The epoll entry is on a dup, so two vms, or a vm and a link, can wait
+ * on the same descriptor. */
+struct irq_src {
+	struct irq_src *next;	/* on the vm's list, or the zombies */
+	struct irq_vm *v;	/* NULL once released */
+	int fd;			/* the guest's */
+	int dup;
+	uint32_t revents;	/* of the last fire */
+	bool fired;		/* until claimed or armed again */
+	bool always;		/* epoll refuses it, a regular file is always ready */
+};
+
+/* what the interrupts of a vm need, in vm->host */
+struct irq_vm {
+	struct riscv32_vm *vm;
+	struct irq_src *srcs;
+	struct irq_src *timer;	/* NULL until the first timed park */
+	unsigned nfired;	/* the line is up while there are any */
+	bool parked;		/* off the scheduler until wake */
+	bool waiting;		/* a thread sleeps on cond */
+	pthread_cond_t cond;
+};
+
+struct hostapi_irq {
+	int epfd;
+	int stopfd;		/* an eventfd that ends the thread */
+	pthread_t thread;
+	pthread_mutex_t lock;	/* every irq_vm and the zombies */
+	pthread_condattr_t condattr;
+	/* released sources, freed once no epoll_wait can return them */
+	struct irq_src *zombies;
+	void (*wake)(struct riscv32_vm *vm, void *arg);
+	void *arg;
+};
+
+static struct irq_vm *irq_vm(struct hostapi_irq *h, struct riscv32_vm *vm)
+{
+	struct irq_vm *v = vm->host;
+
+	if (v == NULL) {
+		v = calloc(1, sizeof(*v));
+		if (v == NULL)
+			return NULL;
+		v->vm = vm;
+		pthread_cond_init(&v->cond, &h->condattr);
+		vm->host = v;
+	}
+	return v;
+}
+
+static void irq_drop(struct hostapi_irq *h, struct irq_src *src)
+{
+	epoll_ctl(h->epfd, EPOLL_CTL_DEL, src->dup, NULL);
+	close(src->dup);
+	src->v = NULL;
+	src->next = h->zombies;
+	h->zombies = src;
+}
+
+static void irq_fire(struct irq_vm *v, struct irq_src *src, uint32_t revents)
+{
+	if (!src->fired) {
+		src->fired = true;
+		v->nfired++;
+	}
+	src->revents = revents;
+	riscv32_irq_external(v->vm, 1);
+}
+
+static void irq_unfire(struct irq_vm *v, struct irq_src *src)
+{
+	if (src->fired) {
+		src->fired = false;
+		if (--v->nfired == 0)
+			riscv32_irq_external(v->vm, 0);
+	}
+}
+
+/* the wait of v may be over: the line went up or its timer went off */
+static void irq_kick(struct hostapi_irq *h, struct irq_vm *v)
+{
+	if (v->waiting)
+		pthread_cond_signal(&v->cond);
+	/* a parked vm is not running, its state is ours to look at */
+	if (v->parked && riscv32_wfi_done(v->vm)) {
+		v->parked = false;
+		h->wake(v->vm, h->arg);
+	}
+}
+
+static int irq_timer(struct hostapi_irq *h, struct irq_vm *v, int64_t ns)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct itimerspec it = { { 0, 0 }, { ns / 1000000000, ns % 1000000000 } };
+	struct irq_src *src = v->timer;
+
+	if (src == NULL) {
+		src = calloc(1, sizeof(*src));
+		if (src == NULL)
+			return -1;
+		src->v = v;
+		src->fd = -1;
+		src->dup = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		ev.data.ptr = src;
+		if (src->dup < 0 || epoll_ctl(h->epfd, EPOLL_CTL_ADD, src->dup, &ev)) {
+			if (src->dup >= 0)
+				close(src->dup);
+			free(src);
+			return -1;
+		}
+		v->timer = src;
+	}
+	return timerfd_settime(src->dup, 0, &it, NULL);
+}
+
+static void irq_event(struct hostapi_irq *h, struct irq_src *src, uint32_t events)
+{
+	struct irq_vm *v = src->v;
+	int64_t ns;
+	uint64_t n;
+
+	if (v == NULL)
+		return;
+
+	if (src->fd < 0) {
+		if (read(src->dup, &n, sizeof(n)) != sizeof(n) || !v->parked)
+			return;
+		/* the guest's clock and the host's round differently */
+		ns = riscv32_timer_deadline(v->vm);
+		if (ns > 0 && irq_timer(h, v, ns) == 0)
+			return;
+	} else {
+		irq_fire(v, src, events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP));
+	}
+	irq_kick(h, v);
+}
+
+static void *irq_thread(void *arg)
+{
+	struct hostapi_irq *h = arg;
+	struct epoll_event ev[IRQ_EVENTS];
+	struct irq_src *z, *next;
+	int i, n;
+
+	for (;;) {
+		/* dropped before this wait, so it can not return them */
+		pthread_mutex_lock(&h->lock);
+		z = h->zombies;
+		h->zombies = NULL;
+		pthread_mutex_unlock(&h->lock);
+		for (; z != NULL; z = next) {
+			next = z->next;
+			free(z);
+		}
+
+		n = epoll_wait(h->epfd, ev, IRQ_EVENTS, -1);
+		pthread_mutex_lock(&h->lock);
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == NULL) {
+				pthread_mutex_unlock(&h->lock);
+				return NULL;
+			}
+			irq_event(h, ev[i].data.ptr, ev[i].events);
+		}
+		pthread_mutex_unlock(&h->lock);
+	}
+}
+
+/* wake is called on the interrupt thread for a vm hostapi_irq_park parked;
+ * NULL when nothing parks */
+struct hostapi_irq *hostapi_irq_create(void (*wake)(struct riscv32_vm *vm, void *arg), void *arg)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct hostapi_irq *h;
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return NULL;
+
+	h->wake = wake;
+	h->arg = arg;
+	h->epfd = epoll_create1(EPOLL_CLOEXEC);
+	h->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (h->epfd < 0 || h->stopfd < 0 ||
+			epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->stopfd, &ev))
+		goto err;
+
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_condattr_init(&h->condattr);
+	pthread_condattr_setclock(&h->condattr, CLOCK_MONOTONIC);
+	if (pthread_create(&h->thread, NULL, irq_thread, h) == 0)
+		return h;
+
+	pthread_condattr_destroy(&h->condattr);
+	pthread_mutex_destroy(&h->lock);
+err:
+	if (h->stopfd >= 0)
+		close(h->stopfd);
+	if (h->epfd >= 0)
+		close(h->epfd);
+	free(h);
+	return NULL;
+}
+
+/* stop the thread; vms not yet released are left to the caller */
+void hostapi_irq_destroy(struct hostapi_irq *h)
+{
+	struct irq_src *z;
+	uint64_t one = 1;
+
+	if (write(h->stopfd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(h->thread, NULL);
+
+	while ((z = h->zombies) != NULL) {
+		h->zombies = z->next;
+		free(z);
+	}
+	pthread_condattr_destroy(&h->condattr);
+	pthread_mutex_destroy(&h->lock);
+	close(h->stopfd);
+	close(h->epfd);
+	free(h);
+}
+
+static struct irq_src *irq_find(struct irq_vm *v, int fd)
+{
+	struct irq_src *src;
+
+	for (src = v->srcs; src != NULL && src->fd != fd; src = src->next)
+		;
+	return src;
+}
+
+static int irq_arm(struct hostapi_irq *h, struct irq_vm *v, int fd, uint32_t events)
+{
+	struct epoll_event ev = { .events = events | EPOLLONESHOT };
+	struct irq_src *src = irq_find(v, fd);
+	int op = EPOLL_CTL_MOD;
+
+	if (events == 0)
+		return -1;
+
+	if (src == NULL) {
+		src = calloc(1, sizeof(*src));
+		if (src == NULL)
+			return -1;
+		src->dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (src->dup < 0) {
+			free(src);
+			return -1;
+		}
+		src->v = v;
+		src->fd = fd;
+		src->next = v->srcs;
+		v->srcs = src;
+		op = EPOLL_CTL_ADD;
+	}
+
+	irq_unfire(v, src);
+	ev.data.ptr = src;
+	if (!src->always && epoll_ctl(h->epfd, op, src->dup, &ev)) {
+		if (errno != EPERM) {
+			if (op == EPOLL_CTL_ADD) {
+				v->srcs = src->next;
+				close(src->dup);
+				free(src);
+			}
+			return -1;
+		}
+		src->always = true;
+	}
+	if (src->always)
+		irq_fire(v, src, events);
+	return 0;
+}
+
+static int irq_forget(struct hostapi_irq *h, struct irq_vm *v, int fd)
+{
+	struct irq_src **p, *src;
+
+	for (p = &v->srcs; (src = *p) != NULL; p = &src->next) {
+		if (src->fd == fd) {
+			irq_unfire(v, src);
+			*p = src->next;
+			irq_drop(h, src);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* the earliest armed of the descriptors that fired, with its revents */
+static int irq_claim(struct irq_vm *v, uint32_t *revents)
+{
+	struct irq_src *src, *first = NULL;
+
+	for (src = v->srcs; src != NULL; src = src->next) {
+		if (src->fired)
+			first = src;
+	}
+	if (first == NULL)
+		return -1;
+
+	*revents = first->revents;
+	irq_unfire(v, first);
+	return first->fd;
+}
+
+int hostapi_irq_ecall(struct hostapi_irq *h, struct riscv32_vm *vm)
+{
+	struct riscv32_cpu *c = &vm->cpu;
+	struct irq_vm *v;
+	int fd = c->a1;
+	uint32_t events = c->a2 & (POLLIN | POLLOUT);
+
+	pthread_mutex_lock(&h->lock);
+	v = irq_vm(h, vm);
+	if (v == NULL)
+		c->a0 = -1;
+	else if (fd < 0)
+		c->a0 = irq_claim(v, &c->a1);
+	else if (c->a2 == 0)
+		c->a0 = irq_forget(h, v, fd);
+	else
+		c->a0 = irq_arm(h, v, fd, events);
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
+
+/* after RISCV32_EXIT_WFI: sleep until an interrupt is pending or the
+ * guest's timer is due */
+void hostapi_irq_wait(struct hostapi_irq *h, struct riscv32_vm *vm)
+{
+	struct timespec ts;
+	struct irq_vm *v;
+	int64_t ns = riscv32_timer_deadline(vm);
+
+	if (ns > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec += ns % 1000000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&h->lock);
+	v = irq_vm(h, vm);
+	if (v != NULL) {
+		v->waiting = true;
+		while (ns != 0 && !riscv32_wfi_done(vm)) {
+			if (ns < 0)
+				pthread_cond_wait(&v->cond, &h->lock);
+			else if (pthread_cond_timedwait(&v->cond, &h->lock, &ts) == ETIMEDOUT)
+				break;
+		}
+		v->waiting = false;
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* after RISCV32_EXIT_WFI on a scheduler: HOSTAPI_PENDING when the vm is
+ * parked until wake, 0 when it should run on */
+int hostapi_irq_park(struct hostapi_irq *h, struct riscv32_vm *vm)
+{
+	struct irq_vm *v;
+	int64_t ns;
+	int rc = 0;
+
+	pthread_mutex_lock(&h->lock);
+	v = irq_vm(h, vm);
+	if (v != NULL && h->wake != NULL && !riscv32_wfi_done(vm)) {
+		ns = riscv32_timer_deadline(vm);
+		/* a due timer, or one that can not be armed, is the run loop's */
+		if (ns < 0 || (ns > 0 && irq_timer(h, v, ns) == 0)) {
+			v->parked = true;
+			rc = HOSTAPI_PENDING;
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+	return rc;
+}
+
+/* the guest closes fd: the source's dup would keep the file open and
+ * a later descriptor with the same number would find it */
+void hostapi_irq_close(struct hostapi_irq *h, struct riscv32_vm *vm, int fd)
+{
+	struct irq_vm *v = vm->host;
+
+	if (v == NULL)
+		return;
+
+	pthread_mutex_lock(&h->lock);
+	irq_forget(h, v, fd);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* forget every descriptor vm armed, before it is destroyed */
+void hostapi_irq_release(struct hostapi_irq *h, struct riscv32_vm *vm)
+{
+	struct irq_vm *v = vm->host;
+	struct irq_src *src;
+
+	if (v == NULL)
+		return;
+
+	pthread_mutex_lock(&h->lock);
+	while ((src = v->srcs) != NULL) {
+		v->srcs = src->next;
+		irq_drop(h, src);
+	}
+	if (v->timer != NULL)
+		irq_drop(h, v->timer);
+	vm->host = NULL;
+	riscv32_irq_external(vm, 0);
+	pthread_mutex_unlock(&h->lock);
+
+	pthread_cond_destroy(&v->cond);
+	free(v);
+}
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <riscv.h>
+#include <sys/poll.h>
+#include "hostapi-internal.h"
+
+/*
+ * A log of what the host told a guest: the result of every host call,
+ * the guest memory the call wrote and every read of the time csr, in the
+ * order the guest saw them.  Replaying it gives the guest the same
+ * answers without touching a descriptor, so it runs again exactly as it
+ * ran when the log was written.
+ *
+ * After the header, entries of unsigned LEB128 numbers:
+ *   LOG_ECALL nr a1 a2 a3 result nregions { addr len bytes }...
+ *   LOG_TIME delta		from the time of the previous LOG_TIME
+ * nr and a1-a3 only let a replay notice a guest that went another way.
+ */
+#define LOG_MAGIC	"rv32log"
+#define LOG_VERSION	1
+#define LOG_REGIONS	3
+
+enum {
+	LOG_ECALL,
+	LOG_TIME,
+};
+
+struct log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct log_region {
+	uint32_t addr;
+	uint32_t len;
+};
+
+struct hostapi_log {
+	FILE *fp;
+	bool replay;
+	bool failed;		/* the guest went another way, or the log ended */
+	uint64_t time;		/* of the last LOG_TIME */
+};
+
+struct hostapi_log *hostapi_log_open(int fd, int replay)
+{
+	struct log_header h = { LOG_MAGIC, LOG_VERSION };
+	struct hostapi_log *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return NULL;
+
+	fd = dup(fd);
+	l->fp = fd >= 0 ? fdopen(fd, replay ? "rb" : "wb") : NULL;
+	if (l->fp == NULL) {
+		if (fd >= 0)
+			close(fd);
+		free(l);
+		return NULL;
+	}
+	l->replay = replay;
+
+	if (replay) {
+		if (fread(&h, sizeof(h), 1, l->fp) == 1 &&
+				!memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) && h.version == LOG_VERSION)
+			return l;
+	} else if (fwrite(&h, sizeof(h), 1, l->fp) == 1) {
+		return l;
+	}
+
+	fclose(l->fp);
+	free(l);
+	return NULL;
+}
+
+/* -1 when a replay went wrong or a record could not be written */
+int hostapi_log_close(struct hostapi_log *l)
+{
+	int rc = l->failed ? -1 : 0;
+
+	/* a guest that stopped early did not run as recorded either */
+	if (l->replay && getc(l->fp) != EOF)
+		rc = -1;
+	if (fclose(l->fp))
+		rc = -1;
+	free(l);
+	return rc;
+}
+
+static void put_uleb(struct hostapi_log *l, uint64_t v)
+{
+	while (v >= 0x80) {
+		putc(v | 0x80, l->fp);
+		v >>= 7;
+	}
+	putc(v, l->fp);
+}
+
+static uint64_t get_uleb(struct hostapi_log *l)
+{
+	uint64_t v = 0;
+	unsigned shift = 0;
+	int ch;
+
+	do {
+		ch = getc(l->fp);
+		if (ch == EOF || shift > 63) {
+			l->failed = true;
+			return 0;
+		}
+		v |= (uint64_t)(ch & 0x7f) << shift;
+		shift += 7;
+	} while (ch & 0x80);
+	return v;
+}
+
+/* the guest memory the call nr with arguments a1 and a2 may write */
+static unsigned log_regions(struct riscv32_vm *vm, uint32_t nr, uint32_t a1, uint32_t a2,
+	struct log_region *rg)
+{
+	struct ribp_ring *r;
+	struct iovec iov[2];
+	int i, n;
+
+	switch (nr) {
+	case HOSTAPI_READ:
+		rg[0].addr = a2;
+		return 1;
+
+	case HOSTAPI_POLL:
+		rg[0].addr = a1;
+		rg[0].len = a2 * sizeof(struct pollfd);
+		return 1;
+
+	case HOSTAPI_RING:
+		/* the indices and flags, and the free space of an input ring */
+		rg[0].addr = a2;
+		rg[0].len = sizeof(*r);
+		n = hostapi_ring_iov(vm, a2, iov, &r);
+		if (n < 0 || !(r->flags & RIBP_RING_IN))
+			return 1;
+		for (i = 0; i < n; i++) {
+			rg[1 + i].addr = (uint8_t *)iov[i].iov_base - vm->mem;
+			rg[1 + i].len = iov[i].iov_len;
+		}
+		return 1 + n;
+	}
+	return 0;
+}
+
+/* hostapi_ecall, writing down what it did */
+static int log_record(struct hostapi_log *l, struct riscv32_vm *vm,
+	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
+	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7)
+{
+	struct log_region rg[LOG_REGIONS];
+	uint32_t nr = *a0, r1 = *a1, r2 = *a2, r3 = *a3, len;
+	unsigned i, n;
+	void *mem;
+	int rc;
+
+	n = log_regions(vm, nr, r1, r2, rg);
+	rc = hostapi_ecall(vm, a0, a1, a2, a3, a4, a5, a6, a7);
+
+	/* read and a ring filled as much as they returned */
+	if (nr == HOSTAPI_READ)
+		rg[0].len = (int32_t)*a0 > 0 ? *a0 : 0;
+	if (n > 1) {
+		len = (int32_t)*a0 > 0 ? *a0 : 0;
+		for (i = 1; i < n; i++) {
+			rg[i].len = rg[i].len < len ? rg[i].len : len;
+			len -= rg[i].len;
+		}
+	}
+
+	put_uleb(l, LOG_ECALL);
+	put_uleb(l, nr);
+	put_uleb(l, r1);
+	put_uleb(l, r2);
+	put_uleb(l, r3);
+	put_uleb(l, *a0);
+	put_uleb(l, n);
+	for (i = 0; i < n; i++) {
+		mem = riscv32_mem_map(vm, rg[i].addr, rg[i].len);
+		if (mem == NULL)
+			rg[i].len = 0;
+		put_uleb(l, rg[i].addr);
+		put_uleb(l, rg[i].len);
+		fwrite(mem, 1, rg[i].len, l->fp);
+	}
+	if (ferror(l->fp))
+		l->failed = true;
+	return rc;
+}
+
+/* the answer the log has for the call, without making it */
+static int log_replay(struct hostapi_log *l, struct riscv32_vm *vm,
+	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3)
+{
+	uint32_t nr = *a0, addr, len;
+	uint64_t n;
+	void *mem;
+
+	if (l->failed)
+		return -1;
+
+	/* exit has nothing to answer, it ends the log */
+	if (nr == HOSTAPI_EXIT)
+		return 1;
+
+	if (get_uleb(l) != LOG_ECALL || get_uleb(l) != nr || get_uleb(l) != *a1 ||
+			get_uleb(l) != *a2 || get_uleb(l) != *a3) {
+		l->failed = true;
+		return -1;
+	}
+
+	*a0 = get_uleb(l);
+	for (n = get_uleb(l); n > 0 && !l->failed; n--) {
+		addr = get_uleb(l);
+		len = get_uleb(l);
+		mem = riscv32_mem_map(vm, addr, len);
+		if (mem == NULL || fread(mem, 1, len, l->fp) != len)
+			l->failed = true;
+	}
+	return l->failed ? -1 : 0;
+}
+
+/* hostapi_ecall through the log: made and recorded, or answered from a
+ * replay.  Returns -1 when the guest does something the replay does not
+ * have. */
+int hostapi_log_ecall(struct hostapi_log *l, struct riscv32_vm *vm,
+	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
+	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7)
+{
+	if (l->replay)
+		return log_replay(l, vm, a0, a1, a2, a3);
+	if (*a0 == HOSTAPI_EXIT)
+		return hostapi_ecall(vm, a0, a1, a2, a3, a4, a5, a6, a7);
+	return log_record(l, vm, a0, a1, a2, a3, a4, a5, a6, a7);
+}
+
+/* the time csr as the guest reads it: the host's, recorded, or the one
+ * the replay has */
+uint64_t hostapi_log_time(struct hostapi_log *l, uint64_t time)
+{
+	if (l->replay) {
+		if (get_uleb(l) != LOG_TIME) {
+			l->failed = true;
+			return l->time;
+		}
+		l->time += get_uleb(l);
+		return l->time;
+	}
+
+	/* the host clock is monotonic, deltas are small */
+	if (time < l->time)
+		time = l->time;
+	put_uleb(l, LOG_TIME);
+	put_uleb(l, time - l->time);
+	l->time = time;
+	return time;
+}
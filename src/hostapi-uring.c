@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <hostapi.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <riscv.h>
+#include "hostapi-internal.h"
+
+/* polls on more descriptors than this are served synchronously */
+#define URING_POLL_MAX	16
+
+struct uring_req;
+
+/* what a cqe's user_data points at; idx is the pollfd, or nfds for the
+ * timer of a poll */
+struct uring_op {
+	struct uring_req *req;
+	unsigned idx;
+};
+
+/* one guest request in flight; the vm stays parked until all its ops
+ * have completed */
+struct uring_req {
+	struct riscv32_vm *vm;
+	struct pollfd *fds;	/* guest memory, NULL unless HOSTAPI_POLL */
+	struct ribp_ring *ring;	/* guest memory, NULL unless HOSTAPI_RING */
+	struct iovec iov[2];
+	unsigned nfds;
+	unsigned nops;
+	unsigned pending;	/* ops without a cqe yet */
+	unsigned nready;	/* pollfds with revents set */
+	bool fired;		/* the first poll op completed, the rest cancelled */
+	struct __kernel_timespec ts;
+	struct uring_op ops[];
+};
+
+struct hostapi_uring {
+	int fd;
+	pthread_mutex_t lock;	/* the submission queue */
+	pthread_t thread;
+	void (*done)(struct riscv32_vm *vm, void *arg);
+	void *arg;
+	struct uring_op stop;	/* user_data of the nop that ends the thread */
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int rc;
+
+	do
+		rc = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+	while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+/* copy n prepared sqes to the ring and submit them; -1 if they do not
+ * fit or the kernel takes none */
+static int uring_submit(struct hostapi_uring *u, const struct io_uring_sqe *sqe, unsigned n)
+{
+	unsigned tail, i, idx;
+
+	pthread_mutex_lock(&u->lock);
+	tail = *u->sq_tail;
+	if (n > u->sq_entries - (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE))) {
+		pthread_mutex_unlock(&u->lock);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		idx = (tail + i) & *u->sq_mask;
+		u->sqes[idx] = sqe[i];
+		u->sq_array[idx] = idx;
+	}
+	__atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+	if (uring_enter(u->fd, n, 0, 0) <= 0) {
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&u->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&u->lock);
+	return 0;
+}
+
+static struct uring_req *uring_req(struct riscv32_vm *vm, unsigned nops)
+{
+	struct uring_req *req;
+	unsigned i;
+
+	req = calloc(1, sizeof(*req) + nops * sizeof(req->ops[0]));
+	if (req == NULL)
+		return NULL;
+
+	req->vm = vm;
+	req->nops = req->pending = nops;
+	for (i = 0; i < nops; i++) {
+		req->ops[i].req = req;
+		req->ops[i].idx = i;
+	}
+	return req;
+}
+
+/* a read, write or open as a single op */
+static int uring_rw(struct hostapi_uring *u, struct riscv32_vm *vm, struct io_uring_sqe *sqe)
+{
+	struct uring_req *req = uring_req(vm, 1);
+
+	if (req == NULL)
+		return -1;
+
+	sqe->user_data = (uintptr_t)&req->ops[0];
+	if (uring_submit(u, sqe, 1)) {
+		free(req);
+		return -1;
+	}
+	return 0;
+}
+
+/* a readv or writev on the free or queued part of a ring; nothing to
+ * move answers at once */
+static int uring_ring(struct hostapi_uring *u, struct riscv32_vm *vm, int fd, uint32_t addr)
+{
+	struct io_uring_sqe sqe;
+	struct uring_req *req;
+	struct ribp_ring *r;
+	int n;
+
+	req = uring_req(vm, 1);
+	if (req == NULL)
+		return -1;
+
+	n = hostapi_ring_iov(vm, addr, req->iov, &r);
+	if (n <= 0) {
+		free(req);
+		return -1;
+	}
+
+	req->ring = r;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = r->flags & RIBP_RING_IN ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe.fd = fd;
+	sqe.addr = (uintptr_t)req->iov;
+	sqe.len = n;
+	sqe.off = -1;
+	sqe.user_data = (uintptr_t)&req->ops[0];
+	if (uring_submit(u, &sqe, 1)) {
+		free(req);
+		return -1;
+	}
+	return 0;
+}
+
+/* a poll_add per descriptor and a timer when the guest gave a timeout;
+ * whichever completes first cancels the others.  Negative descriptors
+ * are skipped as poll() skips them, their revents stay 0 */
+static int uring_poll(struct hostapi_uring *u, struct riscv32_vm *vm,
+	struct pollfd *fds, unsigned nfds, int timeout)
+{
+	struct io_uring_sqe sqe[URING_POLL_MAX + 1];
+	struct uring_req *req;
+	unsigned i, n, nops = timeout > 0;
+
+	for (i = 0; i < nfds; i++)
+		nops += fds[i].fd >= 0;
+	/* nothing to wait for but forever: poll() blocks the same */
+	if (nops == 0)
+		return -1;
+
+	req = uring_req(vm, nops);
+	if (req == NULL)
+		return -1;
+
+	req->fds = fds;
+	req->nfds = nfds;
+	memset(sqe, 0, nops * sizeof(sqe[0]));
+	for (i = n = 0; i < nfds; i++) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+			continue;
+		req->ops[n].idx = i;
+		sqe[n].opcode = IORING_OP_POLL_ADD;
+		sqe[n].fd = fds[i].fd;
+		sqe[n].poll32_events = (uint16_t)fds[i].events;
+		sqe[n].user_data = (uintptr_t)&req->ops[n];
+		n++;
+	}
+	if (timeout > 0) {
+		req->ts.tv_sec = timeout / 1000;
+		req->ts.tv_nsec = timeout % 1000 * 1000000;
+		req->ops[n].idx = nfds;
+		sqe[n].opcode = IORING_OP_TIMEOUT;
+		sqe[n].addr = (uintptr_t)&req->ts;
+		sqe[n].len = 1;
+		sqe[n].user_data = (uintptr_t)&req->ops[n];
+	}
+
+	if (uring_submit(u, sqe, nops)) {
+		free(req);
+		return -1;
+	}
+	return 0;
+}
+
+/* the cancellations' own cqes carry user_data 0 and are ignored */
+static void uring_cancel(struct hostapi_uring *u, struct uring_req *req, struct uring_op *except)
+{
+	struct io_uring_sqe sqe[URING_POLL_MAX + 1];
+	unsigned i, n = 0;
+
+	memset(sqe, 0, sizeof(sqe));
+	for (i = 0; i < req->nops; i++) {
+		if (&req->ops[i] == except)
+			continue;
+		sqe[n].opcode = IORING_OP_ASYNC_CANCEL;
+		sqe[n].addr = (uintptr_t)&req->ops[i];
+		n++;
+	}
+	while (n && uring_submit(u, sqe, n))
+		sched_yield();
+}
+
+static void uring_complete(struct hostapi_uring *u, struct uring_op *op, int res)
+{
+	struct uring_req *req = op->req;
+	struct riscv32_vm *vm = req->vm;
+
+	if (req->ring) {
+		hostapi_ring_done(req->ring, res);
+		vm->cpu.a0 = res < 0 ? -1 : res;
+	} else if (req->fds == NULL) {
+		vm->cpu.a0 = res < 0 ? -1 : res;
+	} else {
+		if (op->idx < req->nfds && res != -ECANCELED) {
+			/* a bad descriptor reports POLLNVAL, as poll() does */
+			req->fds[op->idx].revents = res < 0 ? POLLNVAL : res;
+			req->nready++;
+		}
+		if (!req->fired) {
+			req->fired = true;
+			uring_cancel(u, req, op);
+		}
+		if (--req->pending)
+			return;
+		vm->cpu.a0 = req->nready;
+	}
+
+	free(req);
+	u->done(vm, u->arg);
+}
+
+static void *uring_thread(void *arg)
+{
+	struct hostapi_uring *u = arg;
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+	unsigned head, tail;
+	bool stop = false;
+
+	while (!stop) {
+		/* drain whatever is there even on error, EBUSY means a full cq */
+		uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			op = (struct uring_op *)(uintptr_t)cqe->user_data;
+			if (op == &u->stop)
+				stop = true;
+			else if (op != NULL)
+				uring_complete(u, op, cqe->res);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* the ring and a thread reaping its completions; NULL if the kernel has
+ * no io_uring */
+struct hostapi_uring *hostapi_uring_create(unsigned entries,
+	void (*done)(struct riscv32_vm *vm, void *arg), void *arg)
+{
+	struct io_uring_params p;
+	struct hostapi_uring *u;
+	void *sqes;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+		goto err;
+
+	u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sqes = sqes;
+	u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	u->done = done;
+	u->arg = arg;
+	pthread_mutex_init(&u->lock, NULL);
+	if (pthread_create(&u->thread, NULL, uring_thread, u) == 0)
+		return u;
+
+	pthread_mutex_destroy(&u->lock);
+err:
+	if (sqes != MAP_FAILED)
+		munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	free(u);
+	return NULL;
+}
+
+/* stop the reaping thread; requests still in flight are dropped */
+void hostapi_uring_destroy(struct hostapi_uring *u)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_NOP;
+	sqe.user_data = (uintptr_t)&u->stop;
+	while (uring_submit(u, &sqe, 1))
+		sched_yield();
+	pthread_join(u->thread, NULL);
+
+	munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	pthread_mutex_destroy(&u->lock);
+	close(u->fd);
+	free(u);
+}
+
+int hostapi_uring_ecall(struct hostapi_uring *u, struct riscv32_vm *vm)
+{
+	struct riscv32_cpu *c = &vm->cpu;
+	struct io_uring_sqe sqe;
+	struct pollfd *fds;
+	void *mem = NULL;
+	int rc = -1;
+
+	memset(&sqe, 0, sizeof(sqe));
+	switch (c->a0) {
+	case HOSTAPI_OPEN:
+		mem = riscv32_mem_map(vm, c->a1, c->a4);
+		if (mem == NULL)
+			break;
+		sqe.opcode = IORING_OP_OPENAT;
+		sqe.fd = AT_FDCWD;
+		sqe.addr = (uintptr_t)mem;
+		sqe.open_flags = c->a2;
+		sqe.len = c->a3;
+		rc = uring_rw(u, vm, &sqe);
+	break;
+
+	case HOSTAPI_READ:
+	case HOSTAPI_WRITE:
+		mem = riscv32_mem_map(vm, c->a2, c->a3);
+		if (mem == NULL)
+			break;
+		sqe.opcode = c->a0 == HOSTAPI_READ ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe.fd = c->a1;
+		sqe.addr = (uintptr_t)mem;
+		sqe.len = c->a3;
+		sqe.off = -1;	/* the file position, like read() and write() */
+		rc = uring_rw(u, vm, &sqe);
+	break;
+
+	case HOSTAPI_RING:
+		rc = uring_ring(u, vm, c->a1, c->a2);
+	break;
+
+	case HOSTAPI_POLL:
+		fds = riscv32_mem_map(vm, c->a1, c->a2 * sizeof(struct pollfd));
+		/* ready already, or not meant to wait: answer right away */
+		if (fds == NULL || c->a2 > URING_POLL_MAX || (int)c->a3 == 0 ||
+				(c->a2 == 0 && (int)c->a3 < 0))
+			break;
+		if (poll(fds, c->a2, 0) != 0)
+			break;
+		rc = uring_poll(u, vm, fds, c->a2, c->a3);
+	break;
+	}
+
+	if (rc == 0)
+		return HOSTAPI_PENDING;
+
+	return hostapi_ecall(vm, &c->a0, &c->a1, &c->a2, &c->a3,
+		&c->a4, &c->a5, &c->a6, &c->a7);
+}
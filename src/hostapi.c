@@ -4,8 +4,79 @@
 #include <fcntl.h>
 #include <riscv.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
+#include "hostapi-internal.h"
 
-void hostapi_ecall(struct riscv32_vm *vm,
+/* the part of the ring at addr the host works on next: the free space of
+ * an input ring, the queued bytes of an output one.  Returns the number
+ * of iovecs, 0 when there is nothing to move, -1 for a bad ring */
+int hostapi_ring_iov(struct riscv32_vm *vm, uint32_t addr,
+	struct iovec iov[2], struct ribp_ring **ring)
+{
+	struct ribp_ring *r;
+	uint32_t size, start, len, first;
+
+	if (addr & 3)
+		return -1;
+	r = riscv32_mem_map(vm, addr, sizeof(*r));
+	if (r == NULL)
+		return -1;
+
+	size = r->size;
+	if (size == 0 || (size & (size - 1)) ||
+			riscv32_mem_map(vm, addr + sizeof(*r), size) == NULL)
+		return -1;
+
+	if (r->flags & RIBP_RING_IN) {
+		start = r->tail;
+		len = size - (r->tail - r->head);
+	} else {
+		start = r->head;
+		len = r->tail - r->head;
+	}
+	/* the guest owns the indices, do not trust them */
+	if (len > size)
+		return -1;
+
+	start &= size - 1;
+	first = size - start < len ? size - start : len;
+	iov[0].iov_base = r->data + start;
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = len - first;
+	*ring = r;
+	return len == 0 ? 0 : 1 + (len > first);
+}
+
+/* account res bytes moved by the host */
+void hostapi_ring_done(struct ribp_ring *r, int res)
+{
+	if (r->flags & RIBP_RING_IN) {
+		if (res > 0)
+			r->tail += res;
+		else if (res == 0)
+			r->flags |= RIBP_RING_EOF;
+	} else if (res > 0) {
+		r->head += res;
+	}
+}
+
+static int hostapi_ring(struct riscv32_vm *vm, int fd, uint32_t addr)
+{
+	struct ribp_ring *r;
+	struct iovec iov[2];
+	int n, rc;
+
+	n = hostapi_ring_iov(vm, addr, iov, &r);
+	if (n <= 0)
+		return n;
+
+	rc = r->flags & RIBP_RING_IN ? readv(fd, iov, n) : writev(fd, iov, n);
+	hostapi_ring_done(r, rc);
+	return rc;
+}
+
+int hostapi_ecall(struct riscv32_vm *vm,
 	uint32_t *a0, uint32_t *a1, uint32_t *a2, uint32_t *a3,
 	uint32_t *a4, uint32_t *a5, uint32_t *a6, uint32_t *a7)
 {
@@ -39,8 +110,16 @@ void hostapi_ecall(struct riscv32_vm *vm,
 		*a0 = poll(mem, *a2, *a3);
 	break;
 
+	case HOSTAPI_RING:
+		*a0 = hostapi_ring(vm, *a1, *a2);
+	break;
+
+	case HOSTAPI_EXIT:
+		return 1;
+
 	default:
 		*a0 = -1;
 	break;
 	}
+	return 0;
 }
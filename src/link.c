@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "link.h"
+
+/* the most one splice moves, the default pipe capacity */
+#define LINK_CHUNK	65536
+#define LINK_EVENTS	64
+
+/* what a link waits for before it can move on */
+enum {
+	LINK_WAIT_IN,
+	LINK_WAIT_OUT,
+	LINK_WAIT_TAP,
+	LINK_DEAD,
+};
+
+struct link {
+	struct link *next;
+	int in, out, tap;	/* tap is -1 without one */
+	int in_fl, out_fl, tap_fl;	/* flags to give back on close, or -1 */
+	int stage[2];		/* in is spliced here, out and tap fed from it */
+	unsigned stage_size;	/* what the stage holds, a page once the user
+				 * is over fs.pipe-user-pages-soft */
+	unsigned queued;	/* bytes staged and not yet written to out */
+	unsigned unsent;	/* of those, the ones already teed to tap */
+	int wait;
+	bool eof;
+	bool copy_in;		/* in can not splice, read() it instead */
+	bool copy_out;		/* out can not splice, write() it from buf */
+	unsigned buflen, bufoff;
+	char *buf;
+};
+
+struct ribp_links {
+	int epfd;
+	int stopfd;		/* an eventfd that ends the thread */
+	pthread_t thread;
+	pthread_mutex_t lock;	/* the list, against ribp_link from other threads */
+	struct link *links;
+};
+
+static void link_watch(struct ribp_links *l, struct link *k, int fd, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = k };
+
+	epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void link_wait(struct ribp_links *l, struct link *k, int wait)
+{
+	if (k->wait == wait)
+		return;
+
+	link_watch(l, k, k->in, wait == LINK_WAIT_IN ? EPOLLIN : 0);
+	link_watch(l, k, k->out, wait == LINK_WAIT_OUT ? EPOLLOUT : 0);
+	if (k->tap >= 0)
+		link_watch(l, k, k->tap, wait == LINK_WAIT_TAP ? EPOLLOUT : 0);
+	k->wait = wait;
+}
+
+/* closing a dup does not drop the epoll entry while the descriptor it
+ * was made from is still open, so every end is removed by hand */
+static void link_unwatch(struct ribp_links *l, struct link *k)
+{
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, k->in, NULL);
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, k->out, NULL);
+	if (k->tap >= 0)
+		epoll_ctl(l->epfd, EPOLL_CTL_DEL, k->tap, NULL);
+}
+
+/* an end that shares its description with the caller's gets its file
+ * status flags back before it goes */
+static void link_disown(int fd, int fl)
+{
+	if (fl >= 0)
+		fcntl(fd, F_SETFL, fl);
+	close(fd);
+}
+
+static void link_close(struct ribp_links *l, struct link *k)
+{
+	link_unwatch(l, k);
+	if (k->tap >= 0)
+		link_disown(k->tap, k->tap_fl);
+	close(k->stage[0]);
+	close(k->stage[1]);
+	link_disown(k->out, k->out_fl);
+	link_disown(k->in, k->in_fl);
+	free(k->buf);
+	k->wait = LINK_DEAD;
+}
+
+/* the staged bytes go out by hand when out refuses splice, O_APPEND
+ * files among others */
+static ssize_t link_copy_out(struct link *k)
+{
+	ssize_t n;
+
+	if (k->buflen == 0) {
+		n = read(k->stage[0], k->buf, k->unsent);
+		if (n <= 0)
+			return n;
+		k->buflen = n;
+		k->bufoff = 0;
+	}
+	n = write(k->out, k->buf + k->bufoff, k->buflen - k->bufoff);
+	if (n > 0) {
+		k->bufoff += n;
+		if (k->bufoff == k->buflen)
+			k->buflen = 0;
+	}
+	return n;
+}
+
+/* ttys and others without splice_read */
+static ssize_t link_copy_in(struct link *k)
+{
+	ssize_t n = read(k->in, k->buf, k->stage_size);
+
+	/* the stage is empty here and takes all of that */
+	if (n > 0)
+		n = write(k->stage[1], k->buf, n);
+	return n;
+}
+
+/* move what can be moved without blocking; returns what the link waits
+ * for next */
+static int link_pump(struct ribp_links *l, struct link *k)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (k->unsent) {
+			if (!k->copy_out) {
+				n = splice(k->stage[0], NULL, k->out, NULL, k->unsent,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (n < 0 && errno == EINVAL) {
+					k->copy_out = true;
+					continue;
+				}
+			} else {
+				n = link_copy_out(k);
+			}
+			if (n < 0 && errno == EAGAIN)
+				return LINK_WAIT_OUT;
+			if (n <= 0)
+				return LINK_DEAD;
+			k->unsent -= n;
+			k->queued -= n;
+			continue;
+		}
+
+		if (k->queued) {
+			if (k->tap < 0) {
+				k->unsent = k->queued;
+				continue;
+			}
+			n = tee(k->stage[0], k->tap, k->queued, SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EAGAIN)
+				return LINK_WAIT_TAP;
+			if (n <= 0) {
+				/* the reader of the tap went away, keep forwarding */
+				epoll_ctl(l->epfd, EPOLL_CTL_DEL, k->tap, NULL);
+				link_disown(k->tap, k->tap_fl);
+				k->tap = -1;
+				continue;
+			}
+			k->unsent = n;
+			continue;
+		}
+
+		if (k->eof)
+			return LINK_DEAD;
+
+		if (!k->copy_in) {
+			n = splice(k->in, NULL, k->stage[1], NULL, LINK_CHUNK,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL) {
+				k->copy_in = true;
+				continue;
+			}
+		} else {
+			n = link_copy_in(k);
+		}
+		if (n < 0 && errno == EAGAIN)
+			return LINK_WAIT_IN;
+		if (n < 0)
+			return LINK_DEAD;
+		if (n == 0)
+			k->eof = true;
+		k->queued = n;
+	}
+}
+
+static void link_run(struct ribp_links *l, struct link *k)
+{
+	int wait;
+
+	if (k->wait == LINK_DEAD)
+		return;
+
+	wait = link_pump(l, k);
+	if (wait == LINK_DEAD)
+		link_close(l, k);
+	else
+		link_wait(l, k, wait);
+}
+
+static void *links_thread(void *arg)
+{
+	struct ribp_links *l = arg;
+	struct epoll_event ev[LINK_EVENTS];
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(l->epfd, ev, LINK_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == NULL)
+				return NULL;
+			pthread_mutex_lock(&l->lock);
+			link_run(l, ev[i].data.ptr);
+			pthread_mutex_unlock(&l->lock);
+		}
+	}
+}
+
+struct ribp_links *ribp_links_create(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct ribp_links *l;
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL)
+		return NULL;
+
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	l->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (l->epfd < 0 || l->stopfd < 0 ||
+			epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->stopfd, &ev))
+		goto err;
+
+	pthread_mutex_init(&l->lock, NULL);
+	if (pthread_create(&l->thread, NULL, links_thread, l) == 0)
+		return l;
+
+	pthread_mutex_destroy(&l->lock);
+err:
+	if (l->stopfd >= 0)
+		close(l->stopfd);
+	if (l->epfd >= 0)
+		close(l->epfd);
+	free(l);
+	return NULL;
+}
+
+/* a non blocking end of our own.  A dup shares O_NONBLOCK with the
+ * caller's descriptor, stdin among them, so pipes and ttys are reopened
+ * for a description of their own.  What can not be, a socket or a fifo
+ * nobody reads any more, is dup'ed and *fl keeps the flags to restore;
+ * regular files never block and are left alone */
+static int link_own(int fd, int *fl)
+{
+	char path[32];
+	struct stat st;
+	int own, flags;
+
+	*fl = -1;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fstat(fd, &st))
+		return -1;
+
+	if (S_ISFIFO(st.st_mode) || (S_ISCHR(st.st_mode) && isatty(fd))) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		own = open(path, (flags & O_ACCMODE) | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+		if (own >= 0)
+			return own;
+	}
+
+	own = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own < 0 || S_ISREG(st.st_mode) || (flags & O_NONBLOCK))
+		return own;
+	if (fcntl(own, F_SETFL, flags | O_NONBLOCK) == 0)
+		*fl = flags;
+	return own;
+}
+
+/* regular files are always ready and epoll refuses them, they are
+ * simply never waited for */
+static int link_add(struct ribp_links *l, struct link *k, int fd, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = k };
+
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) && errno != EPERM)
+		return -1;
+	return 0;
+}
+
+/* forward in to out, and to tap when it is not -1 */
+int ribp_link(struct ribp_links *l, int in, int out, int tap)
+{
+	struct link *k;
+	int n;
+
+	k = calloc(1, sizeof(*k));
+	if (k == NULL)
+		return -1;
+
+	k->stage[0] = k->stage[1] = -1;
+	k->tap_fl = -1;
+	k->in = link_own(in, &k->in_fl);
+	k->out = link_own(out, &k->out_fl);
+	k->tap = tap >= 0 ? link_own(tap, &k->tap_fl) : -1;
+	k->buf = malloc(LINK_CHUNK);
+	if (k->in < 0 || k->out < 0 || (tap >= 0 && k->tap < 0) || k->buf == NULL ||
+			pipe2(k->stage, O_CLOEXEC | O_NONBLOCK))
+		goto err;
+	n = fcntl(k->stage[1], F_GETPIPE_SZ);
+	k->stage_size = n > 0 && n < LINK_CHUNK ? n : LINK_CHUNK;
+
+	/* every end is a descriptor of its own, so epoll takes it even when two
+	 * links share a descriptor */
+	if (link_add(l, k, k->out, 0) || (k->tap >= 0 && link_add(l, k, k->tap, 0)) ||
+			link_add(l, k, k->in, EPOLLIN))
+		goto err;
+	k->wait = LINK_WAIT_IN;
+
+	/* a first round for what is readable already, a file for one */
+	pthread_mutex_lock(&l->lock);
+	k->next = l->links;
+	l->links = k;
+	link_run(l, k);
+	pthread_mutex_unlock(&l->lock);
+	return 0;
+
+err:
+	link_unwatch(l, k);
+	if (k->stage[0] >= 0) {
+		close(k->stage[0]);
+		close(k->stage[1]);
+	}
+	if (k->tap >= 0)
+		link_disown(k->tap, k->tap_fl);
+	if (k->out >= 0)
+		link_disown(k->out, k->out_fl);
+	if (k->in >= 0)
+		link_disown(k->in, k->in_fl);
+	free(k->buf);
+	free(k);
+	return -1;
+}
+
+/* stop the thread, forward what is already readable and close the links */
+void ribp_links_destroy(struct ribp_links *l)
+{
+	struct link *k;
+	uint64_t one = 1;
+
+	if (write(l->stopfd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(l->thread, NULL);
+
+	while ((k = l->links) != NULL) {
+		l->links = k->next;
+		if (k->wait != LINK_DEAD) {
+			link_pump(l, k);
+			link_close(l, k);
+		}
+		free(k);
+	}
+
+	pthread_mutex_destroy(&l->lock);
+	close(l->stopfd);
+	close(l->epfd);
+	free(l);
+}
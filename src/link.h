@@ -0,0 +1,23 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __LINK_H__
+#define __LINK_H__
+
+/*
+ * The host side of ribp descriptor links: a thread on an epoll set that
+ * forwards everything readable on a link's input to its output, and tees
+ * a copy to its tap if it has one.  Data moves with splice and tee
+ * through a staging pipe, so traffic between two host descriptors never
+ * enters guest memory; a vm only sees the links whose tap or end is one
+ * of its own descriptors.  The descriptors are dup()ed, switched to non
+ * blocking and owned by the links from then on.
+ */
+struct ribp_links;
+
+struct ribp_links *ribp_links_create(void);
+int ribp_link(struct ribp_links *l, int in, int out, int tap);
+void ribp_links_destroy(struct ribp_links *l);
+
+#endif /* __LINK_H__*/
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "riscv.h"
+#include "riscv-sched.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,9 +11,20 @@
 #include <termios.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <elf.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
 #include <debug.h>
+#include <hostapi.h>
+#include "link.h"
+#include "cache.h"
 
-void debug_exception_handler (struct riscv32_vm *vm, bool intr);
+/* instructions run between looks at the gdb interrupt flag */
+#define DEBUG_POLL_INSNS	100000
+
+int debug_exception_handler (struct riscv32_vm *vm, bool intr);
 int mkptms(const char* target, mode_t perm)
 {
 	int fdm, oflags;
@@ -64,33 +76,669 @@ __err:
 
 int dfd = -1;
 
+/* gdb traffic is buffered both ways: a read() takes whatever gdb sent,
+ * a packet goes out in one write() from flushDebugChar */
+static char debug_in[65536], debug_out[65536];
+static unsigned debug_in_pos, debug_in_len, debug_out_len;
+
+/* refill debug_in; with wait, sleep until gdb sends something */
+static int debug_fill(bool wait)
+{
+	struct pollfd pfd = { .fd = dfd, .events = POLLIN };
+	ssize_t rn;
+
+	for (;;) {
+		rn = read(dfd, debug_in, sizeof(debug_in));
+		if (rn > 0) {
+			debug_in_pos = 0;
+			debug_in_len = rn;
+			return 0;
+		}
+		if (rn == 0 || !wait || (errno != EAGAIN && errno != EINTR))
+			return -1;
+		poll(&pfd, 1, -1);
+	}
+}
+
 int getDebugChar(void)
 {
-	int rn = -1;
-	char ch;
-	if (dfd != 1)
-		rn = read(dfd, &ch, 1);
-//	BLOGD("getchar: %c\n", ch);
-	return rn != 1 ? -1 : ch;
+	if (debug_in_pos == debug_in_len && (dfd == -1 || debug_fill(true)))
+		return -1;
+//	BLOGD("getchar: %c\n", debug_in[debug_in_pos]);
+	return debug_in[debug_in_pos++];
+}
+
+void flushDebugChar(void)
+{
+	struct pollfd pfd = { .fd = dfd, .events = POLLOUT };
+	unsigned off = 0;
+	ssize_t rn;
+
+	while (dfd != -1 && off < debug_out_len) {
+		rn = write(dfd, debug_out + off, debug_out_len - off);
+		if (rn > 0)
+			off += rn;
+		else if (rn < 0 && (errno == EAGAIN || errno == EINTR))
+			poll(&pfd, 1, -1);
+		else
+			break;
+	}
+	debug_out_len = 0;
 }
 
 void putDebugChar(char ch)
 {
 	//BLOGD("putchar: %c\n", ch);
-	if (dfd != -1)
-		write(dfd, &ch, 1);
+	if (debug_out_len == sizeof(debug_out))
+		flushDebugChar();
+	debug_out[debug_out_len++] = ch;
 }
 
-int main(int argc, char **argv)
+/* set by SIGIO when gdb sent something while the guest runs */
+static volatile sig_atomic_t debug_input;
+
+static void debug_sigio(int sig)
+{
+	debug_input = 1;
+}
+
+/* gdb's input arrives as SIGIO, the guest runs without polling for it */
+static void debug_async(int fd)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = debug_sigio;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGIO, &sa, NULL);
+
+	fcntl(fd, F_SETOWN, getpid());
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+}
+
+/* a ctrl-C from gdb is a request to stop */
+static bool debug_interrupted(void)
+{
+	if (!debug_input)
+		return false;
+
+	debug_input = 0;
+	if (debug_in_pos == debug_in_len && debug_fill(false))
+		return false;
+	return debug_in[debug_in_pos++] == 0x03;
+}
+
+/* instructions a scheduled vm runs before yielding its worker */
+#define SCHED_QUANTUM		100000
+
+static int failed;
+static uint64_t retired;	/* instructions retired by finished vms */
+/* instructions each guest may run before it is stopped, from -f */
+static uint64_t fuel = RISCV32_FUEL_UNLIMITED;
+/* bytes of memory each guest may commit, from -M; 0 for no limit */
+static uint64_t memlimit;
+/* with -a, blocking host calls of scheduled vms go through this ring */
+static struct hostapi_uring *uring;
+/* descriptor interrupts, and where a vm waits in wfi; none under -L/-P */
+static struct hostapi_irq *irqs;
+
+/* io_uring requests in flight at once */
+#define URING_ENTRIES		256
+
+/* bytes of images -c keeps by default */
+#define CACHE_LIMIT		(256ull << 20)
+
+/* with -L the host calls of the vm are recorded, with -P replayed */
+static struct hostapi_log *hostlog;
+static bool hostlog_replay;
+
+static uint64_t hostlog_time(struct riscv32_vm *vm, uint64_t time)
+{
+	return hostapi_log_time(hostlog, time);
+}
+
+/* a wfi: sleep until the guest's timer is due rather than spin on it */
+static void wfi_wait(struct riscv32_vm *vm)
+{
+	int64_t ns = riscv32_timer_deadline(vm);
+	struct timespec ts;
+
+	if (ns <= 0)
+		return;
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	nanosleep(&ts, NULL);
+}
+
+/* with -c, prepared images are kept by the key of their rom */
+static struct ribp_cache *cache;
+static uint8_t image_key[SHA256_SIZE];
+static unsigned image_memsize;
+/* on a miss, the image as loaded, saved by the first vm to finish */
+static struct riscv32_snapshot *image_fresh;
+static int image_saved;
+
+static struct riscv32_vm *load_vm(int fd, unsigned memsize, unsigned flags, int engine)
 {
-	int c, fd, rn, off = 0;
-	bool debug = false;
-	const char *romfile = "rom.bin", *stub = NULL;
+	struct riscv32_vm *vm;
 	char buf[4096];
-	unsigned memsize = 1024 * 400;
+	int rn, off = 0;
+	uint32_t end;
+
+	/* -k names an image, there is no rom to fall back to */
+	if (fd < 0) {
+		BLOGE("the image is not in the cache\n");
+		return NULL;
+	}
+
+	vm = riscv32_vm_create(memsize + 8, flags);
+	if (vm == NULL) {
+		BLOGE("can't create a vm with %u bytes of memory\n", memsize);
+		return NULL;
+	}
+	if (engine >= 0)
+		vm->engine = engine;
+	vm->fuel = fuel;
+
+	/* an ELF image starts at its entry, a flat one at 0 */
+	if (pread(fd, buf, SELFMAG, 0) == SELFMAG && !memcmp(buf, ELFMAG, SELFMAG)) {
+		if (riscv32_load_elf(vm, fd, &end)) {
+			BLOGE("can't load the ELF image\n");
+			riscv32_vm_destroy(vm);
+			return NULL;
+		}
+		off = end;
+	} else {
+		lseek(fd, 0, SEEK_SET);
+		while (0 < (rn = read(fd, buf, sizeof(buf)))) {
+			riscv32_load_rom(vm, buf, rn, off);
+			off += rn;
+		}
+		vm->cpu.pc = 0;
+	}
+
+	/* store hostapi */
+	off = (off + 3) & ~3;
+	riscv32_load_rom(vm, "\x73\x00\x00\x00\x67\x80\x00\x00", 8, off);
+	vm->cpu.sp = memsize;
+	vm->cpu.fp = memsize;
+	vm->cpu.a0 = off;
+	return vm;
+}
+
+/* the rom's prepared image from the cache, NULL on a miss */
+static struct riscv32_snapshot *cached_image(unsigned memsize, unsigned flags)
+{
+	return cache ? ribp_cache_get(cache, image_key, memsize, flags) : NULL;
+}
+
+/* a fresh instance, the same as load_vm makes */
+static struct riscv32_vm *clone_vm(struct riscv32_snapshot *snap, int engine)
+{
+	struct riscv32_vm *vm = riscv32_vm_clone(snap);
+
+	if (vm != NULL) {
+		if (engine >= 0)
+			vm->engine = engine;
+		vm->fuel = fuel;
+	}
+	return vm;
+}
+
+/* the guest's pages commit as it touches them, up to -M */
+static int limit_vm(struct riscv32_vm *vm)
+{
+	if (memlimit && riscv32_vm_limit(vm, memlimit)) {
+		BLOGE("can't limit the vm to %llu bytes\n", (unsigned long long)memlimit);
+		return -1;
+	}
+	return 0;
+}
+
+/* save the fresh image, with the instructions vm ran decoded ahead */
+static void cache_fill(struct riscv32_vm *vm)
+{
+	if (image_fresh == NULL || __atomic_exchange_n(&image_saved, 1, __ATOMIC_RELAXED))
+		return;
+	if (ribp_cache_put(cache, image_key, image_memsize, image_fresh, vm))
+		BLOGE("can't save the image in the cache\n");
+}
+
+static int sched_done(struct riscv32_vm *vm, int status)
+{
+	if (status)
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&retired, vm->instret, __ATOMIC_RELAXED);
+	cache_fill(vm);
+	if (irqs)
+		hostapi_irq_release(irqs, vm);
+	riscv32_vm_destroy(vm);
+	return RISCV32_SCHED_DONE;
+}
+
+/* runs on a scheduler worker, the same policy as the loop in run_vm */
+static int sched_exit(struct riscv32_sched *s, struct riscv32_vm *vm, int reason, void *arg)
+{
+	int rc;
+
+	if (reason == RISCV32_EXIT_ECALL) {
+		if (irqs && vm->cpu.a0 == HOSTAPI_CLOSE)
+			hostapi_irq_close(irqs, vm, vm->cpu.a1);
+		if (irqs && vm->cpu.a0 == HOSTAPI_IRQ)
+			rc = hostapi_irq_ecall(irqs, vm);
+		else
+			rc = uring ? hostapi_uring_ecall(uring, vm) :
+				hostapi_ecall(vm, &vm->cpu.a0, &vm->cpu.a1, &vm->cpu.a2, &vm->cpu.a3,
+					&vm->cpu.a4, &vm->cpu.a5, &vm->cpu.a6, &vm->cpu.a7);
+		/* the ring's thread wakes it with the result */
+		if (rc == HOSTAPI_PENDING)
+			return RISCV32_SCHED_PARK;
+		if (rc)
+			return sched_done(vm, vm->cpu.a1);
+	} else if (reason == RISCV32_EXIT_WFI) {
+		/* the interrupt thread wakes it; without one let the others run first */
+		if (irqs && hostapi_irq_park(irqs, vm) == HOSTAPI_PENDING)
+			return RISCV32_SCHED_PARK;
+	} else if (reason == RISCV32_EXIT_FUEL) {
+		BLOGE("out of fuel at pc %08x\n", vm->cpu.pc);
+		return sched_done(vm, 1);
+	} else if (vm->cpu.mtvec == 0) {
+		BLOGE("unhandled exception: mcause %x, mepc %08x, mtval %08x\n",
+			vm->cpu.mcause, vm->cpu.mepc, vm->cpu.mtval);
+		return sched_done(vm, 1);
+	}
+	return RISCV32_SCHED_RUN;
+}
+
+/* on the ring's or the interrupt thread: the parked vm can go on */
+static void sched_resume(struct riscv32_vm *vm, void *arg)
+{
+	riscv32_sched_wake(arg, vm);
+}
+
+static int run_sched(int fd, unsigned memsize, unsigned flags, int engine,
+	unsigned instances, unsigned workers, bool async)
+{
+	struct riscv32_snapshot *snap;
+	struct riscv32_sched *s;
 	struct riscv32_vm *vm;
+	unsigned i;
+
+	if (workers == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	s = riscv32_sched_create(workers, SCHED_QUANTUM, sched_exit, NULL);
+	if (s == NULL) {
+		BLOGE("can't start %u workers\n", workers);
+		return 1;
+	}
 
-	while (-1 != (c = getopt(argc, argv, "r:m:d:"))) {
+	if (async) {
+		uring = hostapi_uring_create(URING_ENTRIES, sched_resume, s);
+		if (uring == NULL)
+			BLOGE("no io_uring, host calls block their worker\n");
+	}
+	irqs = hostapi_irq_create(sched_resume, s);
+	if (irqs == NULL)
+		BLOGE("no descriptor interrupts, wfi keeps its worker busy\n");
+
+	/* load the rom once and start every instance as a clone of it */
+	snap = cached_image(memsize, flags);
+	if (snap == NULL) {
+		vm = load_vm(fd, memsize, flags, engine);
+		if (vm == NULL) {
+			if (irqs)
+				hostapi_irq_destroy(irqs);
+			if (uring)
+				hostapi_uring_destroy(uring);
+			riscv32_sched_destroy(s);
+			return 1;
+		}
+		snap = riscv32_snapshot(vm);
+		riscv32_vm_destroy(vm);
+		if (cache)
+			image_fresh = snap;
+	}
+
+	for (i = 0; i < instances; i++) {
+		vm = snap ? clone_vm(snap, engine) : load_vm(fd, memsize, flags, engine);
+		if (vm == NULL)
+			break;
+		if (limit_vm(vm)) {
+			riscv32_vm_destroy(vm);
+			break;
+		}
+		riscv32_sched_add(s, vm);
+	}
+
+	riscv32_sched_wait(s);
+	if (irqs)
+		hostapi_irq_destroy(irqs);
+	if (uring)
+		hostapi_uring_destroy(uring);
+	riscv32_sched_destroy(s);
+	image_fresh = NULL;
+	if (snap)
+		riscv32_snapshot_free(snap);
+	return i < instances || failed;
+}
+
+/* a single vm, optionally under gdb; returns the guest's exit status */
+static int run_vm(int fd, unsigned memsize, unsigned flags, int engine, const char *stub,
+	int trace)
+{
+	struct riscv32_snapshot *snap;
+	struct riscv32_vm *vm;
+	int reason, rc, step = 0, status = -1;
+
+	snap = cached_image(memsize, flags);
+	if (snap != NULL) {
+		vm = clone_vm(snap, engine);
+		riscv32_snapshot_free(snap);
+	} else {
+		vm = load_vm(fd, memsize, flags, engine);
+		if (vm != NULL && cache)
+			image_fresh = riscv32_snapshot(vm);
+	}
+	if (vm == NULL)
+		return 1;
+	if (limit_vm(vm))
+		goto err;
+
+	if (hostlog != NULL)
+		vm->time_hook = hostlog_time;
+	if (trace >= 0 && riscv32_trace_start(vm, trace)) {
+		BLOGE("can't start the trace\n");
+		goto err;
+	}
+
+	if (stub != NULL) {
+		dfd = mkptms(stub, 0666);
+	}
+	if (dfd >= 0) {
+		debug_async(dfd);
+		step = debug_exception_handler(vm, false);
+	}
+	/* the log can not say when an interrupt came */
+	if (hostlog == NULL) {
+		irqs = hostapi_irq_create(NULL, NULL);
+		if (irqs == NULL)
+			BLOGE("no descriptor interrupts\n");
+	}
+
+	while (status < 0) {
+		riscv32_cpu_run(vm, step ? 1 : dfd >= 0 ? DEBUG_POLL_INSNS : UINT_MAX, &reason);
+
+		switch (reason) {
+		case RISCV32_EXIT_ECALL:
+			if (irqs && vm->cpu.a0 == HOSTAPI_CLOSE)
+				hostapi_irq_close(irqs, vm, vm->cpu.a1);
+			if (irqs && vm->cpu.a0 == HOSTAPI_IRQ)
+				rc = hostapi_irq_ecall(irqs, vm);
+			else
+				rc = hostlog == NULL ?
+					hostapi_ecall(vm, &vm->cpu.a0, &vm->cpu.a1, &vm->cpu.a2, &vm->cpu.a3,
+						&vm->cpu.a4, &vm->cpu.a5, &vm->cpu.a6, &vm->cpu.a7) :
+					hostapi_log_ecall(hostlog, vm, &vm->cpu.a0, &vm->cpu.a1, &vm->cpu.a2,
+						&vm->cpu.a3, &vm->cpu.a4, &vm->cpu.a5, &vm->cpu.a6, &vm->cpu.a7);
+			if (rc < 0) {
+				BLOGE("the guest left the replay at pc %08x\n", vm->cpu.pc - 4);
+				status = 1;
+			} else if (rc) {
+				status = vm->cpu.a1 & 0xff;
+			} else if (step) {
+				step = debug_exception_handler(vm, false);
+			}
+		break;
+
+		case RISCV32_EXIT_WFI:
+			/* a replay reads the time from the log, there is nothing to wait for */
+			if (dfd < 0 && !hostlog_replay) {
+				if (irqs)
+					hostapi_irq_wait(irqs, vm);
+				else
+					wfi_wait(vm);
+				break;
+			}
+			/* fall through */
+		case RISCV32_EXIT_BUDGET:
+			if (step || (dfd >= 0 && debug_interrupted()))
+				step = debug_exception_handler(vm, false);
+		break;
+
+		case RISCV32_EXIT_DEBUG:
+			step = debug_exception_handler(vm, false);
+		break;
+
+		case RISCV32_EXIT_EBREAK:
+		case RISCV32_EXIT_TRAP:
+			if (dfd >= 0) {
+				step = debug_exception_handler(vm, true);
+			} else if (vm->cpu.mtvec == 0) {
+				BLOGE("unhandled exception: mcause %x, mepc %08x, mtval %08x\n",
+					vm->cpu.mcause, vm->cpu.mepc, vm->cpu.mtval);
+				status = 1;
+			}
+		break;
+
+		case RISCV32_EXIT_FUEL:
+			BLOGE("out of fuel at pc %08x\n", vm->cpu.pc);
+			status = 1;
+		break;
+		}
+	}
+
+	retired += vm->instret;
+	if (irqs) {
+		hostapi_irq_release(irqs, vm);
+		hostapi_irq_destroy(irqs);
+	}
+	if (trace >= 0 && riscv32_trace_stop(vm))
+		BLOGE("the trace is incomplete\n");
+	cache_fill(vm);
+	if (image_fresh)
+		riscv32_snapshot_free(image_fresh);
+	image_fresh = NULL;
+	riscv32_vm_destroy(vm);
+	return status;
+
+err:
+	if (image_fresh)
+		riscv32_snapshot_free(image_fresh);
+	image_fresh = NULL;
+	riscv32_vm_destroy(vm);
+	return 1;
+}
+
+static void replay_insn(void *arg, uint32_t pc, uint32_t insn)
+{
+	struct riscv32_vm *vm = arg;
+	const char *sym;
+	uint32_t off;
+
+	if ((insn & 3) == 3)
+		printf("%08x: %08x", pc, insn);
+	else
+		printf("%08x: %04x    ", pc, insn);
+	sym = riscv32_symbol(vm, pc, &off);
+	if (sym != NULL)
+		printf("  <%s+0x%x>", sym, off);
+	putchar('\n');
+}
+
+/* -T: the instructions a trace from -t recorded, from the image the rom
+ * loads as */
+static int replay_vm(int fd, unsigned memsize, unsigned flags, const char *file)
+{
+	struct riscv32_snapshot *snap;
+	struct riscv32_vm *vm;
+	int trace, rc;
+
+	trace = open(file, O_RDONLY);
+	if (trace < 0) {
+		perror(file);
+		return 1;
+	}
+
+	snap = cached_image(memsize, flags);
+	if (snap != NULL) {
+		vm = clone_vm(snap, -1);
+		riscv32_snapshot_free(snap);
+	} else {
+		vm = load_vm(fd, memsize, flags, -1);
+	}
+	if (vm == NULL) {
+		close(trace);
+		return 1;
+	}
+
+	rc = riscv32_trace_replay(vm, trace, replay_insn, vm);
+	fflush(stdout);
+	if (rc)
+		BLOGE("%s is cut short or does not match the rom\n", file);
+	riscv32_vm_destroy(vm);
+	close(trace);
+	return rc ? 1 : 0;
+}
+
+/* -l options, set up once they are all parsed */
+#define MAX_LINKS		16
+/* the pipe ends rscv keeps for rN links go above every N */
+#define LINK_FD_MIN		64
+
+/* one end of a -l link: a host descriptor, or rN for the guest's
+ * descriptor N, one end of a pipe whose other end goes to the links.
+ * N must be free, or stdio */
+static int link_end(const char *s, bool guest_reads)
+{
+	int p[2], n, fd, theirs;
+	char *end;
+
+	n = strtol(s + (*s == 'r'), &end, 0);
+	if (end == s + (*s == 'r') || *end || n < 0)
+		return -1;
+	if (*s != 'r')
+		return n;
+	if (n >= LINK_FD_MIN || (n > 2 && fcntl(n, F_GETFD) >= 0))
+		return -1;
+
+	if (pipe(p))
+		return -1;
+	fd = fcntl(p[guest_reads], F_DUPFD_CLOEXEC, LINK_FD_MIN);
+	close(p[guest_reads]);
+	theirs = p[!guest_reads];
+	if (theirs != n) {
+		dup2(theirs, n);
+		close(theirs);
+	}
+	return fd;
+}
+
+struct link_spec {
+	char *src, *dst, *tap;
+	int in, out, tfd;
+};
+
+/* -l SRC:DST[:TAP], forward SRC to DST and tee a copy to TAP; the guest's
+ * ends of every link are in place before the links open descriptors of
+ * their own */
+static struct ribp_links *make_links(struct link_spec *ls, unsigned n)
+{
+	struct ribp_links *links;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		ls[i].in = link_end(ls[i].src, false);
+		ls[i].out = link_end(ls[i].dst, true);
+		ls[i].tfd = ls[i].tap ? link_end(ls[i].tap, true) : -1;
+		if (ls[i].in < 0 || ls[i].out < 0 || (ls[i].tap && ls[i].tfd < 0)) {
+			BLOGE("can't link %s to %s\n", ls[i].src, ls[i].dst);
+			return NULL;
+		}
+	}
+
+	links = ribp_links_create();
+	for (i = 0; links && i < n; i++) {
+		if (ribp_link(links, ls[i].in, ls[i].out, ls[i].tfd)) {
+			BLOGE("can't link %s to %s\n", ls[i].src, ls[i].dst);
+			ribp_links_destroy(links);
+			return NULL;
+		}
+		/* the links hold their own dups of the pipe ends made for rN */
+		if (ls[i].in >= LINK_FD_MIN)
+			close(ls[i].in);
+		if (ls[i].out >= LINK_FD_MIN)
+			close(ls[i].out);
+		if (ls[i].tfd >= LINK_FD_MIN)
+			close(ls[i].tfd);
+	}
+	return links;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* s as a json string: quotes, backslashes and control characters escaped */
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/* one json object per run, appended to path or written to stdout for "-" */
+static void batch_report(const char *path, const char *rom, const char *engine,
+	unsigned instances, int status, double secs)
+{
+	FILE *fp = strcmp(path, "-") ? fopen(path, "a") : stdout;
+
+	if (fp == NULL) {
+		perror(path);
+		return;
+	}
+
+	fputs("{\"rom\": ", fp);
+	json_string(fp, rom);
+	fputs(", \"engine\": ", fp);
+	json_string(fp, engine ? engine : "default");
+	fprintf(fp, ", \"instances\": %u, \"status\": %d, \"insns\": %llu, "
+		"\"seconds\": %.6f, \"mips\": %.2f}\n",
+		instances, status, (unsigned long long)retired,
+		secs, secs > 0 ? retired / secs / 1e6 : 0);
+
+	if (fp != stdout)
+		fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	int c, fd, status, eng = -1, trace = -1;
+	bool async = false;
+	struct ribp_links *links = NULL;
+	struct link_spec ls[MAX_LINKS];
+	unsigned nlinks = 0;
+	const char *romfile = "rom.bin", *stub = NULL, *engine = NULL, *report = NULL;
+	const char *cachedir = NULL, *key = NULL, *tracefile = NULL, *replay = NULL;
+	const char *logfile = NULL;
+	bool playback = false;
+	uint64_t cachelimit = CACHE_LIMIT;
+	unsigned memsize = 1024 * 400, flags = 0, instances = 1, workers = 0;
+	double start;
+
+	while (-1 != (c = getopt(argc, argv, "r:m:M:d:e:gn:j:f:b:al:c:C:k:t:T:L:P:"))) {
 		switch (c) {
 		case 'r':
 			romfile = optarg;
@@ -103,45 +751,195 @@ int main(int argc, char **argv)
 		case 'm':
 			memsize = strtoul(optarg, NULL, 0);
 		break;
+
+		/* pages are committed under the guard's SIGSEGV handler */
+		case 'M':
+			memlimit = strtoull(optarg, NULL, 0);
+			flags |= RISCV32_VM_GUARD;
+		break;
+
+		case 'e':
+			engine = optarg;
+		break;
+
+		case 'g':
+			flags |= RISCV32_VM_GUARD;
+		break;
+
+		case 'n':
+			instances = strtoul(optarg, NULL, 0);
+		break;
+
+		case 'j':
+			workers = strtoul(optarg, NULL, 0);
+		break;
+
+		case 'f':
+			fuel = strtoull(optarg, NULL, 0);
+		break;
+
+		case 'b':
+			report = optarg;
+		break;
+
+		case 'a':
+			async = true;
+		break;
+
+		case 'l':
+			if (nlinks == MAX_LINKS) {
+				BLOGE("at most %u links\n", MAX_LINKS);
+				return 1;
+			}
+			ls[nlinks].src = strtok(optarg, ":");
+			ls[nlinks].dst = strtok(NULL, ":");
+			ls[nlinks].tap = strtok(NULL, ":");
+			if (ls[nlinks].dst == NULL) {
+				BLOGE("-l SRC:DST[:TAP]\n");
+				return 1;
+			}
+			nlinks++;
+		break;
+
+		case 'c':
+			cachedir = optarg;
+		break;
+
+		case 'C':
+			cachelimit = strtoull(optarg, NULL, 0);
+		break;
+
+		case 'k':
+			key = optarg;
+		break;
+
+		case 't':
+			tracefile = optarg;
+		break;
+
+		case 'T':
+			replay = optarg;
+		break;
+
+		case 'L':
+		case 'P':
+			logfile = optarg;
+			playback = c == 'P';
+		break;
 		}
 	}
 
-	fd = open(romfile, O_RDONLY);
-	if (fd < 0) {
-		perror(romfile);
-		return 1;
+	if (engine != NULL) {
+		if (!strcmp(engine, "switch")) {
+			eng = RISCV32_ENGINE_SWITCH;
+		} else if (!strcmp(engine, "threaded")) {
+			eng = RISCV32_ENGINE_THREADED;
+		} else if (!strcmp(engine, "jit")) {
+			eng = RISCV32_ENGINE_JIT;
+		} else {
+			BLOGE("unknown engine %s\n", engine);
+			return 1;
+		}
 	}
 
-	vm = riscv32_vm(memsize + 8);
+	if (nlinks) {
+		links = make_links(ls, nlinks);
+		if (links == NULL)
+			return 1;
+	}
 
-	while (0 < (rn = read(fd, buf, sizeof(buf)))) {
-		riscv32_load_rom(vm, buf, rn, off);
-		off += rn;
+	if (cachedir != NULL) {
+		cache = ribp_cache_open(cachedir, cachelimit);
+		if (cache == NULL) {
+			perror(cachedir);
+			return 1;
+		}
 	}
+	image_memsize = memsize;
 
-	/* store hostapi */
-	off = (off + 3) & ~3;
-	riscv32_load_rom(vm, "\x73\x00\x00\x00\x67\x80\x00\x00", 8, off);
-	vm->cpu.pc = 0;
-	vm->cpu.sp = memsize;
-	vm->cpu.fp = memsize;
-	vm->cpu.a0 = off;
+	/* -k runs a cached image by its key, without the rom */
+	if (key != NULL) {
+		if (cache == NULL || ribp_cache_parse_key(key, image_key)) {
+			BLOGE("-k needs -c and a 64 digit sha256\n");
+			return 1;
+		}
+		romfile = key;
+		fd = -1;
+	} else {
+		fd = open(romfile, O_RDONLY);
+		if (fd < 0) {
+			perror(romfile);
+			return 1;
+		}
+		if (cache && ribp_cache_key(fd, image_key)) {
+			perror(romfile);
+			return 1;
+		}
+	}
 
-	close(fd);
+	if (replay != NULL) {
+		status = replay_vm(fd, memsize, flags, replay);
+		if (fd >= 0)
+			close(fd);
+		if (cache != NULL)
+			ribp_cache_close(cache);
+		return status;
+	}
 
-	if (stub != NULL) {
-		dfd = mkptms(stub, 0666);
+	/* many guests share the host cores; gdb only attaches to a single vm */
+	if ((instances > 1 || workers || async) && stub != NULL) {
+		BLOGE("-d needs a single vm\n");
+		return 1;
 	}
-	if (dfd >= 0)
-		debug_exception_handler(vm, false);
+	if ((instances > 1 || workers || async) && tracefile != NULL) {
+		BLOGE("-t needs a single vm\n");
+		return 1;
+	}
+	if ((instances > 1 || workers || async) && logfile != NULL) {
+		BLOGE("-L and -P need a single vm\n");
+		return 1;
+	}
+	if (logfile != NULL) {
+		int lfd = playback ? open(logfile, O_RDONLY | O_CLOEXEC) :
+			open(logfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 
-	while (1) {
-		if (debug || 0x03 == getDebugChar()) {
-			debug_exception_handler(vm, debug);
+		hostlog = lfd >= 0 ? hostapi_log_open(lfd, playback) : NULL;
+		hostlog_replay = playback;
+		if (lfd >= 0)
+			close(lfd);
+		if (hostlog == NULL) {
+			BLOGE("can't open the host call log %s\n", logfile);
+			return 1;
 		}
+	}
+	if (tracefile != NULL) {
+		trace = open(tracefile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (trace < 0) {
+			perror(tracefile);
+			return 1;
+		}
+	}
 
-		debug = riscv32_cpu_exec(vm);
+	start = now();
+	if (instances > 1 || workers || async)
+		status = run_sched(fd, memsize, flags, eng, instances, workers, async);
+	else
+		status = run_vm(fd, memsize, flags, eng, stub, trace);
+	if (fd >= 0)
+		close(fd);
+	if (trace >= 0)
+		close(trace);
+	if (hostlog != NULL && hostapi_log_close(hostlog)) {
+		BLOGE("the host call log %s is %s\n", logfile, playback ? "not this run's" : "incomplete");
+		if (status == 0)
+			status = 1;
 	}
+	if (cache != NULL)
+		ribp_cache_close(cache);
+	if (links != NULL)
+		ribp_links_destroy(links);
 
-	return 0;
+	if (report != NULL)
+		batch_report(report, romfile, engine, instances, status, now() - start);
+	return status;
 }
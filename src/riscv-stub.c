@@ -7,11 +7,58 @@
 
 extern void  putDebugChar(char c);
 extern char getDebugChar(void);	/* read and return a single char */
+extern void flushDebugChar(void);	/* send what putDebugChar buffered */
 
 /************************************************************************/
 /* BUFMAX defines the maximum number of characters in inbound/outbound buffers*/
 /* at least NUMREGBYTES*2 are needed for register packets */
-#define BUFMAX 1024
+#define BUFMAX 0x4000
+#define BUFMAX_HEX "4000"	/* for qSupported */
+
+/* registers in gdb's order: x0-x31 then pc */
+#define NUMREGS 33
+
+static const char target_xml[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<architecture>riscv:rv32</architecture>"
+	"<feature name=\"org.gnu.gdb.riscv.cpu\">"
+	"<reg name=\"zero\" bitsize=\"32\" type=\"int\" regnum=\"0\"/>"
+	"<reg name=\"ra\" bitsize=\"32\" type=\"code_ptr\"/>"
+	"<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"gp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"tp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"t0\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t1\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t2\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"fp\" bitsize=\"32\" type=\"data_ptr\"/>"
+	"<reg name=\"s1\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a0\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a1\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a2\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a3\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a4\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a5\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a6\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"a7\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s2\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s3\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s4\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s5\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s6\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s7\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s8\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s9\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s10\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"s11\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t3\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t4\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t5\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"t6\" bitsize=\"32\" type=\"int\"/>"
+	"<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+	"</feature>"
+	"</target>";
 static const char hexchars[]="0123456789abcdef";
 static int hex (unsigned char ch)
 {
@@ -26,6 +73,7 @@ static int hex (unsigned char ch)
 
 static char remcomInBuffer[BUFMAX];
 static char remcomOutBuffer[BUFMAX];
+static char *remcomInEnd;	/* of the packet getpacket returned, X data may hold NULs */
 
 /* scan for the sequence $<data>#<checksum>     */
 static char *getpacket (void)
@@ -58,6 +106,7 @@ retry:
 			count = count + 1;
 		}
 		buffer[count] = 0;
+		remcomInEnd = &buffer[count];
 
 		if (ch == '#') {
 			ch = getDebugChar ();
@@ -67,6 +116,7 @@ retry:
 
 			if (checksum != xmitcsum) {
 				putDebugChar ('-');	/* failed checksum */
+				flushDebugChar ();
 			} else {
 				putDebugChar ('+');	/* successful transfer */
 
@@ -74,10 +124,12 @@ retry:
 				if (buffer[2] == ':') {
 					putDebugChar (buffer[0]);
 					putDebugChar (buffer[1]);
+					flushDebugChar ();
 
 					return &buffer[3];
 				}
 
+				flushDebugChar ();
 				return &buffer[0];
 			}
 		}
@@ -106,6 +158,7 @@ static void putpacket (char *buffer)
 		putDebugChar('#');
 		putDebugChar(hexchars[checksum >> 4]);
 		putDebugChar(hexchars[checksum & 0xf]);
+		flushDebugChar();
 
 	} while (getDebugChar() != '+');
 }
@@ -164,6 +217,24 @@ static char * hex2mem (char *buf, char *mem, int count, int may_fault)
 	return mem;
 }
 
+/* binary data of an X packet, from buf up to end, with } escapes;
+ * return a pointer past the last byte written or 0 if buf runs short */
+static char *bin2mem (char *buf, char *end, char *mem, int count)
+{
+	while (count-- > 0) {
+		if (buf == end)
+			return 0;
+		if (*buf == 0x7d) {
+			if (++buf == end)
+				return 0;
+			*mem++ = *buf++ ^ 0x20;
+		} else {
+			*mem++ = *buf++;
+		}
+	}
+	return mem;
+}
+
 /*
  * While we find nice hex chars, build an int.
  * Return number of chars processed.
@@ -192,14 +263,77 @@ static int hexToInt(char **ptr, unsigned *intValue)
 
 /*
  * This function does all command procesing for interfacing to gdb.  It
- * returns 1 if you should skip the instruction at the trap address, 0
- * otherwise.
+ * returns 1 if the caller should run a single instruction and report
+ * back, 0 to continue.
  */
 
+/* Zt,addr,kind and zt,addr,kind: t 0 and 1 are breakpoints, 2 to 4 the
+ * write, read and access watchpoints */
+static const char *breakpoint(struct riscv32_vm *vm, char *ptr, bool insert)
+{
+	unsigned type, addr, length;
+
+	if (!hexToInt(&ptr, &type) || *ptr++ != ','
+		|| !hexToInt(&ptr, &addr) || *ptr++ != ','
+		|| !hexToInt(&ptr, &length))
+		return "E01";
+
+	switch (type) {
+	case 0:
+	case 1:
+		if (insert ? riscv32_break_insert(vm, addr) : riscv32_break_remove(vm, addr))
+			return "E03";
+	break;
+
+	case 2:
+	case 3:
+	case 4:
+		/* gdb numbers them write, read, access; the vm wants bits */
+		type = type == 2 ? RISCV32_WATCH_WRITE : type == 3 ? RISCV32_WATCH_READ :
+			RISCV32_WATCH_ACCESS;
+		if (insert ? riscv32_watch_insert(vm, addr, length, type) :
+				riscv32_watch_remove(vm, addr, length, type))
+			return "E03";
+	break;
+
+	default:
+		return "";
+	}
+	return "OK";
+}
+
+/* qXfer:features:read:target.xml:offset,length */
+static void features_read(char *ptr, char *out)
+{
+	unsigned offset, length, size = sizeof(target_xml) - 1;
+
+	if (strncmp(ptr, "target.xml:", 11)) {
+		strcpy(out, "E00");
+		return;
+	}
+	ptr += 11;
+	if (!hexToInt(&ptr, &offset) || *ptr++ != ',' || !hexToInt(&ptr, &length)) {
+		strcpy(out, "E01");
+		return;
+	}
+
+	if (offset > size)
+		offset = size;
+	if (length > size - offset)
+		length = size - offset;
+	if (length > BUFMAX - 2)
+		length = BUFMAX - 2;
+
+	/* m for a part, l for the last one */
+	*out++ = offset + length < size ? 'm' : 'l';
+	memcpy(out, target_xml + offset, length);
+	out[length] = 0;
+}
+
 #define REG_NUM(reg)	((offsetof(struct riscv32_cpu, reg) - offsetof(struct riscv32_cpu, zero)) >> 2)
-void debug_exception_handler (struct riscv32_vm *vm, bool intr)
+int debug_exception_handler (struct riscv32_vm *vm, bool intr)
 {
-	int sigval = 5;
+	int sigval = 5, step, watch, i;
 	unsigned addr;
 	unsigned length;
 	char *ptr;
@@ -229,6 +363,16 @@ void debug_exception_handler (struct riscv32_vm *vm, bool intr)
 	ptr = mem2hex((char *)(intr ? &c->mepc : &c->pc), ptr, 4, 0);
 	*ptr++ = ';';
 
+	watch = riscv32_debug_hit(vm, &addr);
+	if (watch) {
+		strcpy(ptr, watch == RISCV32_WATCH_WRITE ? "watch:" :
+			watch == RISCV32_WATCH_READ ? "rwatch:" : "awatch:");
+		ptr += strlen(ptr);
+		for (i = 28; i >= 0; i -= 4)
+			*ptr++ = hexchars[(addr >> i) & 0xf];
+		*ptr++ = ';';
+	}
+
 	*ptr++ = 0;
 
 	putpacket(remcomOutBuffer);
@@ -246,20 +390,21 @@ void debug_exception_handler (struct riscv32_vm *vm, bool intr)
 		break;
 
 		case 'q':
-			switch (*ptr++) {
-			case 'S':
-				switch(*ptr++) {
-				case 'u':
-					strcpy(remcomOutBuffer, "PacketSize=1024");
-				break;
-				case 'y':
-					strcpy(remcomOutBuffer, "OK");
-				break;
-				}
-			break;
-			//case 'O':	/*Offset*/
-			//	strcpy(remcomOutBuffer, "Text=0;Data=0;Bss=0;");
-			//break;
+			if (!strncmp(ptr, "Supported", 9))
+				strcpy(remcomOutBuffer, "PacketSize=" BUFMAX_HEX
+					";qXfer:features:read+;vContSupported+");
+			else if (!strncmp(ptr, "Symbol", 6))
+				strcpy(remcomOutBuffer, "OK");
+			else if (!strncmp(ptr, "Xfer:features:read:", 19))
+				features_read(ptr + 19, remcomOutBuffer);
+		break;
+
+		case 'v':
+			if (!strncmp(ptr, "Cont?", 5)) {
+				strcpy(remcomOutBuffer, "vCont;c;C;s;S");
+			} else if (!strncmp(ptr, "Cont;", 5)) {
+				/* one thread: the first action is the one for it */
+				return ptr[5] == 's' || ptr[5] == 'S';
 			}
 		break;
 
@@ -272,14 +417,38 @@ void debug_exception_handler (struct riscv32_vm *vm, bool intr)
 
 		/* return the value of the CPU registers */
 		case 'g': {
-			mem2hex((void*)&c->zero, remcomOutBuffer, 33 * 4, 0);
+			mem2hex((void*)&c->zero, remcomOutBuffer, NUMREGS * 4, 0);
 		}
 		break;
 
 		/* set the value of the CPU registers - return OK */
-		case 'G': {
-			strcpy(remcomOutBuffer,"OK");
-		}
+		case 'G':
+			if (strlen(ptr) < NUMREGS * 8) {
+				strcpy(remcomOutBuffer, "E01");
+				break;
+			}
+			hex2mem(ptr, (char *)&c->zero, NUMREGS * 4, 0);
+			c->zero = 0;
+			strcpy(remcomOutBuffer, "OK");
+		break;
+
+		case 'p':	/* pNN  Read register NN */
+			if (hexToInt(&ptr, &addr) && addr < NUMREGS)
+				mem2hex((char *)(&c->zero + addr), remcomOutBuffer, 4, 0);
+			else
+				strcpy(remcomOutBuffer, "E01");
+		break;
+
+		case 'P':	/* PNN=VV  Write register NN */
+			if (hexToInt(&ptr, &addr) && addr < NUMREGS && *ptr++ == '='
+				&& strlen(ptr) >= 8)
+			{
+				hex2mem(ptr, (char *)(&c->zero + addr), 4, 0);
+				c->zero = 0;
+				strcpy(remcomOutBuffer, "OK");
+			}
+			else
+				strcpy(remcomOutBuffer, "E01");
 		break;
 
 		case 'm':	  /* mAA..AA,LLLL  Read LLLL bytes at address AA..AA */
@@ -287,7 +456,8 @@ void debug_exception_handler (struct riscv32_vm *vm, bool intr)
 
 			if (hexToInt(&ptr, &addr)
 				&& *ptr++ == ','
-				&& hexToInt(&ptr, &length))
+				&& hexToInt(&ptr, &length)
+				&& length < BUFMAX / 2)
 			{
 				void *mem = riscv32_mem_map(vm, addr, length);
 				if (mem && mem2hex(mem, remcomOutBuffer, length, 1))
@@ -318,10 +488,37 @@ void debug_exception_handler (struct riscv32_vm *vm, bool intr)
 				strcpy(remcomOutBuffer, "E02");
 		break;
 
+		case 'X': /* XAA..AA,LLLL:bin  Write LLLL binary bytes at address AA..AA */
+			if (hexToInt(&ptr, &addr)
+				&& *ptr++ == ','
+				&& hexToInt(&ptr, &length)
+				&& *ptr++ == ':')
+			{
+				/* length 0 is gdb asking whether X works */
+				void *mem = length ? riscv32_mem_map(vm, addr, length) : remcomOutBuffer;
+
+				if (mem && bin2mem(ptr, remcomInEnd, mem, length))
+					strcpy(remcomOutBuffer, "OK");
+				else
+					strcpy(remcomOutBuffer, "E03");
+			}
+			else
+				strcpy(remcomOutBuffer, "E02");
+		break;
+
+		case 'Z':
+		case 'z':
+			strcpy(remcomOutBuffer, breakpoint(vm, ptr, ptr[-1] == 'Z'));
+		break;
+
 		case 'c':    /* cAA..AA    Continue at address AA..AA(optional) */
+		case 's':    /* sAA..AA    Step one instruction from AA..AA(optional) */
+			step = ptr[-1] == 's';
 			/* try to read optional parameter, pc unchanged if no parm */
+			if (hexToInt(&ptr, &addr))
+				c->pc = addr;
 
-			return;
+			return step;
 
 			/* kill the program */
 		case 'k' :		/* do nothing */
@@ -0,0 +1,22 @@
+/*************************************************
+ * Anthor  : LuoZhongYao@gmail.com
+ * Modified: 2026/10/17
+ ************************************************/
+#ifndef __SHA256_H__
+#define __SHA256_H__
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE	32
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+};
+
+void sha256_init(struct sha256 *s);
+void sha256_update(struct sha256 *s, const void *data, size_t size);
+void sha256_final(struct sha256 *s, uint8_t digest[SHA256_SIZE]);
+
+#endif /* __SHA256_H__*/